@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Collects a request body that may arrive in several TCP segments into one malloc'd block. The
+ * block is hung off `slot`, the request's `_tempObject`, which AsyncWebServerRequest releases
+ * with free() when it is destroyed. Bodies over the limit are refused up front instead of being
+ * buffered.
+ *
+ * Nothing here knows about the web server, so the same code runs in the host test.
+ */
+namespace body_buffer {
+  const size_t maxSize = 4096;
+
+  struct body_t
+  {
+    size_t total;
+    size_t received;
+    bool tooLarge;
+    char data[];
+  };
+
+  /**
+   * Adds one segment of a body of `total` bytes. A segment at `index` 0 starts a new body,
+   * segments that don't continue where the previous one ended or run past `total` are dropped,
+   * which leaves the body incomplete.
+   */
+  inline void accumulate(void*& slot, size_t limit, const uint8_t* data, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+      free(slot);
+      bool tooLarge = total > limit;
+      body_t* body = static_cast<body_t*>(malloc(sizeof(body_t) + (tooLarge ? 0 : total)));
+      slot = body;
+      if (!body) return;
+      body->total = total;
+      body->received = 0;
+      body->tooLarge = tooLarge;
+    }
+    body_t* body = static_cast<body_t*>(slot);
+    if (!body || body->tooLarge || index != body->received || index + len > body->total) return;
+    if (len) memcpy(body->data + index, data, len);
+    body->received += len;
+  }
+
+  // Returns the body once it has been received completely, nullptr otherwise
+  inline const body_t* complete(void* slot) {
+    body_t* body = static_cast<body_t*>(slot);
+    if (!body || body->tooLarge || body->received != body->total) return nullptr;
+    return body;
+  }
+
+  inline bool tooLarge(void* slot, size_t contentLength, size_t limit) {
+    return contentLength > limit || (slot && static_cast<body_t*>(slot)->tooLarge);
+  }
+}
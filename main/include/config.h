@@ -1,3 +1,4 @@
+#pragma once
 enum HK_COLOR
 {
   TAN,
@@ -46,6 +47,10 @@ enum class gpioMomentaryStateStatus : uint8_t
 #define MQTT_CLIENTID "" //client-id to connect to mqtt broker
 #define MQTT_USERNAME ""  //username to connect to mqtt broker
 #define MQTT_PASSWORD ""  //password to connect to mqtt broker
+#define MQTT_TLS_ENABLED false //Connect to the broker over TLS (MQTTS), usually on port 8883
+#define MQTT_PSK_IDENTITY "" //PSK identity (hint), when set TLS uses the pre-shared key instead of certificates
+#define MQTT_PSK_KEY "" //Pre-shared key in hex format
+#define MQTT_CA_CERT_PATH "/mqtt_ca.pem" //LittleFS path of the PEM CA certificate used to verify the broker
 
 //MQTT Flags
 #define MQTT_CUSTOM_STATE_ENABLED 0 // Flag to enable the use of custom states and relevant MQTT Topics
@@ -62,6 +67,9 @@ enum class gpioMomentaryStateStatus : uint8_t
 #define MQTT_STATE_TOPIC "homekit/state" // MQTT Topic for publishing the HomeKit lock target state
 #define MQTT_PROX_BAT_TOPIC "homekit/set_battery_lvl" // MQTT Topic for publishing the HomeKit lock target state
 #define MQTT_HK_ALT_ACTION_TOPIC "alt_action" // MQTT Topic for publishing the Alt Action
+#define MQTT_TELEMETRY_TOPIC "telemetry" // MQTT Topic for publishing the periodic device health telemetry
+#define MQTT_TELEMETRY_INTERVAL 60 // Interval in seconds between telemetry publishes, 0 to disable
+#define MQTT_DOORBELL_TOPIC "doorbell" // MQTT Topic for publishing doorbell presses (single, double or long)
 
 // Miscellaneous
 #define HOMEKEY_COLOR TAN
@@ -83,6 +91,12 @@ enum class gpioMomentaryStateStatus : uint8_t
 #define NEOPIXEL_FAIL_B 0 // Color value for Blue - Fail HK Auth
 #define NEOPIXEL_SUCCESS_TIME 1000 // GPIO Delay time in ms - Success HK Auth
 #define NEOPIXEL_FAIL_TIME 1000 // GPIO Delay time in ms - Success HK Auth
+#define NEOPIXEL_BUSY_R 0 // Color value for Red - Reader busy with a tap
+#define NEOPIXEL_BUSY_G 0 // Color value for Green - Reader busy with a tap
+#define NEOPIXEL_BUSY_B 255 // Color value for Blue - Reader busy with a tap
+#define NEOPIXEL_RECONNECT_R 255 // Color value for Red - Reconnecting to the PN532
+#define NEOPIXEL_RECONNECT_G 120 // Color value for Green - Reconnecting to the PN532
+#define NEOPIXEL_RECONNECT_B 0 // Color value for Blue - Reconnecting to the PN532
 #define NFC_SUCCESS_PIN 255 // GPIO Pin pulled HIGH or LOW (see NFC_SUCCESS_HL) on success HK Auth
 #define NFC_SUCCESS_HL HIGH // Flag to define if NFC_SUCCESS_PIN should be held High or Low
 #define NFC_SUCCESS_TIME 1000 // How long should NFC_SUCCESS_PIN be held High or Low
@@ -100,8 +114,22 @@ enum class gpioMomentaryStateStatus : uint8_t
 #define GPIO_HK_ALT_ACTION_PIN 255
 #define GPIO_HK_ALT_ACTION_TIMEOUT 5000
 #define GPIO_HK_ALT_ACTION_GPIO_STATE HIGH
+#define GPIO_DOORBELL_PIN 10 // GPIO Pin of the doorbell button (active LOW), 255 to disable. 10 was the fixed pin before it was configurable
+
+// LAN Events
+#define LAN_EVENT_GROUP "" // Multicast group for the binary LAN event datagrams (e.g. 239.255.42.1), empty to disable
+#define LAN_EVENT_PORT 42420 // UDP port for the LAN event datagrams
+#define LAN_EVENT_KEY "" // Shared key used to sign the LAN event datagrams (HMAC-SHA256), LAN events stay off while empty
+
+// Task placement, ignored on single-core targets (ESP32-C3/C6) where every task runs unpinned
+#define TASK_CORE_NFC 1 // Core for NFC polling, HomeKey authentication and the actuators (1 = APP core, -1 = any)
+#define TASK_CORE_NETWORK 0 // Core for LAN events, web jobs and telemetry, next to WiFi, lwIP, AsyncTCP and MQTT (0 = PRO core, -1 = any)
+#define TASK_PRIORITY_NFC 3 // Priority of the NFC polling task, above HomeSpan's loop (1)
 
 // WebUI
 #define WEB_AUTH_ENABLED false
 #define WEB_AUTH_USERNAME "admin"
-#define WEB_AUTH_PASSWORD "password"
\ No newline at end of file
+#define WEB_AUTH_PASSWORD "password"
+#define WEB_API_TOKEN "" // Bearer token for the local lock API (POST /lock), empty to disable it
+#define WEB_MAX_CONNECTIONS 8 // Concurrent web connections accepted (one request each), keeps TCP connections free for HomeKit and MQTT
+#define WEB_MAX_CONNECTIONS_PER_CLIENT 6 // Concurrent web connections accepted from a single address
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Fixed-capacity publish/subscribe bus. Every subscriber owns a ring of `Capacity` events and a
+ * mask of the topics it wants, `publish` copies the event into the ring of each matching
+ * subscriber and calls its wake hook, so an event costs one copy per subscriber and no heap.
+ * When a ring is full the new event is dropped for that subscriber only and counted.
+ *
+ * `Event` needs a `topic` member below 32. `Lock` provides `lock()`/`unlock()` and guards one
+ * ring, a portMUX critical section on the device and a mutex on the host.
+ */
+namespace event_bus {
+  template <typename Event, typename Lock, size_t MaxSubscribers, size_t Capacity>
+  class Bus {
+  public:
+    struct stats_t {
+      const char* name;
+      uint32_t received;
+      uint32_t dropped;
+      uint32_t highWater; // Most events waiting in the ring at once
+    };
+
+    /**
+     * Adds a subscriber, safe while events are published but not concurrently with another
+     * `subscribe`.
+     *
+     * @param topics Bit mask of the topics to receive
+     * @param wake Called after an event was put into the ring, from the publishing task
+     * @return The subscriber id, -1 if all slots are taken
+     */
+    int subscribe(const char* name, uint32_t topics, void (*wake)(void* arg) = nullptr, void* arg = nullptr) {
+      size_t id = count.load(std::memory_order_relaxed);
+      if (id >= MaxSubscribers) return -1;
+      subscriber_t& sub = subscribers[id];
+      sub.name = name;
+      sub.topics = topics;
+      sub.wake = wake;
+      sub.arg = arg;
+      count.store(id + 1, std::memory_order_release);
+      return id;
+    }
+
+    /** @return The number of subscribers that had to drop the event */
+    size_t publish(const Event& event) {
+      size_t drops = 0;
+      const uint32_t bit = 1u << event.topic;
+      const size_t n = count.load(std::memory_order_acquire);
+      for (size_t i = 0; i < n; i++) {
+        subscriber_t& sub = subscribers[i];
+        if (!(sub.topics & bit)) continue;
+        bool stored = false;
+        sub.lock.lock();
+        if (sub.waiting < Capacity) {
+          sub.ring[(sub.head + sub.waiting) % Capacity] = event;
+          sub.waiting++;
+          sub.received++;
+          if (sub.waiting > sub.highWater) sub.highWater = sub.waiting;
+          stored = true;
+        } else {
+          sub.dropped++;
+        }
+        sub.lock.unlock();
+        if (!stored) {
+          drops++;
+        } else if (sub.wake) {
+          sub.wake(sub.arg);
+        }
+      }
+      return drops;
+    }
+
+    /** Takes the oldest event of subscriber `id`, @return false if its ring is empty */
+    bool receive(int id, Event& event) {
+      subscriber_t& sub = subscribers[id];
+      sub.lock.lock();
+      if (sub.waiting == 0) {
+        sub.lock.unlock();
+        return false;
+      }
+      event = sub.ring[sub.head];
+      sub.head = (sub.head + 1) % Capacity;
+      sub.waiting--;
+      sub.lock.unlock();
+      return true;
+    }
+
+    size_t subscriberCount() const {
+      return count.load(std::memory_order_acquire);
+    }
+
+    stats_t stats(int id) {
+      subscriber_t& sub = subscribers[id];
+      sub.lock.lock();
+      stats_t stats{ sub.name, sub.received, sub.dropped, sub.highWater };
+      sub.lock.unlock();
+      return stats;
+    }
+
+  private:
+    struct subscriber_t {
+      const char* name = nullptr;
+      uint32_t topics = 0;
+      void (*wake)(void* arg) = nullptr;
+      void* arg = nullptr;
+      Lock lock;
+      std::array<Event, Capacity> ring{};
+      size_t head = 0;
+      size_t waiting = 0;
+      uint32_t received = 0;
+      uint32_t dropped = 0;
+      uint32_t highWater = 0;
+    };
+
+    std::array<subscriber_t, MaxSubscribers> subscribers{};
+    std::atomic<size_t> count{ 0 };
+  };
+}
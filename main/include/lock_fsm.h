@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include "config.h"
+
+struct gpioLockAction
+{
+  enum
+  {
+    HOMEKIT = 1,
+    HOMEKEY = 2,
+    OTHER = 3
+  };
+};
+
+/**
+ * Lock state logic shared by every path that changes the lock: HomeKit, HomeKey taps, the MQTT
+ * command topics, the HTTP API and the actuator reporting what the lock GPIO did. A path only
+ * names its source and the event, `handle` looks the actions up in `transitions` and runs them
+ * in a fixed order against three sinks, so the same table runs on the device and in the host
+ * test:
+ *
+ *   Characteristics  int current(), int target(), void setCurrent(int), void setTarget(int)
+ *   Mqtt             void state(int) publishes the lock state, void custom(int) the custom lock action
+ *   Actuator         bool controls() if the lock output follows commands,
+ *                    bool lock(uint8_t source, int state) queues the change, false if it couldn't
+ */
+namespace lock_fsm {
+  enum source_t : uint8_t { HOMEKIT, HOMEKEY, HTTP, MQTT, MQTT_CUSTOM, ACTUATOR, SOURCE_COUNT };
+  /** Commands ask the lock to move, reports tell where it is. CMD_TOGGLE is resolved to CMD_LOCK/CMD_UNLOCK before the lookup */
+  enum event_t : uint8_t { CMD_UNLOCK, CMD_LOCK, IS_UNLOCKED, IS_LOCKED, IS_JAMMED, IS_UNKNOWN, EVENT_COUNT, CMD_TOGGLE };
+  enum action_t : uint8_t
+  {
+    NONE = 0,
+    SET_TARGET = 1 << 0,  // Set lockTargetState to the commanded state
+    ACTUATE = 1 << 1,     // Queue the lock pin change if the GPIO controls the lock
+    PENDING = 1 << 2,     // Report UNLOCKING/LOCKING, skipped if ACTUATE queued since the actuator reports the result
+    CUSTOM = 1 << 3,      // Publish the custom lock action for an external controller
+    SET_CURRENT = 1 << 4  // Report the lock as being in the reported state
+  };
+  constexpr uint8_t COMMAND = SET_TARGET | ACTUATE | PENDING | CUSTOM;
+
+  constexpr uint8_t transitions[SOURCE_COUNT][EVENT_COUNT] = {
+    /*                 CMD_UNLOCK              CMD_LOCK                IS_UNLOCKED               IS_LOCKED                 IS_JAMMED    IS_UNKNOWN */
+    /* HOMEKIT */     { COMMAND & ~SET_TARGET, COMMAND & ~SET_TARGET,  NONE,                     NONE,                     NONE,        NONE },
+    /* HOMEKEY */     { COMMAND,               COMMAND,                NONE,                     NONE,                     NONE,        NONE },
+    /* HTTP */        { COMMAND,               COMMAND,                NONE,                     NONE,                     NONE,        NONE },
+    /* MQTT */        { COMMAND,               COMMAND,                SET_CURRENT,              SET_CURRENT,              SET_CURRENT, SET_CURRENT },
+    /* MQTT_CUSTOM */ { SET_TARGET | PENDING,  SET_TARGET | PENDING,   SET_CURRENT,              SET_CURRENT,              SET_CURRENT, SET_CURRENT },
+    /* ACTUATOR */    { NONE,                  NONE,                   SET_TARGET | SET_CURRENT, SET_TARGET | SET_CURRENT, NONE,        NONE },
+  };
+  // Source handed to the actuator for the momentary setting, MQTT commands count as HomeKit and the HTTP API as other
+  constexpr uint8_t momentarySource[SOURCE_COUNT] = { gpioLockAction::HOMEKIT, gpioLockAction::HOMEKEY, gpioLockAction::OTHER, gpioLockAction::HOMEKIT, gpioLockAction::HOMEKIT, gpioLockAction::OTHER };
+  constexpr int eventState[EVENT_COUNT] = { lockStates::UNLOCKED, lockStates::LOCKED, lockStates::UNLOCKED, lockStates::LOCKED, lockStates::JAMMED, lockStates::UNKNOWN };
+
+  enum result_t : uint8_t { IGNORED, HANDLED, QUEUED };
+
+  /** @return The command for a lock state, EVENT_COUNT if it can't be commanded */
+  inline event_t commandOf(int state) {
+    return state == lockStates::UNLOCKED ? CMD_UNLOCK : state == lockStates::LOCKED ? CMD_LOCK : EVENT_COUNT;
+  }
+
+  /** @return The report for a lock state, EVENT_COUNT if it can't be reported */
+  inline event_t reportOf(int state) {
+    switch (state) {
+    case lockStates::UNLOCKED: return IS_UNLOCKED;
+    case lockStates::LOCKED: return IS_LOCKED;
+    case lockStates::JAMMED: return IS_JAMMED;
+    case lockStates::UNKNOWN: return IS_UNKNOWN;
+    default: return EVENT_COUNT;
+    }
+  }
+
+  template <typename Characteristics, typename Mqtt>
+  void setCurrent(Characteristics& hk, Mqtt& mqtt, int state) {
+    if (hk.current() != state) {
+      hk.setCurrent(state);
+    }
+    mqtt.state(state);
+  }
+
+  /**
+   * Runs the actions for `event` coming from `source`.
+   *
+   * @return IGNORED if the event has no transition, QUEUED if a lock pin change was queued
+   */
+  template <typename Characteristics, typename Mqtt, typename Actuator>
+  result_t handle(Characteristics& hk, Mqtt& mqtt, Actuator& actuator, source_t source, event_t event) {
+    if (event == CMD_TOGGLE) {
+      event = hk.current() == lockStates::LOCKED ? CMD_UNLOCK : CMD_LOCK;
+    }
+    if (source >= SOURCE_COUNT || event >= EVENT_COUNT || transitions[source][event] == NONE) {
+      return IGNORED;
+    }
+    const uint8_t actions = transitions[source][event];
+    const int state = eventState[event];
+    bool queued = false;
+    if ((actions & SET_TARGET) && hk.target() != state) {
+      hk.setTarget(state);
+    }
+    if ((actions & ACTUATE) && actuator.controls()) {
+      queued = actuator.lock(momentarySource[source], state);
+    }
+    if ((actions & PENDING) && !queued) {
+      setCurrent(hk, mqtt, state == lockStates::UNLOCKED ? lockStates::UNLOCKING : lockStates::LOCKING);
+    }
+    if (actions & CUSTOM) {
+      mqtt.custom(state);
+    }
+    if (actions & SET_CURRENT) {
+      setCurrent(hk, mqtt, state);
+    }
+    return queued ? QUEUED : HANDLED;
+  }
+}
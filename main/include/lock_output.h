@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * State machine of the lock output, driven by the actuator task. A slot has at most one pending
+ * deadline, `phase` tells what it is for:
+ *
+ *   STARTUP --timeout--> IDLE                 pin set from the restored current state
+ *   STARTUP --action---> IDLE + action        start-up alignment dropped
+ *   IDLE --unlock, momentary source--> HOLD   pin to unlock level, UNLOCKED
+ *   IDLE --lock/unlock---------------> IDLE   pin to target level, target state
+ *   HOLD --unlock, momentary source--> HOLD   hold restarted, nothing reported
+ *   HOLD --unlock--------------------> IDLE   hold cancelled, stays unlocked, nothing reported
+ *   HOLD --lock----------------------> IDLE   hold cancelled, pin to lock level, LOCKED
+ *   HOLD --timeout-------------------> IDLE   pin back to lock level, LOCKED
+ *
+ * Without a pin (255) nothing runs, except in dumb switch mode where every action is reported
+ * back as reached. `Io` is the GPIO and clock on the device and a fake on the host:
+ *
+ *   config_t config()                        current settings, read on every call
+ *   int64_t now()                            time in us
+ *   void write(uint8_t pin, uint8_t level)   sets the lock pin
+ *   void report(bool locked)                 tells lock_fsm where the lock is now
+ *   bool restore()                           aligns the HomeKit state at start-up, true if it is LOCKED
+ */
+namespace lock_output {
+  enum phase_t : uint8_t { LOCK_IDLE, LOCK_STARTUP, LOCK_HOLD };
+
+  struct config_t
+  {
+    uint8_t pin; // 255 when the lock pin is disabled
+    uint8_t lockLevel;
+    uint8_t unlockLevel;
+    uint8_t momentarySources; // `gpioLockAction` sources whose unlock is momentary, as a mask
+    uint16_t holdMs;
+    bool dumbSwitch;
+  };
+
+  // Time for the HomeSpan characteristics to be ready before the pin is set at start-up
+  constexpr uint32_t startupMs = 1500;
+
+  template <typename Io>
+  class Machine {
+  public:
+    explicit Machine(Io& io) : io(io) {}
+
+    phase_t phase() const { return phase_; }
+    /** @return When `timeout` is due, 0 if nothing is pending */
+    int64_t deadline() const { return deadline_; }
+
+    void start() {
+      phase_ = LOCK_STARTUP;
+      deadline_ = io.now() + (int64_t)startupMs * 1000;
+    }
+
+    void timeout() {
+      const config_t cfg = io.config();
+      phase_t phase = phase_;
+      idle();
+      if (cfg.pin == 255) return;
+      if (phase == LOCK_STARTUP) {
+        bool locked = io.restore();
+        io.write(cfg.pin, locked ? cfg.lockLevel : cfg.unlockLevel);
+      } else if (phase == LOCK_HOLD) {
+        relock(cfg);
+      }
+    }
+
+    /**
+     * @param source A `gpioLockAction` source, checked against the momentary setting
+     * @return true if the pin was written
+     */
+    bool action(uint8_t source, bool unlock) {
+      const config_t cfg = io.config();
+      if (cfg.pin == 255 && !cfg.dumbSwitch) return false;
+      const bool momentary = unlock && (cfg.momentarySources & source);
+      if (phase_ == LOCK_STARTUP) {
+        // The action sets the pin itself
+        idle();
+      }
+      if (cfg.pin == 255) {
+        // Dumb switch mode without a pin, the HomeKit state just follows the target
+        io.report(!unlock);
+        return false;
+      }
+      if (phase_ == LOCK_HOLD) {
+        if (momentary) {
+          hold(cfg);
+          return false;
+        }
+        idle();
+        if (unlock) return false;
+        relock(cfg);
+        return true;
+      }
+      // The pin write is immediate, so no UNLOCKING/LOCKING is reported in between
+      io.write(cfg.pin, unlock ? cfg.unlockLevel : cfg.lockLevel);
+      io.report(!unlock);
+      if (momentary) {
+        phase_ = LOCK_HOLD;
+        hold(cfg);
+      }
+      return true;
+    }
+
+  private:
+    void idle() {
+      phase_ = LOCK_IDLE;
+      deadline_ = 0;
+    }
+
+    void hold(const config_t& cfg) {
+      deadline_ = io.now() + (int64_t)cfg.holdMs * 1000;
+    }
+
+    void relock(const config_t& cfg) {
+      io.write(cfg.pin, cfg.lockLevel);
+      io.report(true);
+    }
+
+    Io& io;
+    phase_t phase_ = LOCK_IDLE;
+    int64_t deadline_ = 0;
+  };
+}
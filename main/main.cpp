@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdarg>
 #include <cstdint>
 #include <memory>
+#include <set>
 #define JSON_NOEXCEPTION 1
 #include <sodium/crypto_sign.h>
 #include <sodium/crypto_box.h>
+#include <sodium/crypto_secretstream_xchacha20poly1305.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
 #include "HAP.h"
 #include "hkAuthContext.h"
 #include "HomeKey.h"
@@ -16,28 +24,53 @@
 #include "LittleFS.h"
 #include "HK_HomeKit.h"
 #include "config.h"
+#include "event_bus.h"
+#include "body_buffer.h"
+#include "lock_output.h"
+#include "lock_fsm.h"
 #include "mqtt_client.h"
+#include "esp_crt_bundle.h"
 #include "esp_app_desc.h"
 #include "pins_arduino.h"
 #include "NFC_SERV_CHARS.h"
 #include <mbedtls/sha256.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+#include <lwip/sockets.h>
 #include <esp_mac.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <soc/soc_caps.h>
+#if SOC_GPIO_SUPPORT_PIN_GLITCH_FILTER
+#include <driver/gpio_filter.h>
+#endif
 #include <freertos/semphr.h>
 
 const char* TAG = "MAIN";
 
-AsyncWebServer webServer(80);
+namespace web_admission {
+  void accept(AsyncWebServer* server, AsyncClient* client);
+}
+
+// AsyncWebServer whose connections pass web_admission as they are accepted, before a request is allocated
+class AdmittingWebServer : public AsyncWebServer
+{
+public:
+  AdmittingWebServer(uint16_t port) : AsyncWebServer(port) {
+    _server.onClient([](void* server, AsyncClient* client) { web_admission::accept((AsyncWebServer*)server, client); }, this);
+  }
+};
+
+AdmittingWebServer webServer(80);
 PN532_SPI *pn532spi;
 PN532 *nfc;
-QueueHandle_t gpio_led_handle = nullptr;
-QueueHandle_t neopixel_handle = nullptr;
-QueueHandle_t gpio_lock_handle = nullptr;
-TaskHandle_t gpio_led_task_handle = nullptr;
-TaskHandle_t neopixel_task_handle = nullptr;
-TaskHandle_t gpio_lock_task_handle = nullptr;
-TaskHandle_t alt_action_task_handle = nullptr;
 TaskHandle_t nfc_reconnect_task = nullptr;
 TaskHandle_t nfc_poll_task = nullptr;
+TaskHandle_t telemetry_task_handle = nullptr;
+std::atomic<uint32_t> nfcLoopCount{ 0 };
+std::atomic<uint32_t> pn532ReconnectCount{ 0 };
 
 struct DoorbellSensor;
 extern DoorbellSensor* homekit_doorbell;
@@ -48,17 +81,6 @@ readerData_t readerData;
 uint8_t ecpData[18] = { 0x6A, 0x2, 0xCB, 0x2, 0x6, 0x2, 0x11, 0x0 };
 const std::array<std::array<uint8_t, 6>, 4> hk_color_vals = { {{0x01,0x04,0xce,0xd5,0xda,0x00}, {0x01,0x04,0xaa,0xd6,0xec,0x00}, {0x01,0x04,0xe3,0xe3,0xe3,0x00}, {0x01,0x04,0x00,0x00,0x00,0x00}} };
 const std::array<const char*, 6> pixelTypeMap = { "RGB", "RBG", "BRG", "BGR", "GBR", "GRB" };
-struct gpioLockAction
-{
-  enum
-  {
-    HOMEKIT = 1,
-    HOMEKEY = 2,
-    OTHER = 3
-  };
-  uint8_t source;
-  uint8_t action;
-};
 
 struct DoorbellSensor : Service::StatelessProgrammableSwitch {
 
@@ -91,14 +113,11 @@ struct DoorbellSensor : Service::StatelessProgrammableSwitch {
         LOG(I, "DoorbellSensor Service configured with Index %d", switchIndex);
     }
 
-    // This method will be called by our ESP32 code when the physical doorbell is pressed.
-    void triggerHomeKitEvent() {
+    // Called by the doorbell button handler with SINGLE_PRESS (0), DOUBLE_PRESS (1) or LONG_PRESS (2).
+    void triggerHomeKitEvent(uint8_t event) {
         if (switchEvent) {
-            LOG(I, "HomeKit: Triggering Doorbell SINGLE_PRESS event.");
-            // Set the value to SINGLE_PRESS (0).
-            // Other values are DOUBLE_PRESS (1) and LONG_PRESS (2),
-            // but SINGLE_PRESS is most appropriate for a standard doorbell.
-            switchEvent->setVal(Characteristic::ProgrammableSwitchEvent::SINGLE_PRESS);
+            LOG(I, "HomeKit: Triggering Doorbell event %d.", event);
+            switchEvent->setVal(event);
 
             // Note: StatelessProgrammableSwitch events are "momentary".
             // HomeKit controllers expect the value to be set and then effectively clear.
@@ -225,6 +244,8 @@ namespace espConfig
       lockCustomStateCmd.append(id).append("/" MQTT_CUSTOM_STATE_CTRL_TOPIC);
       btrLvlCmdTopic.append(id).append("/" MQTT_PROX_BAT_TOPIC);
       hkAltActionTopic.append(id).append("/" MQTT_HK_ALT_ACTION_TOPIC);
+      telemetryTopic.append(id).append("/" MQTT_TELEMETRY_TOPIC);
+      doorbellTopic.append(id).append("/" MQTT_DOORBELL_TOPIC);
     }
     /* MQTT Broker */
     std::string mqttBroker = MQTT_HOST;
@@ -232,6 +253,10 @@ namespace espConfig
     std::string mqttUsername = MQTT_USERNAME;
     std::string mqttPassword = MQTT_PASSWORD;
     std::string mqttClientId;
+    /* MQTT TLS */
+    bool mqttTlsEnabled = MQTT_TLS_ENABLED;
+    std::string mqttPskIdentity = MQTT_PSK_IDENTITY;
+    std::string mqttPskKey = MQTT_PSK_KEY;
     /* MQTT Topics */
     std::string lwtTopic;
     std::string hkTopic;
@@ -241,6 +266,8 @@ namespace espConfig
     std::string lockTStateCmd;
     std::string btrLvlCmdTopic;
     std::string hkAltActionTopic;
+    std::string telemetryTopic;
+    std::string doorbellTopic;
     /* MQTT Custom State */
     std::string lockCustomStateTopic;
     std::string lockCustomStateCmd;
@@ -248,11 +275,13 @@ namespace espConfig
     bool lockEnableCustomState = MQTT_CUSTOM_STATE_ENABLED;
     bool hassMqttDiscoveryEnabled = MQTT_DISCOVERY;
     bool nfcTagNoPublish = false;
+    uint16_t telemetryInterval = MQTT_TELEMETRY_INTERVAL;
     std::map<std::string, int> customLockStates = { {"C_LOCKED", C_LOCKED}, {"C_UNLOCKING", C_UNLOCKING}, {"C_UNLOCKED", C_UNLOCKED}, {"C_LOCKING", C_LOCKING}, {"C_JAMMED", C_JAMMED}, {"C_UNKNOWN", C_UNKNOWN} };
     std::map<std::string, int> customLockActions = { {"UNLOCK", UNLOCK}, {"LOCK", LOCK} };
     NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(espConfig::mqttConfig_t, mqttBroker, mqttPort, mqttUsername, mqttPassword, mqttClientId, lwtTopic, hkTopic, lockStateTopic,
       lockStateCmd, lockCStateCmd, lockTStateCmd, lockCustomStateTopic, lockCustomStateCmd, lockEnableCustomState, hassMqttDiscoveryEnabled, customLockStates, customLockActions,
-      nfcTagNoPublish, btrLvlCmdTopic, hkAltActionTopic)
+      nfcTagNoPublish, btrLvlCmdTopic, hkAltActionTopic, telemetryTopic, telemetryInterval, doorbellTopic,
+      mqttTlsEnabled, mqttPskIdentity, mqttPskKey)
   } mqttData;
 
   struct misc_config_t
@@ -292,9 +321,13 @@ namespace espConfig
     bool webAuthEnabled = WEB_AUTH_ENABLED;
     std::string webUsername = WEB_AUTH_USERNAME;
     std::string webPassword = WEB_AUTH_PASSWORD;
+    std::string webApiToken = WEB_API_TOKEN;
     std::array<uint8_t, 4> nfcGpioPins{SS, SCK, MISO, MOSI};
     uint8_t btrLowStatusThreshold = 10;
     bool proxBatEnabled = false;
+    std::string lanEventGroup = LAN_EVENT_GROUP;
+    uint16_t lanEventPort = LAN_EVENT_PORT;
+    std::string lanEventKey = LAN_EVENT_KEY;
     bool hkDumbSwitchMode = false;
     uint8_t hkAltActionInitPin = GPIO_HK_ALT_ACTION_INIT_PIN;
     uint8_t hkAltActionInitLedPin = GPIO_HK_ALT_ACTION_INIT_LED_PIN;
@@ -302,6 +335,7 @@ namespace espConfig
     uint8_t hkAltActionPin = GPIO_HK_ALT_ACTION_PIN;
     uint16_t hkAltActionTimeout = GPIO_HK_ALT_ACTION_TIMEOUT;
     uint8_t hkAltActionGpioState = GPIO_HK_ALT_ACTION_GPIO_STATE;
+    uint8_t doorbellPin = GPIO_DOORBELL_PIN;
     bool ethernetEnabled = false;
     uint8_t ethActivePreset = 255; // 255 for custom pins
     uint8_t ethPhyType = 0;
@@ -317,10 +351,10 @@ namespace espConfig
         neopixelFailTime, nfcSuccessHL, nfcFailPin, nfcFailTime, nfcFailHL,
         gpioActionPin, gpioActionLockState, gpioActionUnlockState,
         gpioActionMomentaryEnabled, gpioActionMomentaryTimeout, webAuthEnabled,
-        webUsername, webPassword, nfcGpioPins, btrLowStatusThreshold,
-        proxBatEnabled, hkDumbSwitchMode, hkAltActionInitPin,
+        webUsername, webPassword, webApiToken, nfcGpioPins, btrLowStatusThreshold,
+        proxBatEnabled, lanEventGroup, lanEventPort, lanEventKey, hkDumbSwitchMode, hkAltActionInitPin,
         hkAltActionInitLedPin, hkAltActionInitTimeout, hkAltActionPin,
-        hkAltActionTimeout, hkAltActionGpioState, hkGpioControlledState,
+        hkAltActionTimeout, hkAltActionGpioState, hkGpioControlledState, doorbellPin,
         ethernetEnabled, ethActivePreset, ethPhyType,
 #if CONFIG_ETH_USE_ESP32_EMAC
         ethRmiiConfig,
@@ -331,15 +365,387 @@ namespace espConfig
 }; // namespace espConfig
 
 KeyFlow hkFlow = KeyFlow::kFlowFAST;
-bool hkAltActionActive = false;
 SpanCharacteristic* lockCurrentState;
 SpanCharacteristic* lockTargetState;
 SpanCharacteristic* statusLowBtr;
 SpanCharacteristic* btrLevel;
 esp_mqtt_client_handle_t client = nullptr;
+std::atomic<uint32_t> mqttConnectTime{ 0 };
 
 std::shared_ptr<Pixel> pixel;
 
+/**
+ * Stack, priority and core of every task the firmware creates. On dual-core targets NFC polling,
+ * the HomeKey crypto and the actuators share the APP core with HomeSpan's loop, while the tasks
+ * that talk to the network run on the PRO core next to WiFi, lwIP, AsyncTCP and MQTT (pinned in
+ * sdkconfig.defaults), so web or MQTT bursts don't sit between a tap and the lock. Single-core
+ * targets create the same tasks unpinned with the same priorities.
+ */
+namespace task_plan {
+  const char* TAG = "task_plan";
+
+  struct placement_t {
+    const char* name;
+    uint32_t stack;
+    UBaseType_t priority;
+    int core; // -1 for any core
+  };
+
+  const std::array<placement_t, 8> placements = { {
+    { "nfc_task", 8192, TASK_PRIORITY_NFC, TASK_CORE_NFC },
+    { "nfc_reconnect_task", 8192, 5, TASK_CORE_NFC },
+    { "actuator_task", 4096, 4, TASK_CORE_NFC },
+    { "button_task", 3072, 4, TASK_CORE_NFC },
+    { "lan_event_task", 3072, 2, TASK_CORE_NETWORK },
+    // Runs HomeSpan's serial commands, "A" stays in its config AP loop that normally runs on loopTask (8192)
+    { "web_job_task", 8192, 1, TASK_CORE_NETWORK },
+    { "telemetry_task", 3072, 1, TASK_CORE_NETWORK },
+    // Sample tables are static and the profile is rendered without json, check against its own `rec` on /tasks
+    { "profiler_task", 3072, 1, -1 },
+  } };
+
+  /** @return The placement of task `name`, also matches names truncated by FreeRTOS */
+  const placement_t* find(const char* name) {
+    for (auto&& placement : placements) {
+      if (strncmp(placement.name, name, configMAX_TASK_NAME_LEN - 1) == 0) return &placement;
+    }
+    return nullptr;
+  }
+
+  /** Creates task `name` with the stack, priority and core of its placement */
+  BaseType_t create(TaskFunction_t function, const char* name, void* arg, TaskHandle_t* handle) {
+    const placement_t* placement = find(name);
+    if (placement == nullptr) {
+      LOG(E, "No placement for task %s", name);
+      return pdFAIL;
+    }
+    BaseType_t core = tskNO_AFFINITY;
+#if !CONFIG_FREERTOS_UNICORE
+    if (placement->core >= 0 && placement->core < portNUM_PROCESSORS) core = placement->core;
+#endif
+    LOG(D, "Creating %s, stack %lu, priority %u, core %d", name, (unsigned long)placement->stack, (unsigned)placement->priority, core == tskNO_AFFINITY ? -1 : (int)core);
+    return xTaskCreatePinnedToCore(function, name, placement->stack, arg, placement->priority, handle, core);
+  }
+}
+
+/**
+ * Typed events passed between the tasks over one `event_bus::Bus`. Producers publish and move
+ * on, every consumer drains its own ring: `HAP` in `loop()` so the HomeSpan characteristics are
+ * only written from HomeSpan's task, `UI` in `loop()` as well, `LAN` in the lan_event_task and
+ * `ACTUATOR` in the actuator task.
+ */
+namespace events {
+  const char* TAG = "events";
+
+  enum topic_t : uint8_t { TAP, LOCK, NFC, DOORBELL, LOCK_INPUT, BATTERY, TOPIC_COUNT };
+  enum tapResult_t : uint8_t { TAP_DETECTED, TAP_SUCCESS, TAP_FAIL, TAP_TAG };
+
+  struct tap_t {
+    tapResult_t result;
+    uint8_t uidLen;
+    uint32_t latencyUs;     // From the detection to the result, 0 for TAP_DETECTED
+    uint8_t uid[10];        // TAP_TAG
+    uint8_t issuerId[8];    // TAP_SUCCESS
+    uint8_t endpointId[6];  // TAP_SUCCESS
+  };
+  struct lock_t {
+    uint8_t current;
+    uint8_t target;
+  };
+  struct nfc_t {
+    bool connected;
+    char reason[40];
+  };
+  struct doorbell_t {
+    uint8_t press;     // A ProgrammableSwitchEvent value
+    int64_t pressedAt;
+  };
+  struct lockInput_t {
+    uint8_t source;    // A `lock_fsm::source_t`
+    uint8_t event;     // A `lock_fsm::event_t`
+    uint16_t request;  // `lock_api` request waiting for the result, 0 for none
+  };
+  struct battery_t {
+    uint8_t level;
+  };
+
+  struct event_t {
+    topic_t topic;
+    int64_t time; // When it was published
+    union {
+      tap_t tap;
+      lock_t lock;
+      nfc_t nfc;
+      doorbell_t doorbell;
+      lockInput_t lockInput;
+      battery_t battery;
+    };
+  };
+
+  struct busLock_t {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    void lock() { portENTER_CRITICAL(&mux); }
+    void unlock() { portEXIT_CRITICAL(&mux); }
+  };
+
+  constexpr uint32_t bit(topic_t topic) { return 1u << topic; }
+
+  event_bus::Bus<event_t, busLock_t, 6, 16> bus;
+  std::atomic<uint32_t> dropped{ 0 };
+
+  /** Stamps and publishes `event`, @return false if a subscriber had to drop it */
+  bool publish(event_t& event) {
+    event.time = esp_timer_get_time();
+    size_t drops = bus.publish(event);
+    if (drops) {
+      dropped.fetch_add(drops, std::memory_order_relaxed);
+      LOG(W, "Event of topic %d dropped by %u subscriber(s)", event.topic, drops);
+    }
+    return drops == 0;
+  }
+
+  void wakeTask(void* arg) {
+    TaskHandle_t task = *static_cast<TaskHandle_t*>(arg);
+    if (task) xTaskNotifyGive(task);
+  }
+
+  /** Serial command `@E`, prints the per subscriber counters */
+  void printStats(const char* arg) {
+    LOG(I, "%-10s %8s %8s %6s", "subscriber", "received", "dropped", "peak");
+    for (size_t i = 0; i < bus.subscriberCount(); i++) {
+      auto stats = bus.stats(i);
+      LOG(I, "%-10s %8lu %8lu %6lu", stats.name, (unsigned long)stats.received, (unsigned long)stats.dropped, (unsigned long)stats.highWater);
+    }
+  }
+}
+
+/**
+ * Live events pushed to the web UI over Server-Sent Events.
+ * The UI subscriber of the event bus is drained from `loop()`, which formats and sends the
+ * events, so producers (NFC, GPIO, MQTT and telemetry tasks) never touch the network and a slow
+ * browser can't hold up a tap. Without clients the events are discarded.
+ */
+namespace ui_events {
+  const size_t maxClients = 4;
+  const uint32_t maxAvgBacklog = 8; // queued messages per client above which metrics are skipped
+  AsyncEventSource source("/events");
+  int subscriber = -1;
+  char metrics[384];
+  bool metricsPending = false;
+  std::atomic<bool> active{ false };
+  portMUX_TYPE metricsLock = portMUX_INITIALIZER_UNLOCKED;
+
+  void begin() {
+    subscriber = events::bus.subscribe("ui", events::bit(events::TAP) | events::bit(events::LOCK) | events::bit(events::NFC));
+  }
+
+  // Only the latest metrics sample is kept, older ones are superseded
+  void pushMetrics(const char* data, size_t len) {
+    if (!active.load(std::memory_order_relaxed) || len >= sizeof(metrics)) return;
+    portENTER_CRITICAL(&metricsLock);
+    memcpy(metrics, data, len + 1);
+    metricsPending = true;
+    portEXIT_CRITICAL(&metricsLock);
+  }
+
+  void toHex(const uint8_t* data, size_t len, char* out) {
+    for (size_t i = 0; i < len; i++) {
+      sprintf(out + i * 2, "%02X", data[i]);
+    }
+    out[len * 2] = 0;
+  }
+
+  /**
+   * Formats `ev` as the JSON data of its SSE event.
+   *
+   * @return The SSE event name, nullptr if the event is not shown in the UI
+   */
+  const char* format(const events::event_t& ev, char* buf, size_t size) {
+    switch (ev.topic) {
+    case events::TAP: {
+      char first[21], second[13];
+      switch (ev.tap.result) {
+      case events::TAP_SUCCESS:
+        toHex(ev.tap.issuerId, sizeof(ev.tap.issuerId), first);
+        toHex(ev.tap.endpointId, sizeof(ev.tap.endpointId), second);
+        snprintf(buf, size, "{\"homekey\":true,\"success\":true,\"issuerId\":\"%s\",\"endpointId\":\"%s\",\"latency_us\":%lu}", first, second, (unsigned long)ev.tap.latencyUs);
+        return "tap";
+      case events::TAP_FAIL:
+        snprintf(buf, size, "{\"homekey\":true,\"success\":false,\"latency_us\":%lu}", (unsigned long)ev.tap.latencyUs);
+        return "tap";
+      case events::TAP_TAG:
+        toHex(ev.tap.uid, std::min<size_t>(ev.tap.uidLen, sizeof(ev.tap.uid)), first);
+        snprintf(buf, size, "{\"homekey\":false,\"uid\":\"%s\",\"latency_us\":%lu}", first, (unsigned long)ev.tap.latencyUs);
+        return "tap";
+      default:
+        return nullptr;
+      }
+    }
+    case events::LOCK:
+      snprintf(buf, size, "{\"current\":%d,\"target\":%d}", ev.lock.current, ev.lock.target);
+      return "lock";
+    case events::NFC:
+      if (ev.nfc.connected) {
+        snprintf(buf, size, "{\"connected\":true}");
+      } else {
+        snprintf(buf, size, "{\"connected\":false,\"reason\":\"%s\"}", ev.nfc.reason);
+      }
+      return "nfc";
+    default:
+      return nullptr;
+    }
+  }
+
+  void drain() {
+    static char metricsBuf[sizeof(metrics)];
+    size_t clients = source.count();
+    active.store(clients > 0, std::memory_order_relaxed);
+    events::event_t ev;
+    char data[128];
+    while (subscriber >= 0 && events::bus.receive(subscriber, ev)) {
+      if (clients == 0) continue;
+      const char* name = format(ev, data, sizeof(data));
+      if (name) source.send(data, name, millis());
+    }
+    if (clients == 0) {
+      return;
+    }
+    bool sendMetrics = false;
+    portENTER_CRITICAL(&metricsLock);
+    if (metricsPending) {
+      memcpy(metricsBuf, metrics, sizeof(metrics));
+      metricsPending = false;
+      sendMetrics = true;
+    }
+    portEXIT_CRITICAL(&metricsLock);
+    if (sendMetrics && source.avgPacketsWaiting() < maxAvgBacklog) {
+      source.send(metricsBuf, "metrics", millis());
+    }
+  }
+}
+
+/**
+ * Compact binary event datagrams sent to a LAN multicast group for consumers that need to react
+ * within milliseconds (door displays, camera triggers) without going through the MQTT broker.
+ * The lan_event_task drains its event bus subscriber, signs and sends the packets.
+ *
+ * Packet layout (little-endian, 44 bytes):
+ *   magic "HK" | version | type | seq u32 | uptime ms u32 | issuerId[8] | endpointId[6] | state | reserved
+ *   | first 16 bytes of HMAC-SHA256(lanEventKey, preceding 28 bytes)
+ */
+namespace lan_events {
+  enum eventType : uint8_t
+  {
+    TAP_SUCCESS = 1,
+    TAP_FAIL = 2,
+    TAG = 3,
+    LOCK_STATE = 4
+  };
+  struct __attribute__((packed)) packet_t
+  {
+    uint8_t magic[2] = { 'H', 'K' };
+    uint8_t version = 1;
+    uint8_t type = 0;
+    uint32_t seq = 0;
+    uint32_t timestamp = 0;
+    uint8_t issuerId[8] = {};
+    uint8_t endpointId[6] = {};
+    uint8_t state = 0xFF;
+    uint8_t reserved = 0;
+    uint8_t hmac[16] = {};
+  };
+  static_assert(sizeof(packet_t) == 44, "LAN event packet layout changed");
+  const size_t signedLength = offsetof(packet_t, hmac);
+  TaskHandle_t task = nullptr;
+  int subscriber = -1;
+  sockaddr_in dest{};
+
+  /** Fills `packet` from a bus event, @return false if the event is not sent to the LAN */
+  bool toPacket(const events::event_t& ev, packet_t& packet) {
+    static int lastCurrent = -1;
+    packet = packet_t{};
+    packet.timestamp = ev.time / 1000;
+    if (ev.topic == events::TAP) {
+      switch (ev.tap.result) {
+      case events::TAP_SUCCESS:
+        packet.type = TAP_SUCCESS;
+        memcpy(packet.issuerId, ev.tap.issuerId, sizeof(packet.issuerId));
+        memcpy(packet.endpointId, ev.tap.endpointId, sizeof(packet.endpointId));
+        return true;
+      case events::TAP_FAIL:
+        packet.type = TAP_FAIL;
+        return true;
+      case events::TAP_TAG:
+        packet.type = TAG;
+        return true;
+      default:
+        return false;
+      }
+    }
+    // Only changes of the current state are sent
+    if (ev.topic == events::LOCK && ev.lock.current != lastCurrent) {
+      lastCurrent = ev.lock.current;
+      packet.type = LOCK_STATE;
+      packet.state = ev.lock.current;
+      return true;
+    }
+    return false;
+  }
+
+  void lan_event_task(void* arg) {
+    const char* TAG = "lan_events";
+    events::event_t ev;
+    packet_t packet;
+    uint32_t seq = 0;
+    int sock = -1;
+    const mbedtls_md_info_t* md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    uint8_t mac[32];
+    LOG(I, "Sending LAN events to %s:%d", espConfig::miscConfig.lanEventGroup.c_str(), espConfig::miscConfig.lanEventPort);
+    while (1) {
+      while (events::bus.receive(subscriber, ev)) {
+        if (!toPacket(ev, packet)) continue;
+        if (sock < 0) {
+          sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+          if (sock < 0) {
+            LOG(E, "Could not create socket: %d", errno);
+            continue;
+          }
+          uint8_t ttl = 1;
+          setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        }
+        packet.seq = seq++;
+        mbedtls_md_hmac(md, (const uint8_t*)espConfig::miscConfig.lanEventKey.data(), espConfig::miscConfig.lanEventKey.size(), (const uint8_t*)&packet, signedLength, mac);
+        memcpy(packet.hmac, mac, sizeof(packet.hmac));
+        if (sendto(sock, &packet, sizeof(packet), MSG_DONTWAIT, (sockaddr*)&dest, sizeof(dest)) < 0) {
+          LOG(D, "sendto failed: %d", errno);
+          close(sock);
+          sock = -1;
+        }
+      }
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+  }
+
+  void begin() {
+    const char* TAG = "lan_events";
+    if (espConfig::miscConfig.lanEventGroup.empty() || task != nullptr) return;
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(espConfig::miscConfig.lanEventPort);
+    if (inet_pton(AF_INET, espConfig::miscConfig.lanEventGroup.c_str(), &dest.sin_addr) != 1) {
+      LOG(E, "Invalid multicast group \"%s\", LAN events disabled", espConfig::miscConfig.lanEventGroup.c_str());
+      return;
+    }
+    // An HMAC with an empty key proves nothing, so unsigned events are never sent
+    if (espConfig::miscConfig.lanEventKey.empty()) {
+      LOG(E, "No shared key set, LAN events disabled");
+      return;
+    }
+    subscriber = events::bus.subscribe("lan", events::bit(events::TAP) | events::bit(events::LOCK), events::wakeTask, &task);
+    if (subscriber < 0) return;
+    task_plan::create(lan_event_task, "lan_event_task", NULL, &task);
+  }
+}
+
 // This internal version assumes the CALLER holds the mutex
 bool save_to_nvs_internal() {
   // Check added just in case, but lock should be held by caller
@@ -448,344 +854,732 @@ void with_crc16(unsigned char* data, unsigned int size, unsigned char* result) {
   crc16a(data, size, result);
 }
 
-void alt_action_task(void* arg) {
-  uint8_t buttonState = 0;
-  hkAltActionActive = false;
-  LOG(I, "Starting Alt Action button task");
-  while (true)
-  {
-    buttonState = digitalRead(espConfig::miscConfig.hkAltActionInitPin);
-    if (buttonState == HIGH) {
-      LOG(D, "BUTTON HIGH");
-      hkAltActionActive = true;
-      if(espConfig::miscConfig.hkAltActionInitLedPin != 255) {
-        digitalWrite(espConfig::miscConfig.hkAltActionInitLedPin, HIGH);
+/**
+ * Input service for push buttons. The GPIO interrupt only timestamps the edge and wakes the
+ * service task with a notification bit per button, the task debounces (an edge burst is taken
+ * once the pin stayed quiet for `debounceMs`, stamped with its first edge) and classifies the
+ * presses. Handlers run in the service task and should only hand the event on. SINGLE, DOUBLE
+ * and HOLD carry the time of the first press they classify.
+ */
+namespace buttons {
+  const char* TAG = "buttons";
+
+  enum type_t : uint8_t { PRESS, RELEASE, SINGLE, DOUBLE, HOLD };
+  const std::array<const char*, 5> typeNames = { "press", "release", "single", "double", "hold" };
+
+  struct config_t {
+    uint8_t pin;
+    uint8_t mode;          // INPUT, INPUT_PULLUP or INPUT_PULLDOWN
+    bool activeHigh;
+    uint16_t debounceMs;
+    uint16_t holdMs;       // 0 disables HOLD
+    uint16_t doubleMs;     // 0 disables DOUBLE, SINGLE then follows the release right away
+    void (*handler)(uint8_t id, type_t type, int64_t time);
+  };
+
+  struct button_t {
+    config_t config;
+    int64_t burstStart = 0; // First edge of the burst being debounced, 0 if none, guarded by `edgeLock`
+    int64_t lastEdge = 0;
+    bool down = false;
+    bool holdSent = false;
+    uint8_t presses = 0;
+    int64_t pressedAt = 0; // First press of the sequence being classified
+    int64_t holdAt = 0;   // When a press turns into HOLD, 0 if not pending
+    int64_t singleAt = 0; // When a released press turns into SINGLE, 0 if not pending
+  };
+
+  const size_t maxButtons = 4;
+  std::array<button_t, maxButtons> list;
+  std::atomic<uint8_t> count{ 0 };
+  TaskHandle_t task = nullptr;
+  portMUX_TYPE edgeLock = portMUX_INITIALIZER_UNLOCKED;
+
+  void IRAM_ATTR isr(void* arg) {
+    uint8_t id = (uintptr_t)arg;
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&edgeLock);
+    if (!list[id].burstStart) list[id].burstStart = now;
+    list[id].lastEdge = now;
+    portEXIT_CRITICAL_ISR(&edgeLock);
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(task, 1UL << id, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+
+  void emit(uint8_t id, type_t type, int64_t time) {
+    LOG(D, "Button %d: %s", id, typeNames[type]);
+    list[id].config.handler(id, type, time);
+  }
+
+  /** Applies a debounced level change that started at `time` */
+  void transition(uint8_t id, bool down, int64_t time) {
+    button_t& b = list[id];
+    b.down = down;
+    if (down) {
+      b.presses = b.singleAt ? b.presses + 1 : 1;
+      if (b.presses == 1) b.pressedAt = time;
+      b.singleAt = 0;
+      b.holdSent = false;
+      b.holdAt = b.config.holdMs ? time + (int64_t)b.config.holdMs * 1000 : 0;
+      emit(id, PRESS, time);
+      return;
+    }
+    b.holdAt = 0;
+    emit(id, RELEASE, time);
+    if (b.holdSent) {
+      b.presses = 0;
+    } else if (b.presses >= 2) {
+      b.presses = 0;
+      emit(id, DOUBLE, b.pressedAt);
+    } else if (b.config.doubleMs) {
+      b.singleAt = time + (int64_t)b.config.doubleMs * 1000;
+    } else {
+      b.presses = 0;
+      emit(id, SINGLE, b.pressedAt);
+    }
+  }
+
+  /**
+   * Runs everything that is due for a button. A burst that ends at the level it started from but
+   * spans at least half the debounce time is taken as a short press.
+   *
+   * @return The next time the button needs attention, 0 if none
+   */
+  int64_t service(uint8_t id, int64_t now) {
+    button_t& b = list[id];
+    portENTER_CRITICAL(&edgeLock);
+    int64_t start = b.burstStart;
+    int64_t end = b.lastEdge;
+    int64_t settleAt = end + (int64_t)b.config.debounceMs * 1000;
+    if (start && now >= settleAt) {
+      b.burstStart = 0;
+    }
+    portEXIT_CRITICAL(&edgeLock);
+    int64_t next = 0;
+    if (start && now < settleAt) {
+      next = settleAt;
+    } else if (start) {
+      bool down = (digitalRead(b.config.pin) == HIGH) == b.config.activeHigh;
+      if (down != b.down) {
+        transition(id, down, start);
+      } else if (!down && end - start >= (int64_t)b.config.debounceMs * 500) {
+        // Pressed and released again within the debounce time, too long for contact bounce
+        transition(id, true, start);
+        transition(id, false, end);
       }
-      vTaskDelay(espConfig::miscConfig.hkAltActionInitTimeout / portTICK_PERIOD_MS);
-      if (espConfig::miscConfig.hkAltActionInitLedPin != 255) {
-        digitalWrite(espConfig::miscConfig.hkAltActionInitLedPin, LOW);
+    }
+    if (b.holdAt && now >= b.holdAt) {
+      b.holdAt = 0;
+      b.holdSent = true;
+      emit(id, HOLD, b.pressedAt);
+    }
+    if (b.singleAt && now >= b.singleAt) {
+      b.singleAt = 0;
+      b.presses = 0;
+      emit(id, SINGLE, b.pressedAt);
+    }
+    if (b.holdAt && (!next || b.holdAt < next)) next = b.holdAt;
+    if (b.singleAt && (!next || b.singleAt < next)) next = b.singleAt;
+    return next;
+  }
+
+  void button_task(void* arg) {
+    uint32_t bits;
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
+      xTaskNotifyWait(0, ULONG_MAX, &bits, wait);
+      int64_t now = esp_timer_get_time();
+      int64_t next = 0;
+      for (uint8_t id = 0; id < count.load(); id++) {
+        int64_t due = service(id, now);
+        if (due && (!next || due < next)) next = due;
       }
-      LOG(D, "TIMEOUT");
-      hkAltActionActive = false;
+      wait = next ? pdMS_TO_TICKS((next - now + 999) / 1000) + 1 : portMAX_DELAY;
+    }
+  }
+
+  /**
+   * Starts watching a button, the service task is created with the first one.
+   *
+   * @return The button id passed to the handler, -1 if there is no free slot
+   */
+  int add(const config_t& config) {
+    uint8_t id = count.load();
+    if (id >= maxButtons || config.pin == 255 || config.handler == nullptr) {
+      LOG(E, "Can't add a button on pin %d", config.pin);
+      return -1;
+    }
+    if (task == nullptr) {
+      task_plan::create(button_task, "button_task", NULL, &task);
+    }
+    list[id].config = config;
+    pinMode(config.pin, config.mode);
+    list[id].down = (digitalRead(config.pin) == HIGH) == config.activeHigh;
+#if SOC_GPIO_SUPPORT_PIN_GLITCH_FILTER
+    // Drops pulses of a few APB cycles in hardware, contact bounce is left to the debounce below
+    gpio_glitch_filter_handle_t filter;
+    gpio_pin_glitch_filter_config_t filterConfig = { .clk_src = GLITCH_FILTER_CLK_SRC_DEFAULT, .gpio_num = gpio_num_t(config.pin) };
+    if (gpio_new_pin_glitch_filter(&filterConfig, &filter) == ESP_OK) {
+      gpio_glitch_filter_enable(filter);
     }
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+#endif
+    count.store(id + 1);
+    attachInterruptArg(config.pin, isr, (void*)(uintptr_t)id, CHANGE);
+    LOG(I, "Button %d on pin %d (debounce %d ms, hold %d ms, double %d ms)", id, config.pin, config.debounceMs, config.holdMs, config.doubleMs);
+    return id;
   }
-  vTaskDelete(NULL);
 }
 
-void gpio_task(void* arg) {
-  gpioLockAction status;
-  bool initial_state_set = false; // Flag for initial setup
-  const TickType_t initial_delay_ticks = pdMS_TO_TICKS(1500); // Time for HomeSpan chars to init
-  const TickType_t loop_delay_ticks = pdMS_TO_TICKS(100); // Poll interval
+namespace actuator {
+  bool lock(uint8_t source, uint8_t target);
+}
 
-  LOG(I, "gpio_task started.");
+/**
+ * Device side of lock_fsm.h: the HomeKit characteristics, the MQTT state and custom action
+ * topics and the actuator queue. HAP notifications and MQTT state publishes are coalesced, a
+ * state is only sent when it differs from the one sent last. Every change of the characteristics
+ * is published on the event bus as `events::LOCK`.
+ */
+namespace lock_fsm {
+  const char* TAG = "lock_fsm";
 
-  while (1) {
-      // *** SET INITIAL GPIO STATE (runs only once after boot/task start) ***
-      if (!initial_state_set && espConfig::miscConfig.gpioActionPin != 255) {
-          // Wait a bit for HomeSpan characteristics to be ready
-          LOG(D, "gpio_task: Delaying %dms for initial state check...", initial_delay_ticks);
-          vTaskDelay(initial_delay_ticks);
-
-          // Check if the global characteristic pointers are valid
-          if (lockCurrentState != nullptr && lockTargetState != nullptr) {
-              int current_state = lockCurrentState->getVal();
-              LOG(I, "gpio_task: Setting initial GPIO state based on LockCurrentState: %d", current_state);
-
-              uint8_t initial_level;
-              if (current_state == lockStates::LOCKED) {
-                  initial_level = espConfig::miscConfig.gpioActionLockState;
-              } else { // Assume UNLOCKED or other states use the unlock level initially
-                  initial_level = espConfig::miscConfig.gpioActionUnlockState;
-              }
+  std::atomic<int> lastPublished{ -1 };
 
-              // Ensure pin is output
-              pinMode(espConfig::miscConfig.gpioActionPin, OUTPUT);
-              // Write initial state
-              digitalWrite(espConfig::miscConfig.gpioActionPin, initial_level);
-              initial_state_set = true;
-              LOG(I, "gpio_task: Initial GPIO pin %d set to level %d", espConfig::miscConfig.gpioActionPin, initial_level);
-
-              // Ensure target state matches initial current state if needed
-               if(lockTargetState->getVal() != current_state) {
-                    LOG(I, "gpio_task: Aligning initial target state to current state (%d)", current_state);
-                    lockTargetState->setVal(current_state);
-               }
+  /** Reports the lock state to the LAN and UI listeners, sent on every change of either characteristic */
+  void notify(int current, int target) {
+    events::event_t ev{};
+    ev.topic = events::LOCK;
+    ev.lock = { uint8_t(current), uint8_t(target) };
+    events::publish(ev);
+  }
 
-          } else {
-               LOG(E, "gpio_task: lockCurrentState/lockTargetState characteristic not valid for initial state set!");
-               // Optionally retry or set a default safe state (e.g., locked)
-               // pinMode(espConfig::miscConfig.gpioActionPin, OUTPUT);
-               // digitalWrite(espConfig::miscConfig.gpioActionPin, espConfig::miscConfig.gpioActionLockState);
-               // initial_state_set = true; // Mark as set even if fallback?
-          }
-      }
-      // Reset flag if pin gets disabled via web config later
-      if (espConfig::miscConfig.gpioActionPin == 255 && initial_state_set) {
-           LOG(I, "gpio_task: gpioActionPin disabled, resetting initial_state_set flag.");
-           initial_state_set = false;
-      }
+  struct characteristics_t
+  {
+    int current() { return lockCurrentState->getVal(); }
+    // Inside LockMechanism::update() the target written by HomeKit is only in the new value
+    int target() { return lockTargetState->getNewVal(); }
+    void setCurrent(int state) {
+      lockCurrentState->setVal(state);
+      notify(state, target());
+    }
+    void setTarget(int state) {
+      lockTargetState->setVal(state);
+      notify(current(), state);
+    }
+  };
 
+  struct mqtt_t
+  {
+    void state(int state) {
+      if (client != nullptr && lastPublished.exchange(state) != state) {
+        esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(state).c_str(), 1, 1, true);
+      }
+    }
+    void custom(int state) {
+      if (!espConfig::mqttData.lockEnableCustomState || client == nullptr) return;
+      const char* action = state == lockStates::UNLOCKED ? "UNLOCK" : "LOCK";
+      esp_mqtt_client_publish(client, espConfig::mqttData.lockCustomStateTopic.c_str(), std::to_string(espConfig::mqttData.customLockActions[action]).c_str(), 0, 0, false);
+    }
+  };
 
-      // *** PROCESS QUEUE MESSAGES ***
-      if (gpio_lock_handle != nullptr) {
-          // Check queue without blocking (timeout 0)
-          if (xQueueReceive(gpio_lock_handle, &status, 0) == pdPASS) {
-              LOG(D, "gpio_task: Received action - source=%d action=%d", status.source, status.action);
+  struct actuator_t
+  {
+    bool controls() {
+      return (espConfig::miscConfig.gpioActionPin != 255 && espConfig::miscConfig.hkGpioControlledState) || espConfig::miscConfig.hkDumbSwitchMode;
+    }
+    bool lock(uint8_t source, int state) {
+      bool queued = actuator::lock(source, state);
+      if (!queued) LOG(E, "Failed to send action to the actuator queue!");
+      return queued;
+    }
+  };
 
-              // Only process if GPIO pin is currently enabled
-              if (espConfig::miscConfig.gpioActionPin == 255 && !espConfig::miscConfig.hkDumbSwitchMode) {
-                  LOG(W, "gpio_task: Received action but gpioActionPin is disabled (and not dumb mode). Ignoring.");
-                  // Skip rest of processing for this message
-              }
-              // Process action 0 (state change request)
-              else if (status.action == 0) {
-                  if(lockTargetState == nullptr || lockCurrentState == nullptr) {
-                      LOG(E, "gpio_task: Characteristics pointers invalid, cannot process action 0.");
-                      continue; // Skip to next loop iteration
-                  }
+  characteristics_t characteristics;
+  mqtt_t mqtt;
+  actuator_t gpio;
+
+  /**
+   * Runs the actions for `event` coming from `source`, in HomeSpan's task.
+   *
+   * @return true if a lock pin change was queued
+   */
+  bool handle(source_t source, event_t event) {
+    if (lockCurrentState == nullptr || lockTargetState == nullptr) {
+      LOG(E, "Lock characteristics not ready, dropping event %d from %d", event, source);
+      return false;
+    }
+    LOG(D, "source=%d event=%d", source, event);
+    result_t result = handle(characteristics, mqtt, gpio, source, event);
+    if (result == IGNORED) {
+      LOG(W, "Event %d from %d has no transition", event, source);
+    }
+    return result == QUEUED;
+  }
 
-                  int target_state_val = lockTargetState->getNewVal(); // Get intended state
-                  uint8_t gpio_level_to_set;
-                  bool isUnlockAction = (target_state_val == lockStates::UNLOCKED);
+  /**
+   * Hands `event` from `source` to `handle` through the event bus, it runs in HomeSpan's task so
+   * the characteristics are never written from another task.
+   *
+   * @param request A `lock_api` request to complete with the result, 0 for none
+   * @return false if the event was dropped
+   */
+  bool post(source_t source, event_t event, uint16_t request = 0) {
+    events::event_t ev{};
+    ev.topic = events::LOCK_INPUT;
+    ev.lockInput = { source, event, request };
+    return events::publish(ev);
+  }
+}
 
-                  LOG(D, "GPIO Task Action: Target State=%d", target_state_val);
+/**
+ * Drives every output of the reader (lock GPIO, NFC success/fail LEDs, NeoPixel and the alt action
+ * pins) from one task. Holds and pulses are not waited out with `vTaskDelay`: each output owns a
+ * slot with a deadline and a single esp_timer is armed for the earliest one, so all outputs run
+ * concurrently and a new pulse on an output that is still on just moves its deadline. The NeoPixel
+ * slot runs the effects engine, its deadline is the next frame.
+ */
+namespace actuator {
+  const char* TAG = "actuator";
+
+  enum output_t : uint8_t { LOCK, SUCCESS_LED, FAIL_LED, PIXEL, ALT_ACTION, ALT_INIT_LED, OUTPUT_COUNT };
+  enum type_t : uint8_t { TIMER, LOCK_INIT, LOCK_ACTION, EVENTS, ALT_ARM, ALT_PULSE, PIXEL_INIT };
+  /** NeoPixel effects in ascending priority */
+  enum effect_t : uint8_t { EFFECT_RECONNECT, EFFECT_BUSY, EFFECT_SUCCESS, EFFECT_FAIL, EFFECT_COUNT };
+
+  struct command_t {
+    type_t type;
+    uint8_t value; // LOCK_ACTION: a `gpioLockAction` source, PIXEL_INIT: the pin
+    uint8_t target; // LOCK_ACTION: the `lockStates` to move to
+    int64_t queuedAt;
+  };
 
-                  // Determine GPIO level based on target state
-                  if (isUnlockAction) {
-                      gpio_level_to_set = espConfig::miscConfig.gpioActionUnlockState;
-                      // Set intermediate HomeKit state for feedback
-                      if(lockCurrentState->getVal() != lockStates::UNLOCKING) {
-                           lockCurrentState->setVal(lockStates::UNLOCKING);
-                           if (client) esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::UNLOCKING).c_str(), 0, 1, true);
-                      }
-                  } else { // Target is LOCKED
-                      gpio_level_to_set = espConfig::miscConfig.gpioActionLockState;
-                       // Set intermediate HomeKit state for feedback
-                      if(lockCurrentState->getVal() != lockStates::LOCKING) {
-                          lockCurrentState->setVal(lockStates::LOCKING);
-                           if (client) esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::LOCKING).c_str(), 0, 1, true);
-                      }
-                  }
+  QueueHandle_t queue = nullptr;
+  TaskHandle_t task = nullptr;
+  esp_timer_handle_t timer = nullptr;
+  int subscriber = -1;
+  std::array<int64_t, OUTPUT_COUNT> deadlines{}; // 0 when the output is idle
+  int64_t armedFor = 0;
 
-                  // --- Perform Physical Action ---
-                  if (espConfig::miscConfig.gpioActionPin != 255) { // Only write if pin is valid
-                      LOG(D, "GPIO Task: Writing pin %d to level %d", espConfig::miscConfig.gpioActionPin, gpio_level_to_set);
-                      digitalWrite(espConfig::miscConfig.gpioActionPin, gpio_level_to_set);
-                  } else if (espConfig::miscConfig.hkDumbSwitchMode) {
-                      // Dumb switch mode might just mean "toggle" regardless of target state
-                      // Or maybe it simulates a momentary press? Define this behaviour.
-                      // Example: Simple Toggle (assumes it needs a pulse)
-                      LOG(D, "GPIO Task: Dumb Switch Mode - Simulating momentary toggle");
-                      uint8_t pressLevel = espConfig::miscConfig.gpioActionUnlockState; // Or some dedicated pulse level?
-                      uint8_t releaseLevel = espConfig::miscConfig.gpioActionLockState; // Or inverse of pressLevel?
-                      // Assume hkDumbSwitchMode uses gpioActionPin if set, otherwise needs a pin? Error if 255?
-                       if(espConfig::miscConfig.gpioActionPin != 255) {
-                           digitalWrite(espConfig::miscConfig.gpioActionPin, pressLevel);
-                           vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.gpioActionMomentaryTimeout > 0 ? espConfig::miscConfig.gpioActionMomentaryTimeout : 200)); // Use timeout or default
-                           digitalWrite(espConfig::miscConfig.gpioActionPin, releaseLevel);
-                       } else {
-                            LOG(E, "Dumb Switch Mode enabled but no valid gpioActionPin configured!");
-                       }
-                      // In dumb mode, HK state might just toggle immediately
-                      lockCurrentState->setVal(target_state_val);
-                      if (client) esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(target_state_val).c_str(), 0, 1, true);
-                      continue; // Skip momentary logic below for dumb mode? Or adapt it?
-                  }
-                   // --- End Physical Action ---
+  bool post(type_t type, uint8_t value = 0, uint8_t target = 0, TickType_t wait = 0) {
+    const command_t cmd{ type, value, target, esp_timer_get_time() };
+    return queue != nullptr && xQueueSend(queue, &cmd, wait) == pdPASS;
+  }
 
+  /** Set by the button service, read lock-free by the tap path */
+  std::atomic<int64_t> altArmedUntil{ 0 };
 
-                  // --- Momentary Logic (Only if NOT Dumb Mode and pin is valid) ---
-                  if (espConfig::miscConfig.gpioActionPin != 255 && isUnlockAction && (static_cast<uint8_t>(espConfig::miscConfig.gpioActionMomentaryEnabled) & status.source)) {
-                      LOG(D, "GPIO Task: Starting momentary delay (%d ms) for UNLOCK", espConfig::miscConfig.gpioActionMomentaryTimeout);
-                      vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.gpioActionMomentaryTimeout));
+  /** @return true while the alt action window opened by the init button is open */
+  bool altArmed() {
+    return esp_timer_get_time() < altArmedUntil.load(std::memory_order_acquire);
+  }
 
-                      LOG(D, "GPIO Task: Momentary timeout, returning pin %d to LOCK level (%d).", espConfig::miscConfig.gpioActionPin, espConfig::miscConfig.gpioActionLockState);
-                      digitalWrite(espConfig::miscConfig.gpioActionPin, espConfig::miscConfig.gpioActionLockState);
+  /** Opens the alt action window on a press of the init button, presses while it is open are ignored */
+  void altButton(uint8_t id, buttons::type_t type, int64_t time) {
+    if (type != buttons::PRESS || altArmed()) return;
+    altArmedUntil.store(time + (int64_t)espConfig::miscConfig.hkAltActionInitTimeout * 1000, std::memory_order_release);
+    LOG(I, "Alt action armed %lli us after the press", esp_timer_get_time() - time);
+    post(ALT_ARM);
+  }
 
-                      // Update HomeKit state AFTER momentary action completes
-                      // Check if HomeKit still expects UNLOCKED (user might have changed target during delay)
-                      if(lockTargetState->getVal() == lockStates::UNLOCKED) {
-                          LOG(D,"GPIO Task: Momentary done, setting TargetState back to LOCKED");
-                          lockTargetState->setVal(lockStates::LOCKED); // Re-target to Locked
-                      }
-                      lockCurrentState->setVal(lockStates::LOCKED); // Set current to Locked
-                      if (client) esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::LOCKED).c_str(), 0, 1, true);
-
-                  } else if (espConfig::miscConfig.gpioActionPin != 255) {
-                      // If NOT momentary, or if it was a LOCK action:
-                      // Physical action is done, update HomeKit current state to match the final target state
-                      LOG(D, "GPIO Task: Non-momentary action complete, setting CurrentState to %d", target_state_val);
-                      // Optional short delay if physical lock needs time to settle before updating state
-                      // vTaskDelay(pdMS_TO_TICKS(200));
-                      lockCurrentState->setVal(target_state_val);
-                      if (client) esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(target_state_val).c_str(), 0, 1, true);
-                  }
-                  // --- End Momentary Logic ---
+  // Runs in the esp_timer task, the actual work is done by the actuator task
+  void onTimer(void* arg) {
+    post(TIMER);
+  }
 
-              }
-              // Process action 2 (stop task command)
-              else if (status.action == 2) {
-                  LOG(I, "gpio_task stopping command received.");
-                  vTaskDelete(NULL); // Gracefully delete self
-                  return; // Exit function
-              }
-          } // End if xQueueReceive successful
-      } else {
-          // Handle case where queue handle is somehow null (shouldn't happen if setup is correct)
-          LOG(E, "gpio_task: gpio_lock_handle is NULL!");
-          vTaskDelay(pdMS_TO_TICKS(1000)); // Delay longer before retrying
-      }
+  void schedule(output_t output, uint32_t ms) {
+    deadlines[output] = esp_timer_get_time() + (int64_t)ms * 1000;
+  }
 
-      vTaskDelay(loop_delay_ticks); // Prevent task from hogging CPU
-  } // End while(1)
-}
+  /** Arms the timer for the earliest pending deadline unless it already is */
+  void rearm() {
+    int64_t next = 0;
+    for (int64_t deadline : deadlines) {
+      if (deadline && (!next || deadline < next)) next = deadline;
+    }
+    if (next == armedFor) return;
+    esp_timer_stop(timer);
+    armedFor = next;
+    if (next) {
+      esp_timer_start_once(timer, std::max<int64_t>(next - esp_timer_get_time(), 0));
+    }
+  }
 
-void neopixel_task(void* arg) {
-  uint8_t status = 0;
-  while (1) {
-    if (neopixel_handle != nullptr) {
-      status = 0;
-      if (uxQueueMessagesWaiting(neopixel_handle) > 0) {
-        xQueueReceive(neopixel_handle, &status, 0);
-        LOG(D, "Got something in queue %d", status);
-        switch (status) {
-        case 0:
-          if (espConfig::miscConfig.nfcNeopixelPin && espConfig::miscConfig.nfcNeopixelPin != 255) {
-            LOG(D, "SUCCESS PIXEL %d:%d,%d,%d", espConfig::miscConfig.nfcNeopixelPin, espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::R], espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::G], espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::B]);
-            pixel->set(pixel->RGB(espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::R], espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::G], espConfig::miscConfig.neopixelFailureColor[espConfig::misc_config_t::colorMap::B]));
-            vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.neopixelFailTime));
-            pixel->off();
-          }
-          break;
-        case 1:
-          if (espConfig::miscConfig.nfcNeopixelPin && espConfig::miscConfig.nfcNeopixelPin != 255) {
-            LOG(D, "FAIL PIXEL %d:%d,%d,%d", espConfig::miscConfig.nfcNeopixelPin, espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::R], espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::G], espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::B]);
-            pixel->set(pixel->RGB(espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::R], espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::G], espConfig::miscConfig.neopixelSuccessColor[espConfig::misc_config_t::colorMap::B]));
-            vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.neopixelSuccessTime));
-            pixel->off();
-          }
-          break;
-        default:
-          vTaskDelete(NULL);
-          return;
-          break;
-        }
-      }
+  /**
+   * Aligns the target state with the restored `lockCurrentState` and prepares the lock GPIO.
+   *
+   * @return true if the pin is to be set to the lock level
+   */
+  bool lockInitialState() {
+    pinMode(espConfig::miscConfig.gpioActionPin, OUTPUT);
+    if (lockCurrentState == nullptr || lockTargetState == nullptr) {
+      LOG(E, "lockCurrentState/lockTargetState characteristic not valid for initial state set, locking!");
+      return true;
     }
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    int current_state = lockCurrentState->getVal();
+    LOG(I, "Setting initial GPIO state based on LockCurrentState: %d", current_state);
+    if (lockTargetState->getVal() != current_state) {
+      LOG(I, "Aligning initial target state to current state (%d)", current_state);
+      lock_fsm::post(lock_fsm::ACTUATOR, lock_fsm::reportOf(current_state));
+    }
+    return current_state == lockStates::LOCKED;
   }
-}
-void nfc_gpio_task(void* arg) {
-  uint8_t status = 0;
-  while (1) {
-    if (gpio_led_handle != nullptr) {
-      status = 0;
-      if (uxQueueMessagesWaiting(gpio_led_handle) > 0) {
-        xQueueReceive(gpio_led_handle, &status, 0);
-        LOG(D, "Got something in queue %d", status);
-        switch (status) {
-        case 0:
-          if (espConfig::miscConfig.nfcFailPin && espConfig::miscConfig.nfcFailPin != 255) {
-            LOG(D, "FAIL LED %d:%d", espConfig::miscConfig.nfcFailPin, espConfig::miscConfig.nfcFailHL);
-            digitalWrite(espConfig::miscConfig.nfcFailPin, espConfig::miscConfig.nfcFailHL);
-            vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.nfcFailTime));
-            digitalWrite(espConfig::miscConfig.nfcFailPin, !espConfig::miscConfig.nfcFailHL);
-          }
-          break;
-        case 1:
-          if (espConfig::miscConfig.nfcSuccessPin && espConfig::miscConfig.nfcSuccessPin != 255) {
-            LOG(D, "SUCCESS LED %d:%d", espConfig::miscConfig.nfcSuccessPin, espConfig::miscConfig.nfcSuccessHL);
-            digitalWrite(espConfig::miscConfig.nfcSuccessPin, espConfig::miscConfig.nfcSuccessHL);
-            vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.nfcSuccessTime));
-            digitalWrite(espConfig::miscConfig.nfcSuccessPin, !espConfig::miscConfig.nfcSuccessHL);
-          }
-          break;
-        case 2:
-          if(hkAltActionActive){
-            digitalWrite(espConfig::miscConfig.hkAltActionPin, espConfig::miscConfig.hkAltActionGpioState);
-            vTaskDelay(pdMS_TO_TICKS(espConfig::miscConfig.hkAltActionTimeout));
-            digitalWrite(espConfig::miscConfig.hkAltActionPin, !espConfig::miscConfig.hkAltActionGpioState);
-          }
-          break;
-        default:
-          LOG(I, "STOP");
-          vTaskDelete(NULL);
-          return;
-          break;
-        }
-      }
+
+  /** Tells `lock_fsm` where the lock output is now, the target follows it */
+  void reportLockState(int state) {
+    lock_fsm::post(lock_fsm::ACTUATOR, lock_fsm::reportOf(state));
+  }
+
+  // GPIO, clock and lock_fsm behind the lock output state machine
+  struct lockIo_t
+  {
+    lock_output::config_t config() {
+      const auto& c = espConfig::miscConfig;
+      return { c.gpioActionPin, c.gpioActionLockState, c.gpioActionUnlockState, c.gpioActionMomentaryEnabled, c.gpioActionMomentaryTimeout, c.hkDumbSwitchMode };
+    }
+    int64_t now() { return esp_timer_get_time(); }
+    void write(uint8_t pin, uint8_t level) {
+      LOG(D, "Writing pin %d to level %d", pin, level);
+      digitalWrite(pin, level);
+    }
+    void report(bool locked) { reportLockState(locked ? lockStates::LOCKED : lockStates::UNLOCKED); }
+    bool restore() { return lockInitialState(); }
+  };
+  lockIo_t lockIo;
+  lock_output::Machine<lockIo_t> lockOutput(lockIo);
+
+  void lockAction(const command_t& cmd) {
+    if (espConfig::miscConfig.gpioActionPin == 255 && !espConfig::miscConfig.hkDumbSwitchMode) {
+      LOG(W, "Received lock action but gpioActionPin is disabled (and not dumb mode). Ignoring.");
+      return;
     }
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+    LOG(D, "Lock action: source=%d target state=%d phase=%d", cmd.value, cmd.target, lockOutput.phase());
+    if (lockOutput.action(cmd.value, cmd.target == lockStates::UNLOCKED)) {
+      LOG(I, "Lock pin %d set %lli us after the action was queued", espConfig::miscConfig.gpioActionPin, esp_timer_get_time() - cmd.queuedAt);
+    }
+    deadlines[LOCK] = lockOutput.deadline();
   }
-}
 
-struct LockMechanism : Service::LockMechanism
-{
-  const char* TAG = "LockMechanism";
+  struct rgb_t {
+    uint8_t r, g, b;
+    bool operator==(const rgb_t& other) const { return r == other.r && g == other.g && b == other.b; }
+  };
+  enum color_t : uint8_t { COLOR_OFF, COLOR_SUCCESS, COLOR_FAIL, COLOR_BUSY, COLOR_RECONNECT };
 
-  LockMechanism() : Service::LockMechanism() {
-    LOG(I, "Configuring LockMechanism");
-    lockCurrentState = new Characteristic::LockCurrentState(1, true);
-    lockTargetState = new Characteristic::LockTargetState(1, true);
+  struct keyframe_t {
+    color_t color;
+    uint16_t ms;  // 0: the configured success/fail time
+    bool fade;    // Ramp from the previous color over `ms`, otherwise switch at once and hold
+  };
 
-    // --- Protect read of readerData.reader_gid ---
-    if (readerDataMutex != nullptr) {
-        if (xSemaphoreTake(readerDataMutex, pdMS_TO_TICKS(500)) == pdTRUE) {
-            if(readerData.reader_gid.size() >= 8) {
-                memcpy(ecpData + 8, readerData.reader_gid.data(), 8); // Read shared data
-                with_crc16(ecpData, 16, ecpData + 16);
-            } else {
-                LOG(W, "Reader GID not available/valid size in LockMechanism constructor.");
-            }
-            xSemaphoreGive(readerDataMutex);
-        } else {
-            LOG(E, "Failed to take readerDataMutex in LockMechanism constructor!");
-        }
-    } else {
-         LOG(E, "readerDataMutex not initialized for LockMechanism constructor!");
+  struct effectDef_t {
+    const keyframe_t* frames;
+    uint8_t count;
+    bool loop;
+    uint16_t maxMs; // Looping effects stop on their own after this long, 0 to run until stopped
+  };
+
+  constexpr keyframe_t reconnectFrames[] = { { COLOR_RECONNECT, 100, false }, { COLOR_OFF, 900, false } };
+  constexpr keyframe_t busyFrames[] = { { COLOR_BUSY, 300, true }, { COLOR_OFF, 300, true } };
+  constexpr keyframe_t successFrames[] = { { COLOR_SUCCESS, 0, false }, { COLOR_OFF, 150, true } };
+  constexpr keyframe_t failFrames[] = { { COLOR_FAIL, 0, false }, { COLOR_OFF, 150, true } };
+  constexpr std::array<effectDef_t, EFFECT_COUNT> effects = { {
+    { reconnectFrames, 2, true, 0 },
+    { busyFrames, 2, true, 5000 },
+    { successFrames, 2, false, 0 },
+    { failFrames, 2, false, 0 },
+  } };
+  const int64_t frameUs = 20000; // Frame interval while fading
+
+  std::array<int64_t, EFFECT_COUNT> effectSince{}; // Start of each active effect, 0 if inactive
+  effect_t shown = EFFECT_COUNT;
+  uint8_t frame = 0;
+  int64_t frameStart = 0;
+  rgb_t frameFrom{};
+  rgb_t pixelColor{};
+
+  rgb_t color(color_t color) {
+    using colorMap = espConfig::misc_config_t::colorMap;
+    switch (color) {
+    case COLOR_SUCCESS: {
+      auto& c = espConfig::miscConfig.neopixelSuccessColor;
+      return { uint8_t(c[colorMap::R]), uint8_t(c[colorMap::G]), uint8_t(c[colorMap::B]) };
     }
-  } 
+    case COLOR_FAIL: {
+      auto& c = espConfig::miscConfig.neopixelFailureColor;
+      return { uint8_t(c[colorMap::R]), uint8_t(c[colorMap::G]), uint8_t(c[colorMap::B]) };
+    }
+    case COLOR_BUSY:
+      return { NEOPIXEL_BUSY_R, NEOPIXEL_BUSY_G, NEOPIXEL_BUSY_B };
+    case COLOR_RECONNECT:
+      return { NEOPIXEL_RECONNECT_R, NEOPIXEL_RECONNECT_G, NEOPIXEL_RECONNECT_B };
+    default:
+      return { 0, 0, 0 };
+    }
+  }
 
-  boolean update() {
-    int targetState = lockTargetState->getNewVal();
-    LOG(I, "New LockState=%d, Current LockState=%d", targetState, lockCurrentState->getVal());
+  int64_t frameDuration(effect_t effect, const keyframe_t& kf) {
+    if (kf.ms) return (int64_t)kf.ms * 1000;
+    return (int64_t)(effect == EFFECT_SUCCESS ? espConfig::miscConfig.neopixelSuccessTime : espConfig::miscConfig.neopixelFailTime) * 1000;
+  }
 
-    // Sends the action to the gpio_task queue
-    if ((espConfig::miscConfig.gpioActionPin != 255 && espConfig::miscConfig.hkGpioControlledState) || espConfig::miscConfig.hkDumbSwitchMode) {
-      // Only send to queue if the pin is enabled OR dumb switch mode is on
-      const gpioLockAction gpioAction{ .source = gpioLockAction::HOMEKIT, .action = 0 }; // action 0 = process state change
-      LOG(D, "LockMechanism::update() sending action to gpio_task queue.");
-      // Use a small timeout for the queue send in case the queue is full
-      if (xQueueSend(gpio_lock_handle, &gpioAction, pdMS_TO_TICKS(50)) != pdPASS) {
-           LOG(E, "Failed to send action to gpio_lock_handle queue!");
-      }
+  void showColor(const rgb_t& c) {
+    if (c == pixelColor || !pixel) return;
+    pixelColor = c;
+    if (c == rgb_t{ 0, 0, 0 }) {
+      pixel->off();
     } else {
-         LOG(D, "LockMechanism::update() - GPIO action pin disabled or not HK controlled, not sending to queue.");
+      pixel->set(pixel->RGB(c.r, c.g, c.b));
     }
+  }
 
-    int currentState = lockCurrentState->getNewVal(); // Use getNewVal as it reflects intermediate states maybe? Or getVal()? Test this.
-    if (client != nullptr) {
-        // Report intermediate states if possible (gpio_task might set these)
-        if(currentState == lockStates::UNLOCKING || currentState == lockStates::LOCKING) {
-             esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(currentState).c_str(), 1, 1, true);
-        } else {
-            // Report final target state once reached (gpio_task should update this)
-             esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(targetState).c_str(), 1, 1, true);
-        }
+  /**
+   * Renders the highest priority active effect at `now` and schedules the next frame. A preempting
+   * effect starts from the color currently shown, an effect that ran out hands over to the next
+   * active one.
+   */
+  void renderPixel(int64_t now) {
+    while (true) {
+      int top = EFFECT_COUNT - 1;
+      while (top >= 0 && !effectSince[top]) top--;
+      if (top < 0) {
+        shown = EFFECT_COUNT;
+        showColor({ 0, 0, 0 });
+        deadlines[PIXEL] = 0;
+        return;
+      }
+      const effect_t effect = effect_t(top);
+      const effectDef_t& def = effects[effect];
+      if (def.maxMs && now - effectSince[effect] >= (int64_t)def.maxMs * 1000) {
+        effectSince[effect] = 0;
+        continue;
+      }
+      if (effect != shown) {
+        shown = effect;
+        frame = 0;
+        frameStart = now;
+        frameFrom = pixelColor;
+      }
+      int64_t frameEnd = frameStart + frameDuration(effect, def.frames[frame]);
+      while (frameEnd <= now && frame < def.count) {
+        frameFrom = color(def.frames[frame].color);
+        frameStart = frameEnd;
+        if (++frame == def.count && def.loop) frame = 0;
+        if (frame < def.count) frameEnd = frameStart + frameDuration(effect, def.frames[frame]);
+      }
+      if (frame == def.count) {
+        effectSince[effect] = 0;
+        continue;
+      }
+      const keyframe_t& kf = def.frames[frame];
+      rgb_t target = color(kf.color);
+      int64_t next = frameEnd;
+      if (kf.fade) {
+        int64_t span = frameEnd - frameStart;
+        int64_t t = now - frameStart;
+        target = { uint8_t(frameFrom.r + (target.r - frameFrom.r) * t / span),
+                   uint8_t(frameFrom.g + (target.g - frameFrom.g) * t / span),
+                   uint8_t(frameFrom.b + (target.b - frameFrom.b) * t / span) };
+        next = std::min(next, now + frameUs);
+      }
+      if (def.maxMs) next = std::min(next, effectSince[effect] + (int64_t)def.maxMs * 1000);
+      showColor(target);
+      deadlines[PIXEL] = next;
+      return;
+    }
+  }
 
-      if (espConfig::mqttData.lockEnableCustomState) {
-        if (targetState == lockStates::UNLOCKED) {
-          esp_mqtt_client_publish(client, espConfig::mqttData.lockCustomStateTopic.c_str(), std::to_string(espConfig::mqttData.customLockActions["UNLOCK"]).c_str(), 0, 0, false);
-        } else if (targetState == lockStates::LOCKED) {
-          esp_mqtt_client_publish(client, espConfig::mqttData.lockCustomStateTopic.c_str(), std::to_string(espConfig::mqttData.customLockActions["LOCK"]).c_str(), 0, 0, false);
-        }
+  void setEffect(effect_t effect, bool on, int64_t now) {
+    if (espConfig::miscConfig.nfcNeopixelPin == 255 || !pixel || effect >= EFFECT_COUNT) return;
+    effectSince[effect] = on ? now : 0;
+    if (on && effect == shown) shown = EFFECT_COUNT; // Restart it
+    renderPixel(now);
+  }
+
+  void feedback(bool success) {
+    if (success && espConfig::miscConfig.nfcSuccessPin != 255) {
+      LOG(D, "SUCCESS LED %d:%d", espConfig::miscConfig.nfcSuccessPin, espConfig::miscConfig.nfcSuccessHL);
+      digitalWrite(espConfig::miscConfig.nfcSuccessPin, espConfig::miscConfig.nfcSuccessHL);
+      schedule(SUCCESS_LED, espConfig::miscConfig.nfcSuccessTime);
+    } else if (!success && espConfig::miscConfig.nfcFailPin != 255) {
+      LOG(D, "FAIL LED %d:%d", espConfig::miscConfig.nfcFailPin, espConfig::miscConfig.nfcFailHL);
+      digitalWrite(espConfig::miscConfig.nfcFailPin, espConfig::miscConfig.nfcFailHL);
+      schedule(FAIL_LED, espConfig::miscConfig.nfcFailTime);
+    }
+    // The tap is done, its result replaces the busy effect
+    int64_t now = esp_timer_get_time();
+    effectSince[EFFECT_BUSY] = 0;
+    effectSince[success ? EFFECT_FAIL : EFFECT_SUCCESS] = 0;
+    LOG(D, "%s PIXEL %d", success ? "SUCCESS" : "FAIL", espConfig::miscConfig.nfcNeopixelPin);
+    setEffect(success ? EFFECT_SUCCESS : EFFECT_FAIL, true, now);
+  }
+
+  /** Lights the init LED until the alt action window closes */
+  void altArm() {
+    if (espConfig::miscConfig.hkAltActionInitLedPin != 255) {
+      digitalWrite(espConfig::miscConfig.hkAltActionInitLedPin, HIGH);
+    }
+    deadlines[ALT_INIT_LED] = altArmedUntil.load(std::memory_order_acquire);
+  }
+
+  void altPulse() {
+    if (!altArmed() || espConfig::miscConfig.hkAltActionPin == 255) return;
+    digitalWrite(espConfig::miscConfig.hkAltActionPin, espConfig::miscConfig.hkAltActionGpioState);
+    schedule(ALT_ACTION, espConfig::miscConfig.hkAltActionTimeout);
+  }
+
+  void expire(output_t output) {
+    deadlines[output] = 0;
+    switch (output) {
+    case LOCK:
+      lockOutput.timeout();
+      deadlines[LOCK] = lockOutput.deadline();
+      break;
+    case SUCCESS_LED:
+      if (espConfig::miscConfig.nfcSuccessPin != 255) digitalWrite(espConfig::miscConfig.nfcSuccessPin, !espConfig::miscConfig.nfcSuccessHL);
+      break;
+    case FAIL_LED:
+      if (espConfig::miscConfig.nfcFailPin != 255) digitalWrite(espConfig::miscConfig.nfcFailPin, !espConfig::miscConfig.nfcFailHL);
+      break;
+    case PIXEL:
+      renderPixel(esp_timer_get_time());
+      break;
+    case ALT_ACTION:
+      if (espConfig::miscConfig.hkAltActionPin != 255) digitalWrite(espConfig::miscConfig.hkAltActionPin, !espConfig::miscConfig.hkAltActionGpioState);
+      break;
+    case ALT_INIT_LED:
+      if (espConfig::miscConfig.hkAltActionInitLedPin != 255) digitalWrite(espConfig::miscConfig.hkAltActionInitLedPin, LOW);
+      LOG(D, "Alt action window closed");
+      break;
+    default:
+      break;
+    }
+  }
+
+  /** Tap feedback and the NeoPixel effects follow the NFC events */
+  void onEvent(const events::event_t& ev) {
+    if (ev.topic == events::TAP) {
+      if (ev.tap.result == events::TAP_DETECTED) {
+        setEffect(EFFECT_BUSY, true, esp_timer_get_time());
+      } else {
+        feedback(ev.tap.result == events::TAP_SUCCESS);
+      }
+    } else if (ev.topic == events::NFC) {
+      setEffect(EFFECT_RECONNECT, !ev.nfc.connected, esp_timer_get_time());
+    }
+  }
+
+  void wake(void* arg) {
+    post(EVENTS);
+  }
+
+  void actuator_task(void* arg) {
+    command_t cmd;
+    LOG(I, "Actuator task started.");
+    while (true) {
+      if (xQueueReceive(queue, &cmd, portMAX_DELAY) != pdPASS) {
+        continue;
+      }
+      switch (cmd.type) {
+      case LOCK_INIT:
+        lockOutput.start();
+        deadlines[LOCK] = lockOutput.deadline();
+        break;
+      case LOCK_ACTION:
+        lockAction(cmd);
+        break;
+      case ALT_ARM:
+        altArm();
+        break;
+      case ALT_PULSE:
+        altPulse();
+        break;
+      case PIXEL_INIT:
+        // `pixel` is only used by this task once it runs, so it is created here too
+        if (!pixel) pixel = std::make_shared<Pixel>(cmd.value, pixelTypeMap[espConfig::miscConfig.neoPixelType]);
+        break;
+      default:
+        break;
+      }
+      // Any wakeup drains the bus events and runs the due outputs, so a wakeup dropped on a full queue is not lost
+      events::event_t ev;
+      while (subscriber >= 0 && events::bus.receive(subscriber, ev)) {
+        onEvent(ev);
       }
-    } else LOG(W, "MQTT Client not initialized, cannot publish message");
+      int64_t now = esp_timer_get_time();
+      for (size_t i = 0; i < deadlines.size(); i++) {
+        if (deadlines[i] && deadlines[i] <= now) expire(output_t(i));
+      }
+      rearm();
+    }
+  }
+
+  void begin() {
+    queue = xQueueCreate(8, sizeof(command_t));
+    subscriber = events::bus.subscribe("actuator", events::bit(events::TAP) | events::bit(events::NFC), wake);
+    const esp_timer_create_args_t args = { .callback = onTimer, .arg = nullptr, .dispatch_method = ESP_TIMER_TASK, .name = "actuator", .skip_unhandled_events = true };
+    esp_timer_create(&args, &timer);
+    task_plan::create(actuator_task, "actuator_task", NULL, &task);
+    if (espConfig::miscConfig.gpioActionPin != 255) {
+      post(LOCK_INIT);
+    }
+    if (espConfig::miscConfig.hkAltActionInitPin != 255) {
+      buttons::add({ .pin = espConfig::miscConfig.hkAltActionInitPin, .mode = INPUT, .activeHigh = true, .debounceMs = 20, .holdMs = 0, .doubleMs = 0, .handler = altButton });
+    }
+  }
+
+  /** Pulses the alt action pin if the alt action window is open */
+  void altAction() {
+    post(ALT_PULSE);
+  }
+
+  /**
+   * Moves the lock output to `target`, only `lock_fsm` calls this.
+   *
+   * @param source A `gpioLockAction` source, checked against the momentary setting
+   * @return true if the lock action was queued
+   */
+  bool lock(uint8_t source, uint8_t target) {
+    // Use a small timeout for the queue send in case the queue is full
+    return post(LOCK_ACTION, source, target, pdMS_TO_TICKS(50));
+  }
+}
+
+struct LockMechanism : Service::LockMechanism
+{
+  const char* TAG = "LockMechanism";
+
+  LockMechanism() : Service::LockMechanism() {
+    LOG(I, "Configuring LockMechanism");
+    lockCurrentState = new Characteristic::LockCurrentState(1, true);
+    lockTargetState = new Characteristic::LockTargetState(1, true);
+
+    // --- Protect read of readerData.reader_gid ---
+    if (readerDataMutex != nullptr) {
+        if (xSemaphoreTake(readerDataMutex, pdMS_TO_TICKS(500)) == pdTRUE) {
+            if(readerData.reader_gid.size() >= 8) {
+                memcpy(ecpData + 8, readerData.reader_gid.data(), 8); // Read shared data
+                with_crc16(ecpData, 16, ecpData + 16);
+            } else {
+                LOG(W, "Reader GID not available/valid size in LockMechanism constructor.");
+            }
+            xSemaphoreGive(readerDataMutex);
+        } else {
+            LOG(E, "Failed to take readerDataMutex in LockMechanism constructor!");
+        }
+    } else {
+         LOG(E, "readerDataMutex not initialized for LockMechanism constructor!");
+    }
+  } 
 
+  boolean update() {
+    int targetState = lockTargetState->getNewVal();
+    LOG(I, "New LockState=%d, Current LockState=%d", targetState, lockCurrentState->getVal());
+    // HomeSpan sets the target itself, so it isn't reported by lock_fsm
+    lock_fsm::notify(lockCurrentState->getVal(), targetState);
+    lock_fsm::handle(lock_fsm::HOMEKIT, lock_fsm::commandOf(targetState));
     // HomeSpan expects update() to return true if the action is accepted.
-    // Since we delegate to gpio_task, we should usually return true here.
+    // Since we delegate to the actuator task, we should usually return true here.
     return (true);
   }
 };
@@ -1082,79 +1876,34 @@ void print_issuers(const char* buf) {
  *  received custom state value
  */
 void set_custom_state_handler(esp_mqtt_client_handle_t client, int state) {
-  // Ensure states that imply an ACTION (like UNLOCKING/LOCKING) primarily set the target state.
-  // States that just REPORT status (like UNLOCKED/LOCKED/JAMMED) should set the current state.
-
-  if (espConfig::mqttData.customLockStates["C_UNLOCKING"] == state) {
-    LOG(I, "MQTT set_custom_state_handler: Received C_UNLOCKING. Setting target state.");
-    lockTargetState->setVal(lockStates::UNLOCKED); // Use Target State to trigger action
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::UNLOCKING).c_str(), 0, 1, true);
-    return;
-  } else if (espConfig::mqttData.customLockStates["C_LOCKING"] == state) {
-    LOG(I, "MQTT set_custom_state_handler: Received C_LOCKING. Setting target state.");
-    lockTargetState->setVal(lockStates::LOCKED); // Use Target State to trigger action
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::LOCKING).c_str(), 0, 1, true);
-    return;
-  } else if (espConfig::mqttData.customLockStates["C_UNLOCKED"] == state) {
-     LOG(I, "MQTT set_custom_state_handler: Received C_UNLOCKED. Updating current state.");
-    // This reports the lock IS unlocked. Only update CurrentState.
-    // Don't call digitalWrite here. If the GPIO needs setting, the source should ensure it happened.
-    lockCurrentState->setVal(lockStates::UNLOCKED);
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::UNLOCKED).c_str(), 0, 1, true);
-    return;
-  } else if (espConfig::mqttData.customLockStates["C_LOCKED"] == state) {
-     LOG(I, "MQTT set_custom_state_handler: Received C_LOCKED. Updating current state.");
-    // This reports the lock IS locked. Only update CurrentState.
-    lockCurrentState->setVal(lockStates::LOCKED);
-    // Optional: Ensure TargetState matches if necessary?
-    // if(lockTargetState->getVal() != lockStates::LOCKED) lockTargetState->setVal(lockStates::LOCKED);
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::LOCKED).c_str(), 0, 1, true);
-    return;
-  } else if (espConfig::mqttData.customLockStates["C_JAMMED"] == state) {
-    LOG(I, "MQTT set_custom_state_handler: Received C_JAMMED. Updating current state.");
-    lockCurrentState->setVal(lockStates::JAMMED);
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::JAMMED).c_str(), 0, 1, true);
-    return;
-  } else if (espConfig::mqttData.customLockStates["C_UNKNOWN"] == state) {
-    LOG(I, "MQTT set_custom_state_handler: Received C_UNKNOWN. Updating current state.");
-    lockCurrentState->setVal(lockStates::UNKNOWN);
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::UNKNOWN).c_str(), 0, 1, true);
-    return;
+  // C_UNLOCKING/C_LOCKING mean the external lock started moving, the other states report where it is
+  const std::array<std::pair<const char*, lock_fsm::event_t>, 6> customEvents = { {
+    { "C_UNLOCKING", lock_fsm::CMD_UNLOCK }, { "C_LOCKING", lock_fsm::CMD_LOCK }, { "C_UNLOCKED", lock_fsm::IS_UNLOCKED },
+    { "C_LOCKED", lock_fsm::IS_LOCKED }, { "C_JAMMED", lock_fsm::IS_JAMMED }, { "C_UNKNOWN", lock_fsm::IS_UNKNOWN } } };
+  for (auto&& [name, event] : customEvents) {
+    if (espConfig::mqttData.customLockStates[name] == state) {
+      LOG(I, "MQTT set_custom_state_handler: Received %s.", name);
+      lock_fsm::post(lock_fsm::MQTT_CUSTOM, event);
+      return;
+    }
   }
   LOG(W, "MQTT set_custom_state_handler: Update state failed! Received invalid custom state value: %d", state);
 }
 
+/**
+ * Handles `lockStateCmd`: UNLOCKED/LOCKED are commands, JAMMED/UNKNOWN only report the current state.
+ */
 void set_state_handler(esp_mqtt_client_handle_t client, int state) {
-  switch (state) {
-  case lockStates::UNLOCKED:
-    // REMOVE: digitalWrite call block
-    LOG(I, "MQTT set_state_handler: Received UNLOCK command. Setting target state.");
-    lockTargetState->setVal(state); // Trigger HomeKit update -> LockMechanism::update -> gpio_task
-    // lockCurrentState->setVal(state); // Don't set current state here, let gpio_task confirm it
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::UNLOCKING).c_str(), 0, 1, true); // Publish UNLOCKING state
-    if (espConfig::mqttData.lockEnableCustomState) {
-      esp_mqtt_client_publish(client, espConfig::mqttData.lockCustomStateTopic.c_str(), std::to_string(espConfig::mqttData.customLockActions["UNLOCK"]).c_str(), 0, 0, false);
-    }
-    break;
-  case lockStates::LOCKED:
-    LOG(I, "MQTT set_state_handler: Received LOCK command. Setting target state.");
-    lockTargetState->setVal(state); // Trigger HomeKit update -> LockMechanism::update -> gpio_task
-    // lockCurrentState->setVal(state); // Don't set current state here
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockStates::LOCKING).c_str(), 0, 1, true); // Publish LOCKING state
-    if (espConfig::mqttData.lockEnableCustomState) {
-      esp_mqtt_client_publish(client, espConfig::mqttData.lockCustomStateTopic.c_str(), std::to_string(espConfig::mqttData.customLockActions["LOCK"]).c_str(), 0, 0, false);
-    }
-    break;
-  case lockStates::JAMMED: // These only update CURRENT state, no physical action triggered
-  case lockStates::UNKNOWN:
-    LOG(I, "MQTT set_state_handler: Received non-actionable state %d. Updating current state.", state);
-    lockCurrentState->setVal(state);
-    esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(state).c_str(), 0, 1, true);
-    break;
-  default:
+  lock_fsm::event_t event = lock_fsm::commandOf(state);
+  if (event == lock_fsm::EVENT_COUNT && (state == lockStates::JAMMED || state == lockStates::UNKNOWN)) {
+    event = lock_fsm::reportOf(state);
+  }
+  if (event == lock_fsm::EVENT_COUNT) {
     LOG(W, "MQTT set_state_handler: Update state failed! Received invalid state value: %d", state);
-    break;
+    return;
   }
+  LOG(I, "MQTT set_state_handler: Received state %d.", state);
+  lock_fsm::post(lock_fsm::MQTT, event);
 }
 
 void mqtt_connected_event(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
@@ -1227,6 +1976,46 @@ void mqtt_connected_event(void* event_handler_arg, esp_event_base_t event_base,
     std::string lockConfigTopic;
     lockConfigTopic.append("homeassistant/lock/").append(espConfig::mqttData.mqttClientId.c_str()).append("/lock/config");
     esp_mqtt_client_publish(client, lockConfigTopic.c_str(), bufferpub.c_str(), bufferpub.length(), 1, true);
+    if (espConfig::mqttData.telemetryInterval > 0) {
+      // `key` is the path in the telemetry JSON, nested keys are joined with '.'
+      struct { const char* key; const char* name; const char* unit; const char* devClass; } sensors[] = {
+        {"hf", "Free Heap", "B", "data_size"},
+        {"hm", "Minimum Free Heap", "B", "data_size"},
+        {"hb", "Largest Free Block", "B", "data_size"},
+        {"nr", "NFC Loop Rate", "Hz", "frequency"},
+        {"rc", "PN532 Reconnects", nullptr, nullptr},
+        {"rssi", "WiFi RSSI", "dBm", "signal_strength"},
+        {"mq", "MQTT Outbox Size", "B", "data_size"},
+        {"up", "Uptime", "s", "duration"},
+        {"st.nfc", "NFC Task Free Stack", "B", "data_size"},
+        {"st.act", "Actuator Task Free Stack", "B", "data_size"},
+        {"st.telem", "Telemetry Task Free Stack", "B", "data_size"},
+        {"tl.n", "Taps", nullptr, nullptr},
+        {"tl.min", "Minimum Tap Latency", "ms", "duration"},
+        {"tl.avg", "Average Tap Latency", "ms", "duration"},
+        {"tl.max", "Maximum Tap Latency", "ms", "duration"},
+        {"tl.jit", "Tap Latency Jitter", "ms", "duration"},
+      };
+      for (auto&& sensor : sensors) {
+        std::string id = sensor.key;
+        std::replace(id.begin(), id.end(), '.', '_');
+        payload = json();
+        payload["name"] = sensor.name;
+        payload["state_topic"] = espConfig::mqttData.telemetryTopic;
+        payload["value_template"] = std::string("{{ value_json.").append(sensor.key).append(" }}");
+        payload["availability_topic"] = espConfig::mqttData.lwtTopic;
+        payload["unique_id"] = std::string(hap_id_str).append("_").append(id);
+        payload["entity_category"] = "diagnostic";
+        payload["state_class"] = sensor.key == std::string("rc") ? "total_increasing" : "measurement";
+        if (sensor.unit) payload["unit_of_measurement"] = sensor.unit;
+        if (sensor.devClass) payload["device_class"] = sensor.devClass;
+        payload["device"] = device;
+        bufferpub = payload.dump();
+        std::string sensorTopic;
+        sensorTopic.append("homeassistant/sensor/").append(espConfig::mqttData.mqttClientId).append("/").append(id).append("/config");
+        esp_mqtt_client_publish(client, sensorTopic.c_str(), bufferpub.c_str(), bufferpub.length(), 1, true);
+      }
+    }
     LOG(D, "MQTT PUBLISHED DISCOVERY");
   }
   esp_mqtt_client_publish(client, espConfig::mqttData.lwtTopic.c_str(), "online", 6, 1, true);
@@ -1254,23 +2043,489 @@ void mqtt_data_handler(void* event_handler_arg, esp_event_base_t event_base, int
   } else if (!strcmp(espConfig::mqttData.lockStateCmd.c_str(), topic.c_str())) {
     set_state_handler(client, state);
   } else if (!strcmp(espConfig::mqttData.lockTStateCmd.c_str(), topic.c_str())) {
-    if (state == lockStates::UNLOCKED || state == lockStates::LOCKED) {
-      lockTargetState->setVal(state);
-      esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), state == lockStates::UNLOCKED ? std::to_string(lockStates::UNLOCKING).c_str() : std::to_string(lockStates::LOCKING).c_str(), 0, 1, true);
+    if (lock_fsm::commandOf(state) != lock_fsm::EVENT_COUNT) {
+      lock_fsm::post(lock_fsm::MQTT, lock_fsm::commandOf(state));
     }
   } else if (!strcmp(espConfig::mqttData.lockCStateCmd.c_str(), topic.c_str())) {
-    if (state == lockStates::UNLOCKED || state == lockStates::LOCKED || state == lockStates::JAMMED || state == lockStates::UNKNOWN) {
-      lockCurrentState->setVal(state);
-      esp_mqtt_client_publish(client, espConfig::mqttData.lockStateTopic.c_str(), std::to_string(lockCurrentState->getVal()).c_str(), 0, 1, true);
+    if (lock_fsm::reportOf(state) != lock_fsm::EVENT_COUNT) {
+      lock_fsm::post(lock_fsm::MQTT, lock_fsm::reportOf(state));
     }
   } else if (!strcmp(espConfig::mqttData.btrLvlCmdTopic.c_str(), topic.c_str())) {
-    btrLevel->setVal(state);
-    if (state <= espConfig::miscConfig.btrLowStatusThreshold) {
-      statusLowBtr->setVal(1);
+    events::event_t ev{};
+    ev.topic = events::BATTERY;
+    ev.battery.level = state;
+    events::publish(ev);
+  }
+}
+
+/**
+ * Tap latency from the detection of a card to its published result, HomeKey authentication
+ * included. Summarised per telemetry interval so jitter under web and MQTT load is visible.
+ */
+namespace tap_latency {
+  struct summary_t {
+    uint32_t count;
+    uint32_t minUs;
+    uint32_t avgUs;
+    uint32_t maxUs;
+    uint32_t jitterUs; // Standard deviation
+  };
+
+  portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  uint32_t count = 0;
+  uint32_t minUs = UINT32_MAX;
+  uint32_t maxUs = 0;
+  uint64_t sum = 0;
+  uint64_t sumSquares = 0;
+
+  /** Stamps the tap result in `tapEvent` with its latency since `detectedAt`, records and publishes it */
+  void publish(events::event_t& tapEvent, int64_t detectedAt) {
+    uint32_t latency = esp_timer_get_time() - detectedAt;
+    tapEvent.tap.latencyUs = latency;
+    portENTER_CRITICAL(&lock);
+    count++;
+    minUs = std::min(minUs, latency);
+    maxUs = std::max(maxUs, latency);
+    sum += latency;
+    sumSquares += (uint64_t)latency * latency;
+    portEXIT_CRITICAL(&lock);
+    events::publish(tapEvent);
+  }
+
+  /** @return The summary of the taps since the previous call, which starts a new interval */
+  summary_t take() {
+    portENTER_CRITICAL(&lock);
+    uint32_t n = count, lowest = minUs, highest = maxUs;
+    uint64_t total = sum, squares = sumSquares;
+    count = 0;
+    minUs = UINT32_MAX;
+    maxUs = 0;
+    sum = sumSquares = 0;
+    portEXIT_CRITICAL(&lock);
+    summary_t summary{};
+    if (n == 0) return summary;
+    double mean = (double)total / n;
+    summary.count = n;
+    summary.minUs = lowest;
+    summary.avgUs = mean;
+    summary.maxUs = highest;
+    summary.jitterUs = sqrt(std::max(0.0, (double)squares / n - mean * mean));
+    return summary;
+  }
+}
+
+struct telemetrySample_t
+{
+  uint32_t uptime;
+  uint32_t heapFree;
+  uint32_t heapMin;
+  uint32_t heapMaxBlock;
+  uint32_t nfcLoopRate; // loops per second, scaled by 10
+  uint32_t pn532Reconnects;
+  int8_t rssi;
+  bool ethLink;
+  int mqttOutbox;
+  uint32_t mqttConnectTime; // ms spent establishing the last broker connection
+  uint32_t busDropped; // events dropped by event bus subscribers since boot
+  tap_latency::summary_t taps; // taps since the previous sample
+  std::array<int32_t, 3> stackHwm; // -1 when the task is not running
+};
+
+// Short names used as JSON keys for the task stack high-water marks, same order as in telemetry_sample
+const std::array<const char*, 3> telemetryTaskNames = { "nfc", "act", "telem" };
+
+/**
+ * Fills `sample` with the current device health readings, only reads counters and
+ * system state so it is safe to call periodically without touching the heap.
+ *
+ * @param sample Sample to be filled
+ * @param lastLoops NFC loop counter at the previous sample, updated in place
+ * @param lastTime Timestamp in us of the previous sample, updated in place
+ */
+void telemetry_sample(telemetrySample_t& sample, uint32_t& lastLoops, int64_t& lastTime) {
+  int64_t now = esp_timer_get_time();
+  uint32_t loops = nfcLoopCount.load(std::memory_order_relaxed);
+  sample.uptime = now / 1000000;
+  sample.heapFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  sample.heapMin = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  sample.heapMaxBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  sample.nfcLoopRate = now > lastTime ? (uint64_t)(loops - lastLoops) * 10000000 / (now - lastTime) : 0;
+  sample.pn532Reconnects = pn532ReconnectCount.load(std::memory_order_relaxed);
+  sample.ethLink = espConfig::miscConfig.ethernetEnabled && ETH.linkUp();
+  sample.rssi = espConfig::miscConfig.ethernetEnabled ? 0 : WiFi.RSSI();
+  sample.mqttOutbox = client ? esp_mqtt_client_get_outbox_size(client) : -1;
+  sample.mqttConnectTime = mqttConnectTime.load(std::memory_order_relaxed);
+  sample.busDropped = events::dropped.load(std::memory_order_relaxed);
+  sample.taps = tap_latency::take();
+  const std::array<TaskHandle_t, 3> tasks = { nfc_poll_task, actuator::task, telemetry_task_handle };
+  for (size_t i = 0; i < tasks.size(); i++) {
+    sample.stackHwm[i] = tasks[i] != nullptr ? uxTaskGetStackHighWaterMark(tasks[i]) : -1;
+  }
+  lastLoops = loops;
+  lastTime = now;
+}
+
+/**
+ * Encodes a telemetry sample as compact JSON into `buf`.
+ *
+ * @return Number of characters written, 0 if the buffer was too small
+ */
+size_t telemetry_encode(const telemetrySample_t& sample, char* buf, size_t size) {
+  int len = snprintf(buf, size, "{\"up\":%lu,\"hf\":%lu,\"hm\":%lu,\"hb\":%lu,\"nr\":%lu.%lu,\"rc\":%lu,\"rssi\":%d,\"eth\":%d,\"mq\":%d,\"mc\":%lu,\"bd\":%lu,"
+    "\"tl\":{\"n\":%lu,\"min\":%lu,\"avg\":%lu,\"max\":%lu,\"jit\":%lu},\"st\":{",
+    (unsigned long)sample.uptime, (unsigned long)sample.heapFree, (unsigned long)sample.heapMin, (unsigned long)sample.heapMaxBlock,
+    (unsigned long)(sample.nfcLoopRate / 10), (unsigned long)(sample.nfcLoopRate % 10), (unsigned long)sample.pn532Reconnects,
+    sample.rssi, sample.ethLink, sample.mqttOutbox, (unsigned long)sample.mqttConnectTime, (unsigned long)sample.busDropped,
+    (unsigned long)sample.taps.count, (unsigned long)(sample.taps.minUs / 1000), (unsigned long)(sample.taps.avgUs / 1000),
+    (unsigned long)(sample.taps.maxUs / 1000), (unsigned long)(sample.taps.jitterUs / 1000));
+  bool first = true;
+  for (size_t i = 0; i < sample.stackHwm.size() && len > 0 && (size_t)len < size; i++) {
+    if (sample.stackHwm[i] < 0) continue;
+    len += snprintf(buf + len, size - len, "%s\"%s\":%ld", first ? "" : ",", telemetryTaskNames[i], (long)sample.stackHwm[i]);
+    first = false;
+  }
+  if (len > 0 && (size_t)len < size) {
+    len += snprintf(buf + len, size - len, "}}");
+  }
+  return (len > 0 && (size_t)len < size) ? len : 0;
+}
+
+void telemetry_task(void* arg) {
+  const char* TAG = "telemetry";
+  static telemetrySample_t sample;
+  static char buf[384];
+  uint32_t lastLoops = nfcLoopCount.load(std::memory_order_relaxed);
+  int64_t lastTime = esp_timer_get_time();
+  LOG(I, "Publishing telemetry every %d seconds", espConfig::mqttData.telemetryInterval);
+  while (1) {
+    vTaskDelay(pdMS_TO_TICKS(espConfig::mqttData.telemetryInterval * 1000));
+    telemetry_sample(sample, lastLoops, lastTime);
+    size_t len = telemetry_encode(sample, buf, sizeof(buf));
+    if (len == 0) {
+      LOG(E, "Telemetry payload does not fit the buffer!");
+      continue;
+    }
+    LOG(D, "%s", buf);
+    ui_events::pushMetrics(buf, len);
+    if (client != nullptr) {
+      esp_mqtt_client_publish(client, espConfig::mqttData.telemetryTopic.c_str(), buf, len, 0, false);
+    }
+  }
+}
+
+/**
+ * Task profiler. Samples the stack high-water mark and CPU time of every task, HomeSpan's loop,
+ * AsyncTCP and the IDF tasks included, and keeps the lowest free stack seen per task in RTC
+ * memory, so the peaks of a run that ended in a panic or watchdog reset survive the reboot (a
+ * power-on reset clears them). For the tasks with a known stack size a recommended size (peak
+ * use plus `headroom`) is derived. Peaks are published retained to `<telemetryTopic>/tasks`
+ * whenever one drops, and are available on `/tasks` and the `@T` serial command.
+ */
+namespace task_profiler {
+  const char* TAG = "task_profiler";
+
+  const size_t maxTasks = 32;
+  const uint32_t sampleMs = 5000;
+  const uint32_t headroom = 1024; // Free stack a recommended size keeps on top of the peak use
+  const uint32_t peaksMagic = 0x54505231;
+
+  struct stackSize_t {
+    const char* name;
+    uint32_t size;
+  };
+
+  // Stack sizes of the tasks created by the libraries, the firmware's own come from `task_plan`
+  const std::array<stackSize_t, 3> stackSizes = { {
+#ifdef CONFIG_ARDUINO_LOOP_STACK_SIZE
+    { "loopTask", CONFIG_ARDUINO_LOOP_STACK_SIZE },
+#else
+    { "loopTask", 8192 },
+#endif
+#ifdef CONFIG_ASYNC_TCP_STACK_SIZE
+    { "async_tcp", CONFIG_ASYNC_TCP_STACK_SIZE },
+#else
+    { "async_tcp", 8192 * 2 },
+#endif
+#ifdef CONFIG_MQTT_TASK_STACK_SIZE
+    { "mqtt_task", CONFIG_MQTT_TASK_STACK_SIZE },
+#else
+    { "mqtt_task", 6144 },
+#endif
+  } };
+
+  struct peak_t {
+    char name[configMAX_TASK_NAME_LEN];
+    uint32_t minFree;
+  };
+
+  struct peaks_t {
+    uint32_t magic;
+    uint32_t count;
+    std::array<peak_t, maxTasks> tasks;
+    uint32_t checksum;
+  };
+
+  struct stat_t {
+    TaskHandle_t handle;
+    char name[configMAX_TASK_NAME_LEN];
+    int8_t core; // -1 when not pinned or unknown
+    uint8_t priority;
+    uint16_t cpu; // Share of the total CPU time over the last sample, in 0.1 %
+    uint32_t runTime;
+    uint32_t free;
+    uint32_t peak; // Lowest free stack since the last power-on
+    uint32_t size; // 0 when unknown
+  };
+
+  RTC_NOINIT_ATTR peaks_t peaks;
+  std::array<stat_t, maxTasks> stats{};
+  size_t statCount = 0;
+  SemaphoreHandle_t statsMutex = nullptr;
+  TaskHandle_t task = nullptr;
+
+  uint32_t checksum() {
+    uint32_t sum = peaks.magic ^ peaks.count;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(peaks.tasks.data());
+    for (size_t i = 0; i < sizeof(peaks.tasks); i++) {
+      sum = (sum << 5) + sum + data[i];
+    }
+    return sum;
+  }
+
+  uint32_t stackSize(const char* name) {
+    if (const task_plan::placement_t* placement = task_plan::find(name)) return placement->stack;
+    for (auto&& known : stackSizes) {
+      if (strncmp(known.name, name, configMAX_TASK_NAME_LEN - 1) == 0) return known.size;
+    }
+    return 0;
+  }
+
+  /** @return The recommended stack size in bytes, rounded up to 256, 0 when the size is unknown */
+  uint32_t recommended(const stat_t& stat) {
+    if (!stat.size || stat.peak > stat.size) return 0;
+    return (stat.size - stat.peak + headroom + 255) & ~255u;
+  }
+
+  /** Updates the RTC peak of `name` with `free` and returns the lowest value seen so far */
+  uint32_t updatePeak(const char* name, uint32_t free, bool& changed) {
+    for (size_t i = 0; i < peaks.count; i++) {
+      peak_t& peak = peaks.tasks[i];
+      if (strncmp(peak.name, name, sizeof(peak.name)) != 0) continue;
+      if (free < peak.minFree) {
+        peak.minFree = free;
+        changed = true;
+      }
+      return peak.minFree;
+    }
+    if (peaks.count < maxTasks) {
+      peak_t& peak = peaks.tasks[peaks.count++];
+      strlcpy(peak.name, name, sizeof(peak.name));
+      peak.minFree = free;
+      changed = true;
+    }
+    return free;
+  }
+
+  /**
+   * Only runs in the profiler task. The task tables are static, they would take about 2.6 KB of
+   * its stack otherwise.
+   *
+   * @return true if a peak dropped
+   */
+  bool sample() {
+#if configUSE_TRACE_FACILITY
+    static std::array<TaskStatus_t, maxTasks> status;
+    static std::array<stat_t, maxTasks> previous;
+    static uint32_t lastTotal = 0;
+    uint32_t total = 0;
+    UBaseType_t count = uxTaskGetSystemState(status.data(), status.size(), &total);
+    if (count == 0) {
+      LOG(W, "More than %u tasks, not sampled", maxTasks);
+      return false;
+    }
+    uint32_t elapsed = (total - lastTotal) * portNUM_PROCESSORS;
+    lastTotal = total;
+    bool changed = false;
+    xSemaphoreTake(statsMutex, portMAX_DELAY);
+    previous = stats;
+    size_t previousCount = statCount;
+    for (size_t i = 0; i < count; i++) {
+      const TaskStatus_t& ts = status[i];
+      stat_t& stat = stats[i];
+      stat.handle = ts.xHandle;
+      strlcpy(stat.name, ts.pcTaskName, sizeof(stat.name));
+#if configTASKLIST_INCLUDE_COREID
+      stat.core = ts.xCoreID < portNUM_PROCESSORS ? ts.xCoreID : -1;
+#else
+      stat.core = -1;
+#endif
+      stat.priority = ts.uxCurrentPriority;
+#if configGENERATE_RUN_TIME_STATS
+      stat.runTime = ts.ulRunTimeCounter;
+#else
+      stat.runTime = 0;
+#endif
+      stat.cpu = 0;
+      for (size_t j = 0; j < previousCount; j++) {
+        if (previous[j].handle == ts.xHandle) {
+          stat.cpu = elapsed ? (uint64_t)(stat.runTime - previous[j].runTime) * 1000 / elapsed : 0;
+          break;
+        }
+      }
+      stat.free = ts.usStackHighWaterMark;
+      stat.size = stackSize(stat.name);
+      stat.peak = updatePeak(stat.name, stat.free, changed);
+    }
+    statCount = count;
+    peaks.checksum = checksum();
+    xSemaphoreGive(statsMutex);
+    return changed;
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * Renders the profile as `{"tasks":[...]}` straight into a string, one fixed-format entry per
+   * task, so publishing from the profiler task doesn't build a json tree on its small stack.
+   */
+  std::string render() {
+    std::string out = "{\"tasks\":[";
+    char entry[160];
+    xSemaphoreTake(statsMutex, portMAX_DELAY);
+    out.reserve(out.size() + statCount * 120 + 2);
+    for (size_t i = 0; i < statCount; i++) {
+      const stat_t& stat = stats[i];
+      snprintf(entry, sizeof(entry), "%s{\"name\":\"%s\",\"core\":%d,\"prio\":%u,\"cpu\":%u.%u,\"free\":%lu,\"peak\":%lu,\"size\":%lu,\"rec\":%lu}",
+        i ? "," : "", stat.name, stat.core, stat.priority, stat.cpu / 10, stat.cpu % 10, (unsigned long)stat.free, (unsigned long)stat.peak,
+        (unsigned long)stat.size, (unsigned long)recommended(stat));
+      out.append(entry);
+    }
+    xSemaphoreGive(statsMutex);
+    out.append("]}");
+    return out;
+  }
+
+  void publish() {
+    if (client == nullptr || espConfig::mqttData.telemetryTopic.empty()) return;
+    std::string topic = espConfig::mqttData.telemetryTopic + "/tasks";
+    std::string payload = render();
+    esp_mqtt_client_publish(client, topic.c_str(), payload.c_str(), payload.length(), 0, true);
+  }
+
+  /** Serial command `@T` prints the profile, `@T0` clears the peaks */
+  void printCommand(const char* arg) {
+    if (statsMutex == nullptr) return;
+    if (arg[1] == '0') {
+      xSemaphoreTake(statsMutex, portMAX_DELAY);
+      peaks.count = 0;
+      peaks.checksum = checksum();
+      xSemaphoreGive(statsMutex);
+      LOG(I, "Task stack peaks cleared");
+      return;
+    }
+    LOG(I, "%-16s %4s %4s %6s %6s %6s %6s %6s", "task", "core", "prio", "cpu%", "free", "peak", "size", "rec");
+    xSemaphoreTake(statsMutex, portMAX_DELAY);
+    for (size_t i = 0; i < statCount; i++) {
+      const stat_t& stat = stats[i];
+      LOG(I, "%-16s %4d %4u %4u.%u %6lu %6lu %6lu %6lu", stat.name, stat.core, stat.priority, stat.cpu / 10, stat.cpu % 10,
+        (unsigned long)stat.free, (unsigned long)stat.peak, (unsigned long)stat.size, (unsigned long)recommended(stat));
+    }
+    xSemaphoreGive(statsMutex);
+  }
+
+  void profiler_task(void* arg) {
+    while (true) {
+      if (sample()) {
+        publish();
+      }
+      vTaskDelay(pdMS_TO_TICKS(sampleMs));
+    }
+  }
+
+  void begin() {
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (peaks.magic != peaksMagic || peaks.count > maxTasks || peaks.checksum != checksum() || reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT) {
+      peaks.magic = peaksMagic;
+      peaks.count = 0;
+      peaks.checksum = checksum();
     } else {
-      statusLowBtr->setVal(0);
+      LOG(I, "Kept the stack peaks of %lu tasks over reset (reason %d)", (unsigned long)peaks.count, reason);
+    }
+    statsMutex = xSemaphoreCreateMutex();
+    task_plan::create(profiler_task, "profiler_task", NULL, &task);
+  }
+}
+
+int64_t mqttConnectStart = 0;
+
+/**
+ * Measures how long each (re)connection to the broker takes, from the moment the client
+ * starts connecting until the broker acknowledges the session, TLS handshake included.
+ */
+void mqtt_connect_timing_handler(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  if (event_id == MQTT_EVENT_BEFORE_CONNECT) {
+    mqttConnectStart = esp_timer_get_time();
+  } else if (event_id == MQTT_EVENT_CONNECTED && mqttConnectStart != 0) {
+    uint32_t elapsed = (esp_timer_get_time() - mqttConnectStart) / 1000;
+    mqttConnectTime.store(elapsed, std::memory_order_relaxed);
+    LOG(I, "MQTT connection established in %lu ms (%s)", (unsigned long)elapsed, espConfig::mqttData.mqttTlsEnabled ? (espConfig::mqttData.mqttPskIdentity.empty() ? "TLS" : "TLS-PSK") : "TCP");
+  }
+}
+
+std::string mqttCaCert;
+std::vector<uint8_t> mqttPskKeyBin;
+psk_hint_key_t mqttPskHintKey;
+const size_t mqttPskMaxLen = 32; // MBEDTLS_PSK_MAX_LEN
+
+/**
+ * Decodes the hex PSK in `hex` into `key`.
+ *
+ * @return false if `hex` is empty, has an odd length, a character that is not hex or is longer
+ * than `mqttPskMaxLen` bytes, `key` is left empty then
+ */
+bool mqtt_psk_decode(const std::string& hex, std::vector<uint8_t>& key) {
+  key.clear();
+  if (hex.empty() || hex.size() % 2 || hex.size() / 2 > mqttPskMaxLen ||
+      std::find_if(hex.begin(), hex.end(), [](unsigned char c) { return !std::isxdigit(c); }) != hex.end()) {
+    return false;
+  }
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    key.push_back(strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+  }
+  return true;
+}
+
+/**
+ * Sets up the TLS part of the MQTT client configuration, a pre-shared key takes precedence,
+ * otherwise the broker is verified with the CA certificate stored on LittleFS or, if missing,
+ * with the built-in certificate bundle.
+ */
+void mqtt_tls_config(esp_mqtt_client_config_t& mqtt_cfg) {
+  mqtt_cfg.broker.address.transport = MQTT_TRANSPORT_OVER_SSL;
+  if (!espConfig::mqttData.mqttPskIdentity.empty()) {
+    if (mqtt_psk_decode(espConfig::mqttData.mqttPskKey, mqttPskKeyBin)) {
+      mqttPskHintKey.key = mqttPskKeyBin.data();
+      mqttPskHintKey.key_size = mqttPskKeyBin.size();
+      mqttPskHintKey.hint = espConfig::mqttData.mqttPskIdentity.c_str();
+      mqtt_cfg.broker.verification.psk_hint_key = &mqttPskHintKey;
+      LOG(I, "MQTT using TLS-PSK with identity \"%s\"", mqttPskHintKey.hint);
+      return;
     }
+    LOG(E, "MQTT PSK identity set but the key is empty or not valid hex, falling back to certificates");
+  }
+  File caFile = LittleFS.open(MQTT_CA_CERT_PATH, "r");
+  if (caFile && caFile.size() > 0) {
+    mqttCaCert.resize(caFile.size());
+    caFile.readBytes(mqttCaCert.data(), mqttCaCert.size());
+    mqtt_cfg.broker.verification.certificate = mqttCaCert.c_str();
+    mqtt_cfg.broker.verification.certificate_len = mqttCaCert.size() + 1;
+    LOG(I, "MQTT using CA certificate from %s", MQTT_CA_CERT_PATH);
+  } else {
+    mqtt_cfg.broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
+    LOG(I, "MQTT using the built-in CA certificate bundle");
   }
+  if (caFile) caFile.close();
 }
 
 /**
@@ -1282,6 +2537,9 @@ static void mqtt_app_start(void) {
   mqtt_cfg.broker.address.hostname = espConfig::mqttData.mqttBroker.c_str();
   mqtt_cfg.broker.address.port = espConfig::mqttData.mqttPort;
   mqtt_cfg.broker.address.transport = MQTT_TRANSPORT_OVER_TCP;
+  if (espConfig::mqttData.mqttTlsEnabled) {
+    mqtt_tls_config(mqtt_cfg);
+  }
   mqtt_cfg.credentials.client_id = espConfig::mqttData.mqttClientId.c_str();
   mqtt_cfg.credentials.username = espConfig::mqttData.mqttUsername.c_str();
   mqtt_cfg.credentials.authentication.password = espConfig::mqttData.mqttPassword.c_str();
@@ -1291,6 +2549,8 @@ static void mqtt_app_start(void) {
   mqtt_cfg.session.last_will.retain = true;
   mqtt_cfg.session.last_will.qos = 1;
   client = esp_mqtt_client_init(&mqtt_cfg);
+  esp_mqtt_client_register_event(client, MQTT_EVENT_BEFORE_CONNECT, mqtt_connect_timing_handler, client);
+  esp_mqtt_client_register_event(client, MQTT_EVENT_CONNECTED, mqtt_connect_timing_handler, client);
   esp_mqtt_client_register_event(client, MQTT_EVENT_CONNECTED, mqtt_connected_event, client);
   esp_mqtt_client_register_event(client, MQTT_EVENT_DATA, mqtt_data_handler, client);
   esp_mqtt_client_start(client);
@@ -1331,100 +2591,1322 @@ void listDir(fs::FS& fs, const char* dirname, uint8_t levels) {
   }
 }
 
-String indexProcess(const String& var) {
-  if (var == "VERSION") {
-    const esp_app_desc_t* app_desc = esp_app_get_description();
-    std::string app_version = app_desc->version;
-    return String(app_version.c_str());
+bool headersFix(AsyncWebServerRequest* request) { request->addInterestingHeader("ANY"); return true; };
+
+/**
+ * Web UI credentials check shared by every authenticated handler. The digest HA1 is computed
+ * once when the server is set up, so a digest request costs one MD5 for the response instead of
+ * two. The realm is AsyncWebServer's default, which the event source handler challenges with.
+ */
+namespace web_auth {
+  const char* realm = "asyncesp";
+  String digest;
+
+  void begin() {
+    digest = generateDigestHash(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str(), realm);
+  }
+
+  bool check(AsyncWebServerRequest* req) {
+    if (!espConfig::miscConfig.webAuthEnabled) return true;
+    // The hashed check only matches digest credentials, Basic auth falls through to the plain one
+    return req->authenticate(espConfig::miscConfig.webUsername.c_str(), digest.c_str(), realm, true) ||
+           req->authenticate(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
   }
-  return "";
 }
 
-bool headersFix(AsyncWebServerRequest* request) { request->addInterestingHeader("ANY"); return true; };
-void setupWeb() {
-  auto assetsHandle = new AsyncStaticWebHandler("/assets", LittleFS, "/assets/", NULL);
-  assetsHandle->setFilter(headersFix);
-  webServer.addHandler(assetsHandle);
-  auto routesHandle = new AsyncStaticWebHandler("/fragment", LittleFS, "/routes", NULL);
-  routesHandle->setFilter(headersFix);
-  webServer.addHandler(routesHandle);
-  AsyncCallbackWebHandler* dataProvision = new AsyncCallbackWebHandler();
-  webServer.addHandler(dataProvision);
-  dataProvision->setUri("/config");
-  dataProvision->setMethod(HTTP_GET);
-  dataProvision->onRequest([](AsyncWebServerRequest* req) {
-    if (req->hasParam("type")) {
-    json serializedData;
-      AsyncWebParameter* data = req->getParam(0);
-      std::array<std::string, 4> pages = {"mqtt", "actions", "misc", "hkinfo"};
-      if (std::equal(data->value().begin(), data->value().end(), pages[0].begin(), pages[0].end())) {
-        LOG(D, "MQTT CONFIG REQ");
-        serializedData = espConfig::mqttData;
-      } else if (std::equal(data->value().begin(), data->value().end(),pages[1].begin(), pages[1].end()) || std::equal(data->value().begin(), data->value().end(),pages[2].begin(), pages[2].end())) {
-        LOG(D, "ACTIONS CONFIG REQ");
-        serializedData = espConfig::miscConfig;
-      } else if (std::equal(data->value().begin(), data->value().end(),pages[3].begin(), pages[3].end())) {
-        LOG(D, "HK DATA REQ");
-        json inputData = readerData;
-        if (inputData.contains("group_identifier")) {
-          serializedData["group_identifier"] = red_log::bufToHexString(readerData.reader_gid.data(), readerData.reader_gid.size(), true);
-        }
-        if (inputData.contains("unique_identifier")) {
-          serializedData["unique_identifier"] = red_log::bufToHexString(readerData.reader_id.data(), readerData.reader_id.size(), true);
-        }
-        if (inputData.contains("issuers")) {
-          serializedData["issuers"] = json::array();
-          for (auto it = inputData.at("issuers").begin(); it != inputData.at("issuers").end(); ++it)
-          {
-            json issuer;
-            if (it.value().contains("issuerId")) {
-              std::vector<uint8_t> id = it.value().at("issuerId").get<std::vector<uint8_t>>();
-              issuer["issuerId"] = red_log::bufToHexString(id.data(), id.size(), true);
-            }
-            if (it.value().contains("endpoints") && it.value().at("endpoints").size() > 0) {
-              issuer["endpoints"] = json::array();
-              for (auto it2 = it.value().at("endpoints").begin(); it2 != it.value().at("endpoints").end(); ++it2) {
-                json endpoint;
-                if (it2.value().contains("endpointId")) {
-                  std::vector<uint8_t> id = it2.value().at("endpointId").get<std::vector<uint8_t>>();
-                  endpoint["endpointId"] = red_log::bufToHexString(id.data(), id.size(), true);
-                }
-                issuer["endpoints"].push_back(endpoint);
-              }
-            }
-            serializedData["issuers"].push_back(issuer);
+/**
+ * Serves the web assets prepared by tools/build_web_assets.py. Files listed in /manifest.txt
+ * are sent pre-compressed with a content-hash ETag, a matching If-None-Match gets a 304 and
+ * versioned assets (referenced with `?v=<hash>`) are cached by the browser for a year.
+ */
+class CachedStaticHandler : public AsyncWebHandler
+{
+public:
+  struct asset_t
+  {
+    std::string etag;
+    bool immutable;
+  };
+
+  CachedStaticHandler(const char* uri, const char* path, const std::map<std::string, asset_t>& assets, bool auth = false) : _uri(uri), _path(path), _assets(assets), _auth(auth) {}
+
+  /**
+   * Loads the manifest written by the build step, one `<path> <etag> <flags>` entry per line.
+   *
+   * @return false if the image was not built through the asset pipeline
+   */
+  static bool loadManifest(fs::FS& fs, std::map<std::string, asset_t>& assets) {
+    File manifest = fs.open("/manifest.txt", "r");
+    if (!manifest) {
+      return false;
+    }
+    while (manifest.available()) {
+      String line = manifest.readStringUntil('\n');
+      int first = line.indexOf(' ');
+      int second = line.indexOf(' ', first + 1);
+      if (first <= 0 || second <= first) continue;
+      std::string path = line.substring(0, first).c_str();
+      assets[path] = asset_t{ line.substring(first + 1, second).c_str(), line.indexOf('i', second) > 0 };
+    }
+    manifest.close();
+    return !assets.empty();
+  }
+
+  bool canHandle(AsyncWebServerRequest* request) override {
+    if (request->method() != HTTP_GET || !request->url().startsWith(_uri.c_str())) {
+      return false;
+    }
+    if (_assets.find(_path + (request->url().c_str() + _uri.length())) == _assets.end()) {
+      return false;
+    }
+    request->addInterestingHeader("If-None-Match");
+    return true;
+  }
+
+  void handleRequest(AsyncWebServerRequest* request) override {
+    if (_auth && !web_auth::check(request)) {
+      return request->requestAuthentication(web_auth::realm);
+    }
+    std::string path = _path + (request->url().c_str() + _uri.length());
+    const asset_t& asset = _assets.at(path);
+    const char* cacheControl = asset.immutable && request->hasParam("v") ? "public, max-age=31536000, immutable" : "no-cache";
+    AsyncWebServerResponse* response;
+    if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == asset.etag.c_str()) {
+      response = request->beginResponse(304);
+    } else {
+      // AsyncFileResponse picks up `path.gz` and sets Content-Encoding when only the compressed file exists
+      response = request->beginResponse(LittleFS, path.c_str(), String());
+    }
+    response->addHeader("ETag", asset.etag.c_str());
+    response->addHeader("Cache-Control", cacheControl);
+    request->send(response);
+  }
+
+  bool isRequestHandlerTrivial() override { return true; }
+
+private:
+  std::string _uri;
+  std::string _path;
+  const std::map<std::string, asset_t>& _assets;
+  bool _auth;
+};
+
+std::map<std::string, CachedStaticHandler::asset_t> webAssets;
+
+/**
+ * The index page is a static file, bundled and gzipped by tools/build_web_assets.py. It doesn't
+ * contain the firmware version, the UI gets that from the `info` event of /events, so nothing is
+ * rendered on the device and one LittleFS image fits every firmware version. Requests are
+ * streamed straight from LittleFS with the ETag from the manifest.
+ */
+namespace index_page {
+  const char* path = "/index.html";
+  std::string etag;
+  // Assets the bundled page still references, announced with a Link header so they load in parallel
+  std::string preload;
+
+  void loadPreload() {
+    File list = LittleFS.open("/page/preload.txt", "r");
+    if (!list) return;
+    while (list.available()) {
+      String asset = list.readStringUntil('\n');
+      asset.trim();
+      if (asset.isEmpty()) continue;
+      const char* type = asset.indexOf(".css") > 0 ? "style" : asset.indexOf(".js") > 0 ? "script" : "image";
+      if (!preload.empty()) preload.append(", ");
+      preload.append("<").append(asset.c_str()).append(">; rel=preload; as=").append(type);
+    }
+    list.close();
+  }
+
+  /** Takes the ETag from the manifest, images built without it fall back to the file size */
+  bool prepare() {
+    const char* TAG = "index_page";
+    // Copies rendered on the device by earlier firmware, only taking up space now
+    for (const char* stale : { "/page/index.html", "/page/index.html.gz", "/page/version.txt" }) {
+      if (LittleFS.exists(stale)) LittleFS.remove(stale);
+    }
+    auto asset = webAssets.find(path);
+    if (asset != webAssets.end()) {
+      etag = asset->second.etag;
+    } else {
+      File page = LittleFS.open(path, "r");
+      if (!page) page = LittleFS.open(std::string(path).append(".gz").c_str(), "r");
+      if (!page) {
+        LOG(E, "%s not found!", path);
+        return false;
+      }
+      etag = std::string("\"").append(std::to_string(page.size())).append("\"");
+      page.close();
+    }
+    loadPreload();
+    return true;
+  }
+
+  void handleRequest(AsyncWebServerRequest* req) {
+    const char* TAG = "index_page";
+    int64_t start = esp_timer_get_time();
+    AsyncWebServerResponse* response;
+    if (req->hasHeader("If-None-Match") && req->header("If-None-Match") == etag.c_str()) {
+      response = req->beginResponse(304);
+    } else {
+      // AsyncFileResponse picks up `index.html.gz` and sets Content-Encoding when only the compressed file exists
+      response = req->beginResponse(LittleFS, path, "text/html");
+      if (!preload.empty()) response->addHeader("Link", preload.c_str());
+    }
+    response->addHeader("ETag", etag.c_str());
+    response->addHeader("Cache-Control", "no-cache");
+    req->send(response);
+    LOG(V, "Index request handled in %lli us", esp_timer_get_time() - start);
+  }
+}
+
+// Compares two strings in time independent of where they differ
+bool constant_time_equals(const std::string& a, const std::string& b) {
+  size_t len = std::max(a.size(), b.size());
+  uint8_t diff = a.size() != b.size();
+  for (size_t i = 0; i < len; i++) {
+    diff |= (i < a.size() ? a[i] : 0) ^ (i < b.size() ? b[i] : 0);
+  }
+  return diff == 0;
+}
+
+namespace lock_api {
+  // Recently seen idempotency keys, a retried request with the same key gets the original answer back
+  struct idempotencyEntry_t
+  {
+    uint32_t keyHash = 0;
+    int64_t time = 0;
+    int state; // Requested state, a key reused for another state is refused
+    int status;
+    uint32_t latency;
+  };
+  std::array<idempotencyEntry_t, 8> idempotencyCache;
+  size_t idempotencyNext = 0;
+  const int64_t idempotencyTtl = 300000000; // us
+
+  // Longest wait for HomeSpan's task to hand the command to the actuator, it's woken by the bus
+  const TickType_t actuationTimeout = pdMS_TO_TICKS(250);
+  // Given by `complete`, only the async_tcp task waits on it so one request is pending at a time
+  SemaphoreHandle_t done = nullptr;
+  // Request id << 1 | queued of the last completed request
+  std::atomic<uint32_t> result{ 0 };
+  uint16_t nextRequest = 0;
+
+  /** Called from HomeSpan's task once the command of `request` was handled */
+  void complete(uint16_t request, bool queued) {
+    result.store(uint32_t(request) << 1 | queued);
+    xSemaphoreGive(done);
+  }
+
+  /**
+   * Posts the command and waits until the actuator took it.
+   *
+   * @return 200 if the GPIO actuation was queued, 503 if it wasn't, 504 if there was no answer in time
+   */
+  int actuate(int state) {
+    if (done == nullptr) done = xSemaphoreCreateBinary();
+    if (++nextRequest == 0) nextRequest = 1;
+    const uint16_t request = nextRequest;
+    // A request that timed out may have been completed since
+    xSemaphoreTake(done, 0);
+    if (!lock_fsm::post(lock_fsm::HTTP, lock_fsm::commandOf(state), request)) return 503;
+    const TickType_t start = xTaskGetTickCount();
+    TickType_t waited = 0;
+    while (waited < actuationTimeout && xSemaphoreTake(done, actuationTimeout - waited) == pdTRUE) {
+      uint32_t r = result.load();
+      if ((r >> 1) == request) return (r & 1) ? 200 : 503;
+      waited = xTaskGetTickCount() - start;
+    }
+    return 504;
+  }
+
+  uint32_t fnv1a(const char* s) {
+    uint32_t hash = 2166136261u;
+    while (*s) {
+      hash = (hash ^ (uint8_t)*s++) * 16777619u;
+    }
+    return hash;
+  }
+
+  void sendResult(AsyncWebServerRequest* req, int state, int status, uint32_t latency, bool replayed) {
+    char body[96];
+    snprintf(body, sizeof(body), "{\"state\":%d,\"queued\":%s,\"latency_us\":%lu,\"replayed\":%s}", state, status == 200 ? "true" : "false", (unsigned long)latency, replayed ? "true" : "false");
+    req->send(status, "application/json", body);
+  }
+
+  /**
+   * Handles `POST /lock?state=<0|1>`, authenticated with `Authorization: Bearer <webApiToken>`.
+   * An optional `Idempotency-Key` header makes retries safe. The command runs in HomeSpan's task
+   * like every other lock input, the response is only sent once it queued the GPIO actuation
+   * and `latency_us` reports how long that took. Without an answer in `actuationTimeout` it's
+   * 504, the command may still run.
+   */
+  void handleRequest(AsyncWebServerRequest* req) {
+    const char* TAG = "lock_api";
+    int64_t start = esp_timer_get_time();
+    if (espConfig::miscConfig.webApiToken.empty()) {
+      req->send(404, "text/plain", "Not found");
+      return;
+    }
+    std::string auth = req->hasHeader("Authorization") ? req->header("Authorization").c_str() : "";
+    if (auth.compare(0, 7, "Bearer ") != 0 || !constant_time_equals(auth.substr(7), espConfig::miscConfig.webApiToken)) {
+      LOG(W, "Unauthorized lock request from %s", req->client()->remoteIP().toString().c_str());
+      req->send(401, "text/plain", "Unauthorized");
+      return;
+    }
+    if (!req->hasParam("state")) {
+      req->send(400, "text/plain", "Missing state");
+      return;
+    }
+    int state = req->getParam("state")->value().toInt();
+    if (state != lockStates::UNLOCKED && state != lockStates::LOCKED) {
+      req->send(400, "text/plain", "Invalid state");
+      return;
+    }
+    idempotencyEntry_t* entry = nullptr;
+    if (req->hasHeader("Idempotency-Key")) {
+      uint32_t keyHash = fnv1a(req->header("Idempotency-Key").c_str());
+      for (auto&& cached : idempotencyCache) {
+        if (cached.time != 0 && cached.keyHash == keyHash && start - cached.time < idempotencyTtl) {
+          if (cached.state != state) {
+            LOG(W, "Idempotency key %08lx reused for state %d, was %d", (unsigned long)keyHash, state, cached.state);
+            req->send(422, "text/plain", "Idempotency-Key already used for another state");
+            return;
           }
+          LOG(D, "Replaying result for idempotency key %08lx", (unsigned long)keyHash);
+          sendResult(req, cached.state, cached.status, cached.latency, true);
+          return;
+        }
+      }
+      entry = &idempotencyCache[idempotencyNext];
+      idempotencyNext = (idempotencyNext + 1) % idempotencyCache.size();
+      entry->keyHash = keyHash;
+    }
+    int status = actuate(state);
+    uint32_t latency = esp_timer_get_time() - start;
+    LOG(I, "HTTP lock request state=%d status=%d in %lu us", state, status, (unsigned long)latency);
+    if (entry) {
+      entry->time = start;
+      entry->state = state;
+      entry->status = status;
+      entry->latency = latency;
+    }
+    sendResult(req, state, status, latency, false);
+  }
+}
+/**
+ * Chunked JSON writers for `GET /config`. The HomeKey data is walked with a cursor straight
+ * from `readerData` and each chunk only holds what fits into the buffer handed over by the
+ * TCP stack, so memory use doesn't grow with the number of issuers/endpoints. The MQTT and
+ * misc configs are written the same way from their structs, see the end of `config_registry`.
+ */
+namespace config_stream {
+  struct hkCursor_t
+  {
+    enum { HEADER, ISSUER, ENDPOINT, ISSUER_END, FOOTER, DONE } phase = HEADER;
+    size_t issuer = 0;
+    size_t endpoint = 0;
+    std::string pending; // rest of a piece that didn't fit into the previous chunk
+    size_t sent = 0;
+    uint32_t minFreeHeap = UINT32_MAX;
+  };
+
+  // Copies as much of the pending piece as fits into the chunk, the rest goes out with the next one
+  void put(std::string& pending, uint8_t* buffer, size_t maxLen, size_t& len) {
+    size_t n = std::min(maxLen - len, pending.size());
+    memcpy(buffer + len, pending.data(), n);
+    pending.erase(0, n);
+    len += n;
+  }
+
+  /**
+   * Returning 0 ends a chunked response, so it's only returned once the cursor is done. While
+   * another task holds `readerDataMutex` the chunk is retried later instead of blocking the
+   * async_tcp task.
+   */
+  size_t fillHkInfo(hkCursor_t& cursor, uint8_t* buffer, size_t maxLen) {
+    const char* TAG = "config_stream";
+    size_t len = 0;
+    put(cursor.pending, buffer, maxLen, len);
+    if (cursor.pending.empty() && cursor.phase != hkCursor_t::DONE) {
+      if (xSemaphoreTake(readerDataMutex, 0) != pdTRUE) {
+        LOG(D, "readerDataMutex busy, retrying hkinfo chunk");
+        return len ? len : RESPONSE_TRY_AGAIN;
+      }
+      std::string piece;
+      while (cursor.pending.empty() && cursor.phase != hkCursor_t::DONE) {
+        // Issuers may be added or removed between chunks, the cursor is re-checked against the current data
+        const auto& issuers = readerData.issuers;
+        piece.clear();
+        switch (cursor.phase) {
+          case hkCursor_t::HEADER:
+            piece.append("{\"group_identifier\":\"").append(red_log::bufToHexString(readerData.reader_gid.data(), readerData.reader_gid.size(), true));
+            piece.append("\",\"unique_identifier\":\"").append(red_log::bufToHexString(readerData.reader_id.data(), readerData.reader_id.size(), true));
+            piece.append("\",\"issuers\":[");
+            break;
+          case hkCursor_t::ISSUER:
+            if (cursor.issuer >= issuers.size()) {
+              cursor.phase = hkCursor_t::FOOTER;
+              continue;
+            }
+            if (cursor.issuer > 0) piece.append(",");
+            piece.append("{\"issuerId\":\"").append(red_log::bufToHexString(issuers[cursor.issuer].issuer_id.data(), issuers[cursor.issuer].issuer_id.size(), true));
+            piece.append("\",\"endpoints\":[");
+            break;
+          case hkCursor_t::ENDPOINT:
+            if (cursor.issuer >= issuers.size() || cursor.endpoint >= issuers[cursor.issuer].endpoints.size()) {
+              cursor.phase = hkCursor_t::ISSUER_END;
+              continue;
+            }
+            if (cursor.endpoint > 0) piece.append(",");
+            piece.append("{\"endpointId\":\"").append(red_log::bufToHexString(issuers[cursor.issuer].endpoints[cursor.endpoint].endpoint_id.data(), issuers[cursor.issuer].endpoints[cursor.endpoint].endpoint_id.size(), true));
+            piece.append("\"}");
+            break;
+          case hkCursor_t::ISSUER_END:
+            piece.append("]}");
+            break;
+          case hkCursor_t::FOOTER:
+            piece.append("]}");
+            break;
+          default:
+            break;
+        }
+        switch (cursor.phase) {
+          case hkCursor_t::HEADER: cursor.phase = hkCursor_t::ISSUER; break;
+          case hkCursor_t::ISSUER: cursor.phase = hkCursor_t::ENDPOINT; cursor.endpoint = 0; break;
+          case hkCursor_t::ENDPOINT: cursor.endpoint++; break;
+          case hkCursor_t::ISSUER_END: cursor.phase = hkCursor_t::ISSUER; cursor.issuer++; break;
+          case hkCursor_t::FOOTER: cursor.phase = hkCursor_t::DONE; break;
+          default: break;
         }
+        cursor.pending.swap(piece);
+        put(cursor.pending, buffer, maxLen, len);
+      }
+      xSemaphoreGive(readerDataMutex);
+    }
+    cursor.sent += len;
+    cursor.minFreeHeap = std::min(cursor.minFreeHeap, (uint32_t)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    if (cursor.phase == hkCursor_t::DONE && cursor.pending.empty()) {
+      if (len == 0) LOG(D, "hkinfo streamed %u bytes, lowest free heap during response: %lu", cursor.sent, (unsigned long)cursor.minFreeHeap);
+      return len;
+    }
+    return len ? len : RESPONSE_TRY_AGAIN;
+  }
+
+  AsyncWebServerResponse* hkInfo(AsyncWebServerRequest* req) {
+    auto cursor = std::make_shared<hkCursor_t>();
+    return req->beginChunkedResponse("application/json", [cursor](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return fillHkInfo(*cursor, buffer, maxLen);
+    });
+  }
+}
+// AsyncWebServerRequest front end of body_buffer.h
+namespace body_buffer {
+  template <size_t limit = maxSize>
+  void accumulate(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total) {
+    accumulate(req->_tempObject, limit, data, len, index, total);
+  }
+
+  const body_t* complete(AsyncWebServerRequest* req) {
+    return complete(req->_tempObject);
+  }
+
+  // Takes the complete body away from the request, the caller frees it
+  body_t* release(AsyncWebServerRequest* req) {
+    body_t* body = const_cast<body_t*>(complete(req));
+    if (body) req->_tempObject = nullptr;
+    return body;
+  }
+
+  json parse(AsyncWebServerRequest* req) {
+    const body_t* body = complete(req);
+    if (!body) return json(json::value_t::discarded);
+    return json::parse(body->data, body->data + body->total, nullptr, false);
+  }
+
+  template <size_t limit = maxSize>
+  bool tooLarge(AsyncWebServerRequest* req) {
+    return tooLarge(req->_tempObject, req->contentLength(), limit);
+  }
+}
+/**
+ * Declarative description of every field `/config/save` accepts. Each entry states which
+ * config struct (and NVS blob) it lives in, how it is validated, an optional hook that applies
+ * the change at runtime and whether a reboot is needed for it to take effect instead.
+ * Saving computes the diff against the current config, runs only the hooks of fields that
+ * changed and only writes the blobs of groups that changed.
+ */
+namespace config_registry {
+  enum group_t : uint8_t { MQTT, MISC };
+  // SECRET is a STRING that /config only sends back as `secretPlaceholder`
+  enum type_t : uint8_t { BOOL, UINT, PIN, STRING, SECRET, COMPOUND };
+  const char* secretPlaceholder = "********";
+
+  struct field_t
+  {
+    const char* name;
+    group_t group;
+    type_t type;
+    uint32_t max;
+    bool reboot;
+    // Appends the JSON of the current value, read straight from the config struct
+    void (*write)(std::string& out);
+    bool (*validate)(const json& value, std::string& error);
+    // Runs once the group was persisted and the struct updated, `previous` is the value the field had before
+    void (*apply)(const json& value, const json& previous);
+    // Runs before the group is persisted, may change other fields in `updated`, the new values for the whole group
+    void (*prepare)(const json& value, json& updated);
+  };
+
+  bool validateSetupCode(const json& value, std::string& error) {
+    std::string code = value.template get<std::string>();
+    if (code.length() != 8 || std::find_if(code.begin(), code.end(), [](unsigned char c) { return !std::isdigit(c); }) != code.end()) {
+      error = "\"" + code + "\" is not a valid value for \"setupCode\"";
+      return false;
+    }
+    if (homeSpan.controllerListBegin() != homeSpan.controllerListEnd() && code != espConfig::miscConfig.setupCode) {
+      error = "The Setup Code can only be set if no devices are paired, reset if any issues!";
+      return false;
+    }
+    return true;
+  }
+
+  // An empty key is allowed while no PSK identity is set, `mqtt_tls_config` falls back to certificates then
+  bool validateMqttPskKey(const json& value, std::string& error) {
+    std::string hex = value.template get<std::string>();
+    std::vector<uint8_t> key;
+    if (!hex.empty() && !mqtt_psk_decode(hex, key)) {
+      error = "\"mqttPskKey\" must be an even number of hex digits, at most " + std::to_string(mqttPskMaxLen * 2);
+      return false;
+    }
+    return true;
+  }
+
+  void applyNfcTagNoPublish(const json& value, const json& previous) {
+    if (value == false) return;
+    std::string rfidTopic;
+    rfidTopic.append("homeassistant/tag/").append(espConfig::mqttData.mqttClientId).append("/rfid/config");
+    esp_mqtt_client_publish(client, rfidTopic.c_str(), "", 0, 0, false);
+  }
+
+  void applySetupCode(const json& value, const json& previous) {
+    if (homeSpan.controllerListBegin() == homeSpan.controllerListEnd()) {
+      homeSpan.setPairingCode(value.template get<std::string>().c_str());
+    }
+  }
+
+  // The actuator task always runs, enabling an output only needs the pin or pixel set up
+  void applyNfcNeopixelPin(const json& value, const json& previous) {
+    if (value != 255 && !actuator::post(actuator::PIXEL_INIT, value.template get<uint8_t>(), 0, pdMS_TO_TICKS(100))) {
+      const char* TAG = "config_registry";
+      LOG(E, "Could not queue the NeoPixel setup, it starts on the next reboot");
+    }
+  }
+
+  void applyNfcLedPin(const json& value, const json& previous) {
+    if (value != 255) {
+      pinMode(value, OUTPUT);
+    }
+  }
+
+  // The low status is recomputed in HomeSpan's task from the current level
+  void applyBtrLowStatusThreshold(const json& value, const json& previous) {
+    if (statusLowBtr && btrLevel) {
+      events::event_t ev{};
+      ev.topic = events::BATTERY;
+      ev.battery.level = btrLevel->getVal();
+      events::publish(ev);
+    }
+  }
+
+  // The simple GPIO trigger and the dumb switch mode exclude each other
+  void prepareGpioActionPin(const json& value, json& updated) {
+    if (espConfig::miscConfig.gpioActionPin == 255 && value != 255) {
+      updated.at("hkDumbSwitchMode") = false;
+    }
+  }
+
+  void applyGpioActionPin(const json& value, const json& previous) {
+    const char* TAG = "config_registry";
+    if (previous == 255 && value != 255) {
+      LOG(D, "ENABLING HomeKit Trigger - Simple GPIO");
+      pinMode(value, OUTPUT);
+    } else if (previous != 255 && value == 255) {
+      LOG(D, "DISABLING HomeKit Trigger - Simple GPIO");
+      gpio_reset_pin(gpio_num_t(previous.template get<uint8_t>()));
+    }
+  }
+
+  template <typename T>
+  void writeValue(std::string& out, const T& value) {
+    out.append(json(value).dump());
+  }
+
+  // The member name doubles as the field name, so every field is checked to exist in its struct
+#define MQTT_FIELD(member, type, max, reboot, ...) { #member, MQTT, type, max, reboot, [](std::string& out) { writeValue(out, espConfig::mqttData.member); }, __VA_ARGS__ }
+#define MISC_FIELD(member, type, max, reboot, ...) { #member, MISC, type, max, reboot, [](std::string& out) { writeValue(out, espConfig::miscConfig.member); }, __VA_ARGS__ }
+
+  const field_t fields[] = {
+    /* MQTT, the client is only configured at boot */
+    MQTT_FIELD(mqttBroker, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttPort, UINT, UINT16_MAX, true, nullptr, nullptr),
+    MQTT_FIELD(mqttUsername, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttPassword, SECRET, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttClientId, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttTlsEnabled, BOOL, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttPskIdentity, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(mqttPskKey, SECRET, 0, true, validateMqttPskKey, nullptr),
+    MQTT_FIELD(lwtTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(hkTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockStateTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockStateCmd, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockCStateCmd, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockTStateCmd, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(btrLvlCmdTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(hkAltActionTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(telemetryTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(telemetryInterval, UINT, UINT16_MAX, true, nullptr, nullptr),
+    MQTT_FIELD(doorbellTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockCustomStateTopic, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockCustomStateCmd, STRING, 0, true, nullptr, nullptr),
+    MQTT_FIELD(lockEnableCustomState, BOOL, 0, true, nullptr, nullptr),
+    MQTT_FIELD(hassMqttDiscoveryEnabled, BOOL, 0, true, nullptr, nullptr),
+    MQTT_FIELD(nfcTagNoPublish, BOOL, 0, true, nullptr, applyNfcTagNoPublish),
+    MQTT_FIELD(customLockStates, COMPOUND, 0, true, nullptr, nullptr),
+    MQTT_FIELD(customLockActions, COMPOUND, 0, true, nullptr, nullptr),
+    /* Misc */
+    MISC_FIELD(deviceName, STRING, 0, true, nullptr, nullptr),
+    MISC_FIELD(otaPasswd, SECRET, 0, true, nullptr, nullptr),
+    MISC_FIELD(hk_key_color, UINT, UINT8_MAX, true, nullptr, nullptr),
+    MISC_FIELD(setupCode, STRING, 0, false, validateSetupCode, applySetupCode),
+    MISC_FIELD(lockAlwaysUnlock, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(lockAlwaysLock, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(controlPin, PIN, 0, true, nullptr, nullptr),
+    MISC_FIELD(hsStatusPin, PIN, 0, true, nullptr, nullptr),
+    MISC_FIELD(webAuthEnabled, BOOL, 0, true, nullptr, nullptr),
+    MISC_FIELD(webUsername, STRING, 0, true, nullptr, nullptr),
+    MISC_FIELD(webPassword, SECRET, 0, true, nullptr, nullptr),
+    MISC_FIELD(webApiToken, SECRET, 0, false, nullptr, nullptr),
+    MISC_FIELD(nfcGpioPins, COMPOUND, 0, true, nullptr, nullptr),
+    MISC_FIELD(btrLowStatusThreshold, UINT, 100, false, nullptr, applyBtrLowStatusThreshold),
+    MISC_FIELD(proxBatEnabled, BOOL, 0, true, nullptr, nullptr),
+    MISC_FIELD(lanEventGroup, STRING, 0, true, nullptr, nullptr),
+    MISC_FIELD(lanEventPort, UINT, UINT16_MAX, true, nullptr, nullptr),
+    MISC_FIELD(lanEventKey, SECRET, 0, true, nullptr, nullptr),
+    MISC_FIELD(hkAltActionInitPin, PIN, 0, true, nullptr, nullptr),
+    MISC_FIELD(hkAltActionInitLedPin, PIN, 0, true, nullptr, nullptr),
+    MISC_FIELD(hkAltActionInitTimeout, UINT, UINT16_MAX, true, nullptr, nullptr),
+    MISC_FIELD(doorbellPin, PIN, 0, true, nullptr, nullptr),
+    MISC_FIELD(ethernetEnabled, BOOL, 0, true, nullptr, nullptr),
+    MISC_FIELD(ethActivePreset, UINT, UINT8_MAX, true, nullptr, nullptr),
+    MISC_FIELD(ethPhyType, UINT, UINT8_MAX, true, nullptr, nullptr),
+#if CONFIG_ETH_USE_ESP32_EMAC
+    MISC_FIELD(ethRmiiConfig, COMPOUND, 0, true, nullptr, nullptr),
+#endif
+    MISC_FIELD(ethSpiConfig, COMPOUND, 0, true, nullptr, nullptr),
+    /* Actions, applied at runtime */
+    MISC_FIELD(nfcNeopixelPin, PIN, 0, false, nullptr, applyNfcNeopixelPin),
+    MISC_FIELD(neoPixelType, UINT, UINT8_MAX, true, nullptr, nullptr),
+    MISC_FIELD(neopixelSuccessColor, COMPOUND, 0, false, nullptr, nullptr),
+    MISC_FIELD(neopixelFailureColor, COMPOUND, 0, false, nullptr, nullptr),
+    MISC_FIELD(neopixelSuccessTime, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(neopixelFailTime, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(nfcSuccessPin, PIN, 0, false, nullptr, applyNfcLedPin),
+    MISC_FIELD(nfcSuccessTime, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(nfcSuccessHL, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(nfcFailPin, PIN, 0, false, nullptr, applyNfcLedPin),
+    MISC_FIELD(nfcFailTime, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(nfcFailHL, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(gpioActionPin, PIN, 0, false, nullptr, applyGpioActionPin, prepareGpioActionPin),
+    MISC_FIELD(gpioActionLockState, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(gpioActionUnlockState, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(gpioActionMomentaryEnabled, UINT, UINT8_MAX, false, nullptr, nullptr),
+    MISC_FIELD(gpioActionMomentaryTimeout, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(hkGpioControlledState, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(hkDumbSwitchMode, BOOL, 0, false, nullptr, nullptr),
+    MISC_FIELD(hkAltActionPin, PIN, 0, false, nullptr, nullptr),
+    MISC_FIELD(hkAltActionTimeout, UINT, UINT16_MAX, false, nullptr, nullptr),
+    MISC_FIELD(hkAltActionGpioState, UINT, UINT8_MAX, false, nullptr, nullptr),
+  };
+#undef MQTT_FIELD
+#undef MISC_FIELD
+
+  const field_t* find(const std::string& name) {
+    for (auto&& field : fields) {
+      if (name == field.name) return &field;
+    }
+    return nullptr;
+  }
+
+  /**
+   * Checks `value` against the field description, numbers posted for booleans are converted
+   * in place since the web UI sends checkboxes as 0/1.
+   */
+  bool validate(const field_t& field, json& value, const json& current, std::string& error) {
+    bool valid;
+    switch (field.type) {
+      case BOOL:
+        if (value.is_number_unsigned() && value <= 1) value = value == 1;
+        valid = value.is_boolean();
+        break;
+      case UINT:
+        valid = value.is_number_unsigned() && value <= field.max;
+        break;
+      case PIN:
+        // 255 disables the pin
+        valid = value.is_number_unsigned() && value > 0 && value < 256 && (value == 255 || (value < GPIO_NUM_MAX && (GPIO_IS_VALID_GPIO(value.template get<uint8_t>()) || GPIO_IS_VALID_OUTPUT_GPIO(value.template get<uint8_t>()))));
+        break;
+      case STRING:
+      case SECRET:
+        valid = value.is_string();
+        break;
+      default:
+        valid = value.type() == current.type();
+        break;
+    }
+    if (!valid) {
+      error = "\"" + value.dump() + "\" is not a valid " + (field.type == PIN ? "GPIO Pin" : "value") + " for \"" + field.name + "\"";
+      return false;
+    }
+    return !field.validate || field.validate(value, error);
+  }
+
+  bool persist(group_t group, const json& data) {
+    const char* TAG = "config_registry";
+    std::vector<uint8_t> vectorData = json::to_msgpack(data);
+    esp_err_t set_nvs = nvs_set_blob(savedData, group == MQTT ? "MQTTDATA" : "MISCDATA", vectorData.data(), vectorData.size());
+    esp_err_t commit_nvs = nvs_commit(savedData);
+    LOG(D, "SET_STATUS: %s", esp_err_to_name(set_nvs));
+    LOG(D, "COMMIT_STATUS: %s", esp_err_to_name(commit_nvs));
+    return set_nvs == ESP_OK && commit_nvs == ESP_OK;
+  }
+
+  struct result_t
+  {
+    int status = 200;
+    std::string message;
+    size_t changed = 0;
+    bool reboot = false;
+  };
+
+  /**
+   * Validates the posted fields of one group, persists the group if anything changed and then
+   * applies the changed fields. Nothing is applied unless every field validated and the group
+   * was written to NVS, so the running config never gets ahead of the stored one.
+   */
+  result_t save(group_t group, json& body) {
+    const char* TAG = "config_registry";
+    int64_t start = esp_timer_get_time();
+    result_t result;
+    json updated = group == MQTT ? json(espConfig::mqttData) : json(espConfig::miscConfig);
+    struct change_t
+    {
+      const field_t* field;
+      const json* value;
+      json previous;
+    };
+    std::vector<change_t> changes;
+    for (auto it = body.begin(); it != body.end(); ++it) {
+      const field_t* field = find(it.key());
+      if (!field || field->group != group || !updated.contains(it.key())) {
+        LOG(E, "\"%s\" could not validate!", it.key().c_str());
+        result.status = 400;
+        result.message = "\"" + it.key() + "\" not of correct type or does not exist in config";
+        return result;
+      }
+      // The placeholder posted back from the form leaves the secret as it is
+      if (field->type == SECRET && it.value() == secretPlaceholder) {
+        continue;
+      }
+      if (!validate(*field, it.value(), updated.at(it.key()), result.message)) {
+        LOG(E, "\"%s\" could not validate!", it.key().c_str());
+        result.status = 400;
+        return result;
+      }
+      if (updated.at(it.key()) != it.value()) {
+        changes.push_back({ field, &it.value(), updated.at(it.key()) });
+      }
+    }
+    result.changed = changes.size();
+    if (changes.empty()) {
+      return result;
+    }
+    for (auto&& change : changes) {
+      updated.at(change.field->name) = *change.value;
+    }
+    for (auto&& change : changes) {
+      if (change.field->prepare) {
+        change.field->prepare(*change.value, updated);
+      }
+    }
+    if (!persist(group, updated)) {
+      LOG(E, "Something went wrong, could not save to NVS");
+      result.status = 500;
+      result.message = "Could not save to NVS";
+      return result;
+    }
+    if (group == MQTT) {
+      updated.get_to<espConfig::mqttConfig_t>(espConfig::mqttData);
+    } else {
+      updated.get_to<espConfig::misc_config_t>(espConfig::miscConfig);
+    }
+    LOG(I, "Config successfully saved to NVS, %u field(s) changed in %lli us", changes.size(), esp_timer_get_time() - start);
+    for (auto&& change : changes) {
+      if (change.field->apply) {
+        change.field->apply(*change.value, change.previous);
+      }
+      result.reboot |= change.field->reboot;
+      LOG(I, "\"%s\" applied %lli us after save%s", change.field->name, esp_timer_get_time() - start, change.field->reboot ? " (pending reboot)" : "");
+    }
+    return result;
+  }
+}
+
+namespace config_stream {
+  struct fieldCursor_t
+  {
+    config_registry::group_t group;
+    size_t next = 0; // Index into `config_registry::fields`
+    bool done = false;
+    std::string pending;
+    size_t sent = 0;
+    uint32_t minFreeHeap = UINT32_MAX;
+  };
+
+  /**
+   * Writes the fields of one group straight from its config struct, one field per piece, so no
+   * JSON tree or full copy of the response is built. Secrets that are set go out as
+   * `secretPlaceholder`.
+   */
+  size_t fillFields(fieldCursor_t& cursor, uint8_t* buffer, size_t maxLen) {
+    const char* TAG = "config_stream";
+    size_t len = 0;
+    put(cursor.pending, buffer, maxLen, len);
+    std::string value;
+    while (cursor.pending.empty() && !cursor.done) {
+      if (cursor.next == std::size(config_registry::fields)) {
+        cursor.pending = cursor.sent + len == 0 ? "{}" : "}";
+        cursor.done = true;
+      } else {
+        const config_registry::field_t& field = config_registry::fields[cursor.next++];
+        if (field.group != cursor.group) continue;
+        value.clear();
+        field.write(value);
+        if (field.type == config_registry::SECRET && value != "\"\"") {
+          value.assign("\"").append(config_registry::secretPlaceholder).append("\"");
+        }
+        cursor.pending.append(cursor.sent + len == 0 ? "{\"" : ",\"").append(field.name).append("\":").append(value);
+      }
+      put(cursor.pending, buffer, maxLen, len);
+    }
+    cursor.sent += len;
+    cursor.minFreeHeap = std::min(cursor.minFreeHeap, (uint32_t)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    if (len == 0) LOG(D, "config streamed %u bytes, lowest free heap during response: %lu", cursor.sent, (unsigned long)cursor.minFreeHeap);
+    return len;
+  }
+
+  AsyncWebServerResponse* config(AsyncWebServerRequest* req, config_registry::group_t group) {
+    auto cursor = std::make_shared<fieldCursor_t>();
+    cursor->group = group;
+    return req->beginChunkedResponse("application/json", [cursor](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return fillFields(*cursor, buffer, maxLen);
+    });
+  }
+}
+/**
+ * Encrypted backup of the device configuration, for moving it to a replacement reader.
+ *
+ * The archive is a plain header followed by one libsodium secretstream message per NVS blob:
+ *   header:  magic "HKCA" | version | flags | reserved u16 | PBKDF2 iterations u32 | salt[16] | stream header[24]
+ *   message: ciphertext length u32 | ciphertext of (ns length u8 | ns | key length u8 | key | blob length u32 | blob)
+ * The last message is an empty one tagged FINAL, so a truncated archive is rejected. Blobs are
+ * read from NVS and encrypted one at a time as the response is sent.
+ */
+namespace config_archive {
+  const uint8_t version = 1;
+  const uint32_t iterations = 10000;
+  const size_t maxSize = 16384;
+  enum flags_t : uint8_t { READER = 1, PAIRING = 2 };
+  // HomeSpan keeps the accessory keys and paired controllers in "HAP" and the setup code verifier in "SRP"
+  const std::array<const char*, 2> pairingNamespaces = { "HAP", "SRP" };
+
+  struct __attribute__((packed)) header_t
+  {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t iterations;
+    uint8_t salt[16];
+    uint8_t streamHeader[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+  };
+
+  struct export_t
+  {
+    std::vector<std::pair<std::string, std::string>> entries;
+    size_t next = 0;
+    bool finalSent = false;
+    crypto_secretstream_xchacha20poly1305_state state;
+    std::vector<uint8_t> pending;
+    size_t pendingPos = 0;
+    size_t sent = 0;
+    int64_t start = 0;
+  };
+
+  bool deriveKey(const std::string& passphrase, const uint8_t* salt, uint32_t rounds, uint8_t* key) {
+    return mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA256, (const unsigned char*)passphrase.data(), passphrase.size(), salt, 16, rounds, crypto_secretstream_xchacha20poly1305_KEYBYTES, key) == 0;
+  }
+
+  bool allowed(const std::string& ns, const std::string& key, uint8_t flags) {
+    if (ns == "SAVED_DATA") {
+      return key == "MQTTDATA" || key == "MISCDATA" || (key == "READERDATA" && (flags & READER));
+    }
+    return (flags & PAIRING) && std::find_if(pairingNamespaces.begin(), pairingNamespaces.end(), [&](const char* n) { return ns == n; }) != pairingNamespaces.end();
+  }
+
+  bool readRecord(const std::string& ns, const std::string& key, std::vector<uint8_t>& record) {
+    nvs_handle_t handle;
+    if (nvs_open(ns.c_str(), NVS_READONLY, &handle) != ESP_OK) return false;
+    size_t len = 0;
+    bool ok = nvs_get_blob(handle, key.c_str(), NULL, &len) == ESP_OK;
+    if (ok) {
+      record.resize(2 + ns.size() + key.size() + 4 + len);
+      uint8_t* p = record.data();
+      *p++ = ns.size();
+      p = std::copy(ns.begin(), ns.end(), p);
+      *p++ = key.size();
+      p = std::copy(key.begin(), key.end(), p);
+      uint32_t blobLen = len;
+      memcpy(p, &blobLen, 4);
+      ok = nvs_get_blob(handle, key.c_str(), p + 4, &len) == ESP_OK;
+    }
+    nvs_close(handle);
+    return ok;
+  }
+
+  // Encrypts the next blob into `pending`, the final empty message after the last one
+  bool nextMessage(export_t& ex) {
+    ex.pending.clear();
+    ex.pendingPos = 0;
+    if (ex.finalSent) return false;
+    std::vector<uint8_t> record;
+    uint8_t tag = crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+    while (record.empty()) {
+      if (ex.next >= ex.entries.size()) {
+        tag = crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+        ex.finalSent = true;
+        break;
+      }
+      auto& entry = ex.entries[ex.next++];
+      if (!readRecord(entry.first, entry.second, record)) record.clear();
+    }
+    uint32_t cipherLen = record.size() + crypto_secretstream_xchacha20poly1305_ABYTES;
+    ex.pending.resize(4 + cipherLen);
+    memcpy(ex.pending.data(), &cipherLen, 4);
+    crypto_secretstream_xchacha20poly1305_push(&ex.state, ex.pending.data() + 4, NULL, record.data(), record.size(), NULL, 0, tag);
+    sodium_memzero(record.data(), record.size());
+    return true;
+  }
+
+  size_t fill(export_t& ex, uint8_t* buffer, size_t maxLen) {
+    const char* TAG = "config_archive";
+    size_t len = 0;
+    while (len < maxLen) {
+      if (ex.pendingPos == ex.pending.size() && !nextMessage(ex)) break;
+      size_t n = std::min(maxLen - len, ex.pending.size() - ex.pendingPos);
+      memcpy(buffer + len, ex.pending.data() + ex.pendingPos, n);
+      ex.pendingPos += n;
+      len += n;
+    }
+    ex.sent += len;
+    if (len == 0) {
+      LOG(I, "Exported %u entries (%u bytes) in %lli ms", ex.entries.size(), ex.sent, (esp_timer_get_time() - ex.start) / 1000);
+    }
+    return len;
+  }
+
+  /**
+   * Starts a chunked export response, `flags` selects whether the HomeKey reader data and the
+   * HomeKit pairings are included besides the MQTT and misc config.
+   */
+  AsyncWebServerResponse* exportArchive(AsyncWebServerRequest* req, const std::string& passphrase, uint8_t flags) {
+    auto ex = std::make_shared<export_t>();
+    ex->start = esp_timer_get_time();
+    for (const char* key : { "MQTTDATA", "MISCDATA", "READERDATA" }) {
+      if (allowed("SAVED_DATA", key, flags)) ex->entries.emplace_back("SAVED_DATA", key);
+    }
+    if (flags & PAIRING) {
+      for (const char* ns : pairingNamespaces) {
+        nvs_iterator_t it = nullptr;
+        esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns, NVS_TYPE_BLOB, &it);
+        while (res == ESP_OK) {
+          nvs_entry_info_t info;
+          nvs_entry_info(it, &info);
+          ex->entries.emplace_back(ns, info.key);
+          res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+      }
+    }
+    header_t header{ { 'H', 'K', 'C', 'A' }, version, flags, 0, iterations, {}, {} };
+    randombytes_buf(header.salt, sizeof(header.salt));
+    uint8_t key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+    if (!deriveKey(passphrase, header.salt, iterations, key)) return nullptr;
+    crypto_secretstream_xchacha20poly1305_init_push(&ex->state, header.streamHeader, key);
+    sodium_memzero(key, sizeof(key));
+    ex->pending.assign((uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+    AsyncWebServerResponse* response = req->beginChunkedResponse("application/octet-stream", [ex](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      return fill(*ex, buffer, maxLen);
+    });
+    response->addHeader("Content-Disposition", "attachment; filename=\"hk-config.bin\"");
+    return response;
+  }
+
+  struct record_t
+  {
+    std::string ns;
+    std::string key;
+    std::vector<uint8_t> data;
+  };
+
+  /**
+   * Decrypts and checks the whole archive before anything is written. The blobs are then
+   * written and each namespace committed once, so a wrong passphrase or a damaged or truncated
+   * file leaves the current configuration untouched.
+   *
+   * The HomeKit pairings are replaced as a whole: only what the archive holds is kept in the
+   * pairing namespaces, so an archive without pairings leaves the device unpaired instead of
+   * mixing its pairings with the imported reader data. NVS has no transactions, so each
+   * namespace is written on its own and the old pairing keys are only erased once the new ones
+   * are in; a failed write leaves the old pairings behind rather than none.
+   *
+   * Runs on the web_jobs task, the key derivation is capped at the rounds `exportArchive` uses.
+   *
+   * @param flags Set to the archive's flags, tells whether pairings were included
+   * @return nullptr on success, otherwise the reason the archive was rejected
+   */
+  const char* importArchive(const uint8_t* data, size_t len, const std::string& passphrase, size_t& imported, uint8_t& flags) {
+    const char* TAG = "config_archive";
+    int64_t start = esp_timer_get_time();
+    header_t header;
+    if (len < sizeof(header)) return "Not a configuration archive";
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "HKCA", 4) != 0) return "Not a configuration archive";
+    if (header.version != version) return "Unsupported archive version";
+    if (header.iterations == 0 || header.iterations > iterations) return "Invalid archive header";
+    uint8_t key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+    crypto_secretstream_xchacha20poly1305_state state;
+    if (!deriveKey(passphrase, header.salt, header.iterations, key)) return "Key derivation failed";
+    int initRes = crypto_secretstream_xchacha20poly1305_init_pull(&state, header.streamHeader, key);
+    sodium_memzero(key, sizeof(key));
+    if (initRes != 0) return "Invalid archive header";
+    std::vector<record_t> records;
+    size_t pos = sizeof(header);
+    bool final = false;
+    while (!final) {
+      uint32_t cipherLen;
+      if (len - pos < 4) return "Archive is truncated";
+      memcpy(&cipherLen, data + pos, 4);
+      pos += 4;
+      if (cipherLen < crypto_secretstream_xchacha20poly1305_ABYTES || cipherLen > len - pos) return "Archive is truncated";
+      std::vector<uint8_t> plain(cipherLen - crypto_secretstream_xchacha20poly1305_ABYTES);
+      uint8_t tag;
+      if (crypto_secretstream_xchacha20poly1305_pull(&state, plain.data(), NULL, &tag, data + pos, cipherLen, NULL, 0) != 0) {
+        return "Wrong passphrase or damaged archive";
+      }
+      pos += cipherLen;
+      final = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+      if (plain.empty()) continue;
+      record_t record;
+      size_t p = 0;
+      if (p + 1 > plain.size() || p + 1 + plain[p] > plain.size()) return "Malformed archive entry";
+      record.ns.assign((const char*)&plain[p + 1], plain[p]);
+      p += 1 + plain[p];
+      if (p + 1 > plain.size() || p + 1 + plain[p] > plain.size()) return "Malformed archive entry";
+      record.key.assign((const char*)&plain[p + 1], plain[p]);
+      p += 1 + plain[p];
+      uint32_t blobLen;
+      if (p + 4 > plain.size()) return "Malformed archive entry";
+      memcpy(&blobLen, &plain[p], 4);
+      p += 4;
+      if (blobLen != plain.size() - p) return "Malformed archive entry";
+      if (!allowed(record.ns, record.key, header.flags)) {
+        LOG(W, "Skipping unexpected entry %s/%s", record.ns.c_str(), record.key.c_str());
+        continue;
+      }
+      record.data.assign(plain.begin() + p, plain.end());
+      sodium_memzero(plain.data(), plain.size());
+      records.emplace_back(std::move(record));
+    }
+    if (pos != len) return "Unexpected data after the end of the archive";
+    LOG(I, "Archive with %u entries verified in %lli ms", records.size(), (esp_timer_get_time() - start) / 1000);
+    bool ok = true;
+    std::vector<std::string> namespaces = { "SAVED_DATA" };
+    namespaces.insert(namespaces.end(), pairingNamespaces.begin(), pairingNamespaces.end());
+    for (auto&& ns : namespaces) {
+      nvs_handle_t handle;
+      if (nvs_open(ns.c_str(), NVS_READWRITE, &handle) != ESP_OK) {
+        ok = false;
+        break;
+      }
+      std::set<std::string> written;
+      for (auto&& record : records) {
+        if (record.ns != ns) continue;
+        if (nvs_set_blob(handle, record.key.c_str(), record.data.data(), record.data.size()) != ESP_OK) {
+          ok = false;
+          break;
+        }
+        written.insert(record.key);
+      }
+      if (ok && ns != "SAVED_DATA") {
+        std::vector<std::string> stale;
+        nvs_iterator_t it = nullptr;
+        esp_err_t res = nvs_entry_find(NVS_DEFAULT_PART_NAME, ns.c_str(), NVS_TYPE_ANY, &it);
+        while (res == ESP_OK) {
+          nvs_entry_info_t info;
+          nvs_entry_info(it, &info);
+          if (!written.count(info.key)) stale.emplace_back(info.key);
+          res = nvs_entry_next(&it);
+        }
+        nvs_release_iterator(it);
+        for (auto&& key : stale) {
+          ok &= nvs_erase_key(handle, key.c_str()) == ESP_OK;
+        }
+      }
+      ok &= nvs_commit(handle) == ESP_OK;
+      nvs_close(handle);
+      if (!ok) break;
+    }
+    if (!ok) {
+      LOG(E, "Could not write the imported configuration to NVS");
+      return "Could not write to NVS";
+    }
+    imported = records.size();
+    flags = header.flags;
+    LOG(I, "Imported %u entries in %lli ms", records.size(), (esp_timer_get_time() - start) / 1000);
+    return nullptr;
+  }
+
+  // Archive handed from the import handler to the web_jobs task, one import at a time
+  std::atomic<body_buffer::body_t*> pending{ nullptr };
+  std::string pendingPassphrase;
+
+  /** @return false if another import is still pending, `body` is then left to the caller */
+  bool queueImport(body_buffer::body_t* body, const std::string& passphrase) {
+    if (pending.load() != nullptr) return false;
+    pendingPassphrase = passphrase;
+    pending.store(body);
+    return true;
+  }
+
+  // Drops a queued import whose job couldn't be submitted
+  void cancelImport() {
+    free(pending.exchange(nullptr));
+  }
+
+  /**
+   * Imports the pending archive, `message` tells the user what happened.
+   *
+   * @return true if the configuration was written and the device has to restart
+   */
+  bool runImport(std::string& message) {
+    body_buffer::body_t* body = pending.exchange(nullptr);
+    if (!body) {
+      message = "No archive to import";
+      return false;
+    }
+    size_t imported = 0;
+    uint8_t flags = 0;
+    const char* error = importArchive((const uint8_t*)body->data, body->total, pendingPassphrase, imported, flags);
+    sodium_memzero(body->data, body->total);
+    free(body);
+    sodium_memzero(pendingPassphrase.data(), pendingPassphrase.size());
+    if (error) {
+      message = error;
+      return false;
+    }
+    message = "Imported " + std::to_string(imported) + " entries";
+    message.append(flags & PAIRING ? " including the HomeKit pairings" : ", the archive had no HomeKit pairings and the device has to be paired again");
+    message.append("! Restarting...");
+    return true;
+  }
+}
+
+/**
+ * Runs slow or disruptive web-triggered operations (reboots, resets, starting the AP, config
+ * imports) on a
+ * task of their own, so the handler can answer immediately instead of blocking the async_tcp
+ * task. The handler returns the job id in an `X-Job-Id` header and `GET /job?id=<id>` reports
+ * its state. Jobs wait a moment before running so their HTTP response can be flushed first.
+ */
+namespace web_jobs {
+  enum jobType_t : uint8_t { REBOOT, RESET_HK, RESET_WIFI, START_AP, IMPORT };
+  enum jobState_t : uint8_t { QUEUED, RUNNING, DONE };
+  const std::array<const char*, 5> typeNames = { "reboot", "reset_hk", "reset_wifi", "start_ap", "import" };
+  const std::array<const char*, 3> stateNames = { "queued", "running", "done" };
+
+  struct job_t
+  {
+    uint32_t id;
+    jobType_t type;
+    jobState_t state;
+    bool failed;
+    char result[112]; // Outcome for the user, only set by jobs that report one
+  };
+  // Recent jobs for the status endpoint, indexed by id
+  std::array<job_t, 4> jobs{};
+  portMUX_TYPE jobsLock = portMUX_INITIALIZER_UNLOCKED;
+  uint32_t nextId = 1;
+  QueueHandle_t queue = nullptr;
+  TaskHandle_t task_handle = nullptr;
+
+  void setState(uint32_t id, jobState_t state) {
+    taskENTER_CRITICAL(&jobsLock);
+    job_t& job = jobs[id % jobs.size()];
+    if (job.id == id) job.state = state;
+    taskEXIT_CRITICAL(&jobsLock);
+  }
+
+  // Marks the job done with its outcome, before the job task gets to it so a restart can follow
+  void finish(uint32_t id, bool failed, const std::string& result) {
+    taskENTER_CRITICAL(&jobsLock);
+    job_t& job = jobs[id % jobs.size()];
+    if (job.id == id) {
+      job.state = DONE;
+      job.failed = failed;
+      snprintf(job.result, sizeof(job.result), "%s", result.c_str());
+    }
+    taskEXIT_CRITICAL(&jobsLock);
+  }
+
+  void run(const job_t& job) {
+    switch (job.type) {
+      case REBOOT:
+        ESP.restart();
+        break;
+      case RESET_HK:
+        deleteReaderData();
+        homeSpan.processSerialCommand("H");
+        break;
+      case RESET_WIFI:
+        homeSpan.processSerialCommand("X");
+        break;
+      case START_AP:
+        webServer.end();
+        homeSpan.processSerialCommand("A");
+        break;
+      case IMPORT: {
+        std::string message;
+        bool ok = config_archive::runImport(message);
+        finish(job.id, !ok, message);
+        if (ok) {
+          // Leaves the UI time to fetch the result
+          vTaskDelay(pdMS_TO_TICKS(3000));
+          ESP.restart();
+        }
+        break;
+      }
+    }
+  }
+
+  void job_task(void* arg) {
+    const char* TAG = "web_jobs";
+    job_t job;
+    while (1) {
+      if (xQueueReceive(queue, &job, portMAX_DELAY) != pdTRUE) continue;
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      LOG(I, "Running job %lu (%s)", (unsigned long)job.id, typeNames[job.type]);
+      setState(job.id, RUNNING);
+      run(job);
+      setState(job.id, DONE);
+    }
+  }
+
+  void begin() {
+    if (queue == nullptr) {
+      queue = xQueueCreate(jobs.size(), sizeof(job_t));
+    }
+    if (task_handle == nullptr) {
+      task_plan::create(job_task, "web_job_task", NULL, &task_handle);
+    }
+  }
+
+  /**
+   * Queues a job, returns its id or 0 if too many are pending. The job is only recorded and the
+   * id only used up once it was queued, so a refused job doesn't push a real one out of `jobs`.
+   * Only called from the async_tcp task, `nextId` has no other writer.
+   */
+  uint32_t submit(jobType_t type) {
+    job_t job{ nextId, type, QUEUED, false, "" };
+    if (!queue || xQueueSend(queue, &job, 0) != pdTRUE) return 0;
+    taskENTER_CRITICAL(&jobsLock);
+    nextId++;
+    // The job task waits before it runs a job, this is recorded long before its first setState
+    jobs[job.id % jobs.size()] = job;
+    taskEXIT_CRITICAL(&jobsLock);
+    return job.id;
+  }
+
+  /**
+   * Answers with `message` and hands the work to the job task. Clients that can't follow the
+   * job get the same text response as before.
+   *
+   * @return The job id, 0 if it was refused with a 503
+   */
+  uint32_t respond(AsyncWebServerRequest* req, jobType_t type, const char* message) {
+    uint32_t id = submit(type);
+    if (id == 0) {
+      req->send(503, "text/plain", "Another operation is pending, try again");
+      return 0;
+    }
+    AsyncWebServerResponse* response = req->beginResponse(202, "text/plain", message);
+    response->addHeader("X-Job-Id", String(id));
+    req->send(response);
+    return id;
+  }
+
+  void handleStatus(AsyncWebServerRequest* req) {
+    uint32_t id = req->hasParam("id") ? req->getParam("id")->value().toInt() : 0;
+    taskENTER_CRITICAL(&jobsLock);
+    job_t job = jobs[id % jobs.size()];
+    taskEXIT_CRITICAL(&jobsLock);
+    if (id == 0 || job.id != id) {
+      req->send(404, "application/json", "{\"error\":\"unknown job\"}");
+      return;
+    }
+    char body[224];
+    snprintf(body, sizeof(body), "{\"id\":%lu,\"type\":\"%s\",\"state\":\"%s\",\"failed\":%s,\"result\":\"%s\"}", (unsigned long)job.id, typeNames[job.type],
+      stateNames[job.state], job.failed ? "true" : "false", job.result);
+    req->send(200, "application/json", body);
+  }
+}
+
+/**
+ * Handlers of the web UI and API endpoints, dispatched by `web_router::Router` from one sorted
+ * table instead of a heap allocated AsyncCallbackWebHandler per endpoint.
+ */
+namespace web_routes {
+  void configGet(AsyncWebServerRequest* req) {
+    if (req->hasParam("type")) {
+      AsyncWebParameter* data = req->getParam(0);
+      std::array<std::string, 4> pages = {"mqtt", "actions", "misc", "hkinfo"};
+      if (std::equal(data->value().begin(), data->value().end(), pages[0].begin(), pages[0].end())) {
+        LOG(D, "MQTT CONFIG REQ");
+        req->send(config_stream::config(req, config_registry::MQTT));
+      } else if (std::equal(data->value().begin(), data->value().end(),pages[1].begin(), pages[1].end()) || std::equal(data->value().begin(), data->value().end(),pages[2].begin(), pages[2].end())) {
+        LOG(D, "ACTIONS CONFIG REQ");
+        req->send(config_stream::config(req, config_registry::MISC));
+      } else if (std::equal(data->value().begin(), data->value().end(),pages[3].begin(), pages[3].end())) {
+        LOG(D, "HK DATA REQ");
+        req->send(config_stream::hkInfo(req));
       } else {
         req->send(400);
-        return;
-      }
-      if (!serializedData.empty()) {
-        req->send(200, "application/json", serializedData.dump().c_str());
-      } else {
-        req->send(500);
       }
     } else req->send(500);
-  });
-  AsyncCallbackWebHandler* ethSuppportConfig = new AsyncCallbackWebHandler();
-  webServer.addHandler(ethSuppportConfig);
-  ethSuppportConfig->setUri("/eth_get_config");
-  ethSuppportConfig->setMethod(HTTP_GET);
-  ethSuppportConfig->onRequest([](AsyncWebServerRequest *req) {
-    json eth_config;
-    eth_config["supportedChips"] = json::array();
-    for (auto &&v : eth_config_ns::supportedChips) {
-      eth_config.at("supportedChips").push_back(v.second);
-    }
-    eth_config["boardPresets"] = eth_config_ns::boardPresets;
-    eth_config["ethEnabled"] = espConfig::miscConfig.ethernetEnabled;
-    req->send(200, "application/json", eth_config.dump().c_str());
-  });
-  AsyncCallbackWebHandler* dataClear = new AsyncCallbackWebHandler();
-  webServer.addHandler(dataClear);
-  dataClear->setUri("/config/clear");
-  dataClear->setMethod(HTTP_POST);
-  dataClear->onRequest([](AsyncWebServerRequest* req) {
+  }
+
+  void configClear(AsyncWebServerRequest* req) {
     if (req->hasParam("type")) {
       AsyncWebParameter* data = req->getParam(0);
       std::array<std::string, 3> pages = { "mqtt", "actions", "misc" };
@@ -1451,298 +3933,383 @@ void setupWeb() {
         req->send(400);
         return;
       }
-  });
-  AsyncCallbackWebHandler* dataLoad = new AsyncCallbackWebHandler();
-  webServer.addHandler(dataLoad);
-  dataLoad->setUri("/config/save");
-  dataLoad->setMethod(HTTP_POST);
-  dataLoad->onBody([](AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) {
-    json *dataJson = new json(json::parse(data, data + len));
-    if (!dataJson->is_discarded()) {
-      LOG(I, "%s", dataJson->dump().c_str());
-      request->_tempObject = dataJson;
+  }
+
+  const size_t mqttCaMaxSize = 8192;
+
+  // The certificate is buffered and only written once the whole body arrived
+  void mqttCa(AsyncWebServerRequest* req) {
+    if (req->method() == HTTP_DELETE) {
+      LittleFS.remove(MQTT_CA_CERT_PATH);
+      req->send(200, "text/plain", "CA certificate removed, changes apply on next reboot");
+      return;
     }
-  });
-  dataLoad->onRequest([=](AsyncWebServerRequest* req) {
-    json *serializedData = static_cast<json*>(req->_tempObject);
-    if (req->hasParam("type") && serializedData) {
-      AsyncWebParameter* data = req->getParam(0);
-      json configData;
-      std::array<std::string, 3> pages = { "mqtt", "actions", "misc" };
-      uint8_t selConfig;
-      if (std::equal(data->value().begin(), data->value().end(), pages[0].begin(), pages[0].end())) {
-        LOG(D, "MQTT CONFIG SEL");
-        configData = espConfig::mqttData;
-        selConfig = 0;
-      } else if (std::equal(data->value().begin(), data->value().end(), pages[1].begin(), pages[1].end())) {
-        LOG(D, "ACTIONS CONFIG SEL");
-        configData = espConfig::miscConfig;
-        selConfig = 1;
-      } else if (std::equal(data->value().begin(), data->value().end(), pages[2].begin(), pages[2].end())) {
-        LOG(D, "MISC CONFIG SEL");
-        configData = espConfig::miscConfig;
-        selConfig = 2;
-      } else {
-        req->send(400);
-        return;
+    if (body_buffer::tooLarge<mqttCaMaxSize>(req)) {
+      req->send(413, "text/plain", "CA certificate too large");
+      return;
+    }
+    const body_buffer::body_t* body = body_buffer::complete(req);
+    if (!body || body->total == 0) {
+      req->send(400, "text/plain", "Missing CA certificate");
+      return;
+    }
+    File caFile = LittleFS.open(MQTT_CA_CERT_PATH, "w");
+    if (!caFile || caFile.write((const uint8_t*)body->data, body->total) != body->total) {
+      if (caFile) caFile.close();
+      LittleFS.remove(MQTT_CA_CERT_PATH);
+      req->send(500, "text/plain", "Could not save the CA certificate");
+      return;
+    }
+    caFile.close();
+    req->send(200, "text/plain", "CA certificate saved, changes apply on next reboot");
+  }
+
+  void configSave(AsyncWebServerRequest* req) {
+    if (body_buffer::tooLarge<>(req)) {
+      req->send(413, "text/plain", "Request body too large");
+      return;
+    }
+    json body = body_buffer::parse(req);
+    if (body.is_discarded() || !body.is_object()) {
+      LOG(E, "Could not parse the config body!");
+      req->send(400, "text/plain", "Invalid JSON");
+      return;
+    }
+    LOG(I, "%s", body.dump().c_str());
+    if (!req->hasParam("type")) {
+      req->send(400);
+      return;
+    }
+    AsyncWebParameter* data = req->getParam(0);
+    std::array<std::string, 3> pages = { "mqtt", "actions", "misc" };
+    config_registry::group_t group;
+    if (std::equal(data->value().begin(), data->value().end(), pages[0].begin(), pages[0].end())) {
+      LOG(D, "MQTT CONFIG SEL");
+      group = config_registry::MQTT;
+    } else if (std::equal(data->value().begin(), data->value().end(), pages[1].begin(), pages[1].end()) || std::equal(data->value().begin(), data->value().end(), pages[2].begin(), pages[2].end())) {
+      LOG(D, "MISC CONFIG SEL");
+      group = config_registry::MISC;
+    } else {
+      req->send(400);
+      return;
+    }
+    config_registry::result_t result = config_registry::save(group, body);
+    if (result.status != 200) {
+      req->send(result.status, "text/plain", result.message.c_str());
+    } else if (result.reboot) {
+      web_jobs::respond(req, web_jobs::REBOOT, "Saved! Restarting...");
+    } else if (result.changed == 0) {
+      req->send(200, "text/plain", "Nothing changed");
+    } else {
+      req->send(200, "text/plain", "Saved and applied!");
+    }
+  }
+
+  std::string archivePassphrase(AsyncWebServerRequest* req) {
+    return req->hasHeader("X-Archive-Passphrase") ? req->header("X-Archive-Passphrase").c_str() : "";
+  }
+
+  void configExport(AsyncWebServerRequest* req) {
+    std::string passphrase = archivePassphrase(req);
+    if (passphrase.size() < 8) {
+      req->send(400, "text/plain", "A passphrase of at least 8 characters is required");
+      return;
+    }
+    uint8_t flags = 0;
+    if (req->hasParam("reader") && req->getParam("reader")->value() == "1") flags |= config_archive::READER;
+    if (req->hasParam("pairing") && req->getParam("pairing")->value() == "1") flags |= config_archive::PAIRING;
+    AsyncWebServerResponse* response = config_archive::exportArchive(req, passphrase, flags);
+    if (!response) {
+      req->send(500, "text/plain", "Could not create the archive");
+      return;
+    }
+    req->send(response);
+  }
+
+  void configImport(AsyncWebServerRequest* req) {
+    if (body_buffer::tooLarge<config_archive::maxSize>(req)) {
+      req->send(413, "text/plain", "Archive too large");
+      return;
+    }
+    body_buffer::body_t* body = body_buffer::release(req);
+    if (!body) {
+      req->send(400, "text/plain", "Missing archive");
+      return;
+    }
+    // The key derivation and the NVS writes take too long for the async_tcp task
+    if (!config_archive::queueImport(body, archivePassphrase(req))) {
+      free(body);
+      req->send(503, "text/plain", "Another import is pending, try again");
+      return;
+    }
+    if (web_jobs::respond(req, web_jobs::IMPORT, "Importing...") == 0) {
+      config_archive::cancelImport();
+    }
+  }
+
+  void ethConfig(AsyncWebServerRequest* req) {
+    json eth_config;
+    eth_config["supportedChips"] = json::array();
+    for (auto &&v : eth_config_ns::supportedChips) {
+      eth_config.at("supportedChips").push_back(v.second);
+    }
+    eth_config["boardPresets"] = eth_config_ns::boardPresets;
+    eth_config["ethEnabled"] = espConfig::miscConfig.ethernetEnabled;
+    req->send(200, "application/json", eth_config.dump().c_str());
+  }
+
+  void tasks(AsyncWebServerRequest* request) {
+    request->send(200, "application/json", task_profiler::render().c_str());
+  }
+
+  void wifiRssi(AsyncWebServerRequest* request) {
+    std::string rssi_val = std::to_string(WiFi.RSSI());
+    request->send(200, "text/plain", rssi_val.c_str());
+  }
+
+  void rebootDevice(AsyncWebServerRequest* request) {
+    web_jobs::respond(request, web_jobs::REBOOT, "Rebooting the device...");
+  }
+
+  void resetHkPair(AsyncWebServerRequest* request) {
+    web_jobs::respond(request, web_jobs::RESET_HK, "Erasing HomeKit pairings and restarting...");
+  }
+
+  void resetWifiCred(AsyncWebServerRequest* request) {
+    web_jobs::respond(request, web_jobs::RESET_WIFI, "Erasing WiFi credentials and restarting, AP will start on boot...");
+  }
+
+  void startConfigAp(AsyncWebServerRequest* request) {
+    web_jobs::respond(request, web_jobs::START_AP, "Starting the AP...");
+  }
+}
+
+/**
+ * Connection budget for the web server. AsyncTCP connections draw from the same pool of lwIP
+ * TCP PCBs as HAP and MQTT, and a browser fetching assets in parallel can use most of them.
+ * Connections are counted as they are accepted, the server answers one request per connection.
+ * Over the global or per-address budget the connection gets a canned 503 with Retry-After and
+ * is closed right away, without a request object, so the web server never holds more than
+ * WEB_MAX_CONNECTIONS PCBs for requests. The event stream is long-lived and capped separately,
+ * its connection leaves the budget once it is known to be one.
+ */
+namespace web_admission {
+  struct client_t
+  {
+    uint32_t address;
+    uint8_t active;
+  };
+  // Only touched from the async_tcp task, no locking needed
+  std::array<client_t, WEB_MAX_CONNECTIONS> clients{};
+  uint8_t active = 0;
+  uint32_t rejected = 0;
+  const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 15\r\nConnection: close\r\n\r\nBusy, try again";
+
+  void release(uint32_t address) {
+    for (auto&& c : clients) {
+      if (c.active > 0 && c.address == address) {
+        c.active--;
+        break;
       }
-      uint8_t propertiesProcessed = 0;
-      for (auto it = serializedData->begin(); it != serializedData->end(); ++it) {
-        if (configData.contains(it.key()) && ((configData.at(it.key()).type() == it.value().type()) || configData.at(it.key()).is_boolean())) {
-          if (it.key() == std::string("setupCode")) {
-            std::string code = it.value().template get<std::string>();
-            if (it.value().is_string() && (!code.empty() && std::find_if(code.begin(), code.end(), [](unsigned char c) { return !std::isdigit(c); }) == code.end()) && it.value().template get<std::string>().length() == 8) {
-              if (homeSpan.controllerListBegin() != homeSpan.controllerListEnd() && code.compare(configData.at(it.key()).template get<std::string>())) {
-                LOG(E, "The Setup Code can only be set if no devices are paired, reset if any issues!");
-                req->send(400, "text/plain", "The Setup Code can only be set if no devices are paired, reset if any issues!");
-                break;
-              }
-            } else {
-              LOG(E, "\"%s\" could not validate!", it.key().c_str());
-              std::string msg = "\"\" is not a valid value for \"\"";
-              msg.insert(1, it.value().dump().c_str()).insert(msg.length() - 1, it.key());
-              req->send(400, "text/plain", msg.c_str());
-              break;
-            }
-          } else if (!(std::char_traits<char>::compare(it.key().data() + (it.key().length() - 3), "Pin", 3))) {
-            if (it.value().is_number() && it.value() > 0 && it.value() < 256) {
-              if (!GPIO_IS_VALID_GPIO(it.value().template get<uint8_t>()) && !GPIO_IS_VALID_OUTPUT_GPIO(it.value().template get<uint8_t>()) && it.value() != 255) {
-                LOG(E, "\"%s\" could not validate!", it.key().c_str());
-                std::string msg = "\"\" is not a valid GPIO Pin for \"\"";
-                msg.insert(1, it.value().dump().c_str()).insert(msg.length() - 1, it.key());
-                req->send(400, "text/plain", msg.c_str());
-                break;
-              }
-            } else {
-                LOG(E, "\"%s\" could not validate!", it.key().c_str());
-                std::string msg = "\"\" is not a valid value for \"\"";
-                msg.insert(1, it.value().dump().c_str()).insert(msg.length() - 1, it.key());
-                req->send(400, "text/plain", msg.c_str());
-                break;
-            }
-          }
-          if (configData.at(it.key()).is_boolean() && it.value().is_number()) {
-            it.value() = static_cast<bool>(it.value().template get<uint8_t>());
-          } else if(configData.at(it.key()).is_boolean() && !it.value().is_number()) {
-            LOG(E, "\"%s\" could not validate!", it.key().c_str());
-            std::string msg = "\"\" is not a valid value for \"\"";
-            msg.insert(1, it.value().dump().c_str()).insert(msg.length() - 1, it.key());
-            req->send(400, "text/plain", msg.c_str());
-            break;
-          }
-          propertiesProcessed++;
-        } else {
-          LOG(E, "\"%s\" could not validate!", it.key().c_str());
-          std::string msg = "\"\" not of correct type or does not exist in config";
-          msg.insert(1, it.key());
-          req->send(400, "text/plain", msg.c_str());
-          break;
-        }
+    }
+    active--;
+  }
+
+  void accept(AsyncWebServer* server, AsyncClient* client) {
+    if (client == NULL) return;
+    uint32_t address = client->getRemoteAddress();
+    client_t* slot = nullptr;
+    for (auto&& c : clients) {
+      if (c.active > 0 && c.address == address) {
+        slot = &c;
+        break;
       }
-      if (propertiesProcessed != serializedData->size()) {
-        LOG(E, "Not all properties could be validated, cannot continue!");
-        if(!req->client()->disconnected() || !req->client()->disconnecting()) {
-          req->send(500, "text/plain", "Something went wrong!");
-        }
-        return;
+      if (!slot && c.active == 0) slot = &c;
+    }
+    if (active >= WEB_MAX_CONNECTIONS || !slot || slot->active >= WEB_MAX_CONNECTIONS_PER_CLIENT) {
+      rejected++;
+      LOG(D, "Rejecting connection from %s, %u active, %lu rejected so far", client->remoteIP().toString().c_str(), active, (unsigned long)rejected);
+      // Closing calls the disconnect callback, which frees the client
+      client->onDisconnect([](void* arg, AsyncClient* c) { delete c; });
+      client->write(busy, sizeof(busy) - 1);
+      client->close(true);
+      return;
+    }
+    client->setRxTimeout(3);
+    AsyncWebServerRequest* request = new AsyncWebServerRequest(server, client);
+    if (request == NULL) {
+      client->close(true);
+      client->free();
+      delete client;
+      return;
+    }
+    slot->address = address;
+    slot->active++;
+    active++;
+    request->onDisconnect([address]() { release(address); });
+  }
+
+  // Registered as the first handler, hands the slot of an event stream connection back
+  class Gate : public AsyncWebHandler
+  {
+  public:
+    bool canHandle(AsyncWebServerRequest* request) override {
+      if (request->url() == "/events") {
+        // The request object is deleted without a disconnect once the event source takes over the client
+        request->onDisconnect([]() {});
+        release(request->client()->getRemoteAddress());
       }
-      bool rebootNeeded = false;
-      std::string rebootMsg;
-      for (auto it = serializedData->begin(); it != serializedData->end(); ++it) {
-        if (it.key() == std::string("nfcTagNoPublish") && (it.value() != 0)) {
-          std::string clientId;
-          if (serializedData->contains("mqttClientId")) {
-            clientId = serializedData->at("mqttClientId");
-          }
-          std::string rfidTopic;
-          rfidTopic.append("homeassistant/tag/").append(!clientId.empty() ? clientId : espConfig::mqttData.mqttClientId).append("/rfid/config");
-          esp_mqtt_client_publish(client, rfidTopic.c_str(), "", 0, 0, false);
-        } else if (it.key() == std::string("setupCode")) {
-          std::string code = it.value().template get<std::string>();
-          if (espConfig::miscConfig.setupCode.c_str() != it.value() && code.length() == 8) {
-            if (homeSpan.controllerListBegin() == homeSpan.controllerListEnd()) {
-              homeSpan.setPairingCode(code.c_str());
-            }
-          }
-        } else if (it.key() == std::string("nfcNeopixelPin")) {
-          if (espConfig::miscConfig.nfcNeopixelPin == 255 && it.value() != 255 && neopixel_task_handle == nullptr) {
-            xTaskCreate(neopixel_task, "neopixel_task", 4096, NULL, 2, &neopixel_task_handle);
-            if (!pixel) {
-              pixel = std::make_shared<Pixel>(it.value(), PixelType::GRB);
-            }
-          } else if (espConfig::miscConfig.nfcNeopixelPin != 255 && it.value() == 255 && neopixel_task_handle != nullptr) {
-            uint8_t status = 2;
-            xQueueSend(neopixel_handle, &status, 0);
-            neopixel_task_handle = nullptr;
-          }
-        } else if (it.key() == std::string("nfcSuccessPin")) {
-          if (espConfig::miscConfig.nfcSuccessPin == 255 && it.value() != 255 && gpio_led_task_handle == nullptr) {
-            pinMode(it.value(), OUTPUT);
-            xTaskCreate(nfc_gpio_task, "nfc_gpio_task", 4096, NULL, 2, &gpio_led_task_handle);
-          } else if (espConfig::miscConfig.nfcSuccessPin != 255 && it.value() == 255 && gpio_led_task_handle != nullptr) {
-            if (serializedData->contains("nfcFailPin") && serializedData->at("nfcFailPin") == 255) {
-              uint8_t status = 2;
-              xQueueSend(gpio_led_handle, &status, 0);
-              gpio_led_task_handle = nullptr;
-            }
-          } else if (it.value() != 255) {
-            pinMode(it.value(), OUTPUT);
-          }
-        } else if (it.key() == std::string("nfcFailPin")) {
-          if (espConfig::miscConfig.nfcFailPin == 255 && it.value() != 255 && gpio_led_task_handle == nullptr) {
-            pinMode(it.value(), OUTPUT);
-            xTaskCreate(nfc_gpio_task, "nfc_gpio_task", 4096, NULL, 2, &gpio_led_task_handle);
-          } else if (espConfig::miscConfig.nfcFailPin != 255 && it.value() == 255 && gpio_led_task_handle != nullptr) {
-            if (serializedData->contains("nfcSuccessPin") && serializedData->at("nfcSuccessPin") == 255) {
-              uint8_t status = 2;
-              xQueueSend(gpio_led_handle, &status, 0);
-              gpio_led_task_handle = nullptr;
-            }
-          } else if (it.value() != 255) {
-            pinMode(it.value(), OUTPUT);
-          }
-        } else if (it.key() == std::string("btrLowStatusThreshold")) {
-          if (statusLowBtr && btrLevel) {
-            if (btrLevel->getVal() <= it.value()) {
-              statusLowBtr->setVal(1);
-            } else {
-              statusLowBtr->setVal(0);
-            }
-          }
-        } else if (it.key() == std::string("neoPixelType")) {
-          uint8_t pixelType = it.value().template get<uint8_t>();
-          if (pixelType != configData.at(it.key()).template get<uint8_t>()) {
-            rebootNeeded = true;
-            rebootMsg = "Pixel Type was changed, reboot needed! Rebooting...";
-          }
-        } else if (it.key() == std::string("gpioActionPin")) {
-          if (espConfig::miscConfig.gpioActionPin == 255 && it.value() != 255 ) {
-            LOG(D, "ENABLING HomeKit Trigger - Simple GPIO");
-            pinMode(it.value(), OUTPUT);
-            if(gpio_lock_task_handle == nullptr){
-              xTaskCreate(gpio_task, "gpio_task", 4096, NULL, 2, &gpio_lock_task_handle);
-            }
-            if(espConfig::miscConfig.hkDumbSwitchMode){
-              serializedData->at("hkDumbSwitchMode") = false;
-            }
-          } else if (espConfig::miscConfig.gpioActionPin != 255 && it.value() == 255) {
-            LOG(D, "DISABLING HomeKit Trigger - Simple GPIO");
-            if( gpio_lock_task_handle != nullptr){
-              gpioLockAction status{ .source = gpioLockAction::OTHER, .action = 2 };
-              xQueueSend(gpio_lock_handle, &status, 0);
-              gpio_lock_task_handle = nullptr;
-            }
-            gpio_reset_pin(gpio_num_t(espConfig::miscConfig.gpioActionPin));
-          }
-        } else if (it.key() == std::string("hkDumbSwitchMode") && gpio_lock_task_handle == nullptr) {
-          xTaskCreate(gpio_task, "gpio_task", 4096, NULL, 2, &gpio_lock_task_handle);
-        }
-        configData.at(it.key()) = it.value();
-      }
-      std::vector<uint8_t> vectorData = json::to_msgpack(configData);
-      esp_err_t set_nvs = nvs_set_blob(savedData, selConfig == 0 ? "MQTTDATA" : "MISCDATA", vectorData.data(), vectorData.size());
-      esp_err_t commit_nvs = nvs_commit(savedData);
-      LOG(D, "SET_STATUS: %s", esp_err_to_name(set_nvs));
-      LOG(D, "COMMIT_STATUS: %s", esp_err_to_name(commit_nvs));
-      if (set_nvs == ESP_OK && commit_nvs == ESP_OK) {
-        LOG(I, "Config successfully saved to NVS");
-        if (selConfig == 0) {
-          configData.get_to<espConfig::mqttConfig_t>(espConfig::mqttData);
-        } else {
-          configData.get_to<espConfig::misc_config_t>(espConfig::miscConfig);
-        }
-      } else {
-        LOG(E, "Something went wrong, could not save to NVS");
+      return false;
+    }
+
+    bool isRequestHandlerTrivial() override { return true; }
+  };
+
+  Gate gate;
+}
+
+namespace web_router {
+  struct route_t
+  {
+    const char* path;
+    WebRequestMethodComposite methods;
+    bool auth;
+    // Keep all request headers (If-None-Match, Authorization: Bearer, Idempotency-Key)
+    bool headers;
+    void (*onRequest)(AsyncWebServerRequest* req);
+    // Collects the body in `_tempObject`, segments of a body whose first segment was dropped must be ignored
+    void (*onBody)(AsyncWebServerRequest* req, uint8_t* data, size_t len, size_t index, size_t total);
+  };
+
+  // Must stay sorted by path, checked at compile time below
+  constexpr route_t routes[] = {
+    { "/", HTTP_GET, true, true, index_page::handleRequest, nullptr },
+    { "/config", HTTP_GET, true, false, web_routes::configGet, nullptr },
+    { "/config/clear", HTTP_POST, true, false, web_routes::configClear, nullptr },
+    { "/config/export", HTTP_POST, true, true, web_routes::configExport, nullptr },
+    { "/config/import", HTTP_POST, true, true, web_routes::configImport, body_buffer::accumulate<config_archive::maxSize> },
+    { "/config/mqtt_ca", HTTP_POST | HTTP_DELETE, true, false, web_routes::mqttCa, body_buffer::accumulate<web_routes::mqttCaMaxSize> },
+    { "/config/save", HTTP_POST, true, false, web_routes::configSave, body_buffer::accumulate<> },
+    { "/eth_get_config", HTTP_GET, true, false, web_routes::ethConfig, nullptr },
+    { "/get_wifi_rssi", HTTP_GET, true, false, web_routes::wifiRssi, nullptr },
+    { "/job", HTTP_GET, true, false, web_jobs::handleStatus, nullptr },
+    { "/lock", HTTP_POST, false, true, lock_api::handleRequest, nullptr },
+    { "/reboot_device", HTTP_GET, true, false, web_routes::rebootDevice, nullptr },
+    { "/reset_hk_pair", HTTP_GET, true, false, web_routes::resetHkPair, nullptr },
+    { "/reset_wifi_cred", HTTP_GET, true, false, web_routes::resetWifiCred, nullptr },
+    { "/start_config_ap", HTTP_GET, true, false, web_routes::startConfigAp, nullptr },
+    { "/tasks", HTTP_GET, true, false, web_routes::tasks, nullptr },
+  };
+
+  constexpr bool pathLess(const char* a, const char* b) {
+    while (*a && *a == *b) {
+      a++;
+      b++;
+    }
+    return (unsigned char)*a < (unsigned char)*b;
+  }
+
+  constexpr bool routesSorted() {
+    for (size_t i = 1; i < sizeof(routes) / sizeof(routes[0]); i++) {
+      if (!pathLess(routes[i - 1].path, routes[i].path)) return false;
+    }
+    return true;
+  }
+  static_assert(routesSorted(), "web_router::routes must be sorted by path without duplicates");
+
+  const route_t* find(AsyncWebServerRequest* req) {
+    const char* url = req->url().c_str();
+    const route_t* route = std::lower_bound(std::begin(routes), std::end(routes), url, [](const route_t& r, const char* path) { return pathLess(r.path, path); });
+    if (route == std::end(routes) || strcmp(route->path, url) != 0 || !(route->methods & req->method())) {
+      return nullptr;
+    }
+    return route;
+  }
+
+  class Router : public AsyncWebHandler
+  {
+  public:
+    bool canHandle(AsyncWebServerRequest* request) override {
+      const char* TAG = "web_router";
+      int64_t start = esp_timer_get_time();
+      const route_t* route = find(request);
+      LOG(V, "Routed %s in %lli us", request->url().c_str(), esp_timer_get_time() - start);
+      if (!route) return false;
+      if (route->headers) {
+        request->addInterestingHeader("ANY");
       }
-      if (selConfig == 0 || selConfig == 2) {
-        req->send(200, "text/plain", "Saved! Restarting...");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        ESP.restart();
-      } else {
-        if(rebootNeeded){
-          req->send(200, "text/plain", rebootMsg.c_str());
-        } else {
-          req->send(200, "text/plain", "Saved and applied!");
-        }
+      return true;
+    }
+
+    /**
+     * Credentials are checked once per request. A body is only started after its first segment
+     * passed the check, so a started body (`_tempObject` set) means the request is authenticated.
+     */
+    void handleRequest(AsyncWebServerRequest* request) override {
+      const route_t* route = find(request);
+      bool bodyAuthenticated = route->onBody && request->_tempObject;
+      if (route->auth && !bodyAuthenticated && !web_auth::check(request)) {
+        return request->requestAuthentication(web_auth::realm);
       }
+      route->onRequest(request);
     }
-  });
-  auto rebootDeviceHandle = new AsyncCallbackWebHandler();
-  rebootDeviceHandle->setUri("/reboot_device");
-  rebootDeviceHandle->setMethod(HTTP_GET);
-  rebootDeviceHandle->onRequest([](AsyncWebServerRequest* request) {
-    request->send(200, "text/plain", "Rebooting the device...");
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    ESP.restart();
-    });
-  webServer.addHandler(rebootDeviceHandle);
-  auto startConfigAP = new AsyncCallbackWebHandler();
-  startConfigAP->setUri("/start_config_ap");
-  startConfigAP->setMethod(HTTP_GET);
-  startConfigAP->onRequest([](AsyncWebServerRequest* request) {
-    request->send(200, "text/plain", "Starting the AP...");
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    webServer.end();
-    homeSpan.processSerialCommand("A");
-    });
-  webServer.addHandler(startConfigAP);
-  auto resetHkHandle = new AsyncCallbackWebHandler();
-  resetHkHandle->setUri("/reset_hk_pair");
-  resetHkHandle->setMethod(HTTP_GET);
-  resetHkHandle->onRequest([](AsyncWebServerRequest* request) {
-    request->send(200, "text/plain", "Erasing HomeKit pairings and restarting...");
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    deleteReaderData();
-    homeSpan.processSerialCommand("H");
-    });
-  webServer.addHandler(resetHkHandle);
-  auto resetWifiHandle = new AsyncCallbackWebHandler();
-  resetWifiHandle->setUri("/reset_wifi_cred");
-  resetWifiHandle->setMethod(HTTP_GET);
-  resetWifiHandle->onRequest([](AsyncWebServerRequest* request) {
-    request->send(200, "text/plain", "Erasing WiFi credentials and restarting, AP will start on boot...");
-    vTaskDelay(pdMS_TO_TICKS(1000));
-    homeSpan.processSerialCommand("X");
-    });
-  webServer.addHandler(resetWifiHandle);
-  auto getWifiRssi = new AsyncCallbackWebHandler();
-  getWifiRssi->setUri("/get_wifi_rssi");
-  getWifiRssi->setMethod(HTTP_GET);
-  getWifiRssi->onRequest([](AsyncWebServerRequest* request) {
-    std::string rssi_val = std::to_string(WiFi.RSSI());
-    request->send(200, "text/plain", rssi_val.c_str());
-    });
-  webServer.addHandler(getWifiRssi);
-  AsyncCallbackWebHandler* rootHandle = new AsyncCallbackWebHandler();
-  webServer.addHandler(rootHandle);
-  rootHandle->setUri("/");
-  rootHandle->setMethod(HTTP_GET);
-  rootHandle->onRequest([](AsyncWebServerRequest* req) {
-    req->send(LittleFS, "/index.html", "text/html", false, indexProcess);
-  });
-  AsyncCallbackWebHandler* hashPage = new AsyncCallbackWebHandler();
-  webServer.addHandler(hashPage);
-  hashPage->setUri("/#*");
-  hashPage->setMethod(HTTP_GET);
-  hashPage->onRequest([](AsyncWebServerRequest* req) {
-    req->send(LittleFS, "/index.html", "text/html", false, indexProcess);
-  });
+
+    void handleBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, size_t index, size_t total) override {
+      const route_t* route = find(request);
+      if (!route || !route->onBody) return;
+      // Bodies of unauthenticated requests are dropped before they reach the handler, the later segments with them
+      if (index == 0 && route->auth && !web_auth::check(request)) return;
+      route->onBody(request, data, len, index, total);
+    }
+
+    bool isRequestHandlerTrivial() override { return false; }
+  };
+
+  Router router;
+}
+void setupWeb() {
+  uint32_t heapBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  web_jobs::begin();
+  webServer.addHandler(&web_admission::gate);
+  AsyncWebHandler* assetsHandle;
+  AsyncWebHandler* routesHandle;
+  if (webAssets.empty() && !CachedStaticHandler::loadManifest(LittleFS, webAssets)) {
+    LOG(W, "Web assets manifest not found, serving LittleFS files without caching");
+    assetsHandle = new AsyncStaticWebHandler("/assets", LittleFS, "/assets/", NULL);
+    routesHandle = new AsyncStaticWebHandler("/fragment", LittleFS, "/routes", NULL);
+  } else {
+    assetsHandle = new CachedStaticHandler("/assets", "/assets", webAssets);
+    routesHandle = new CachedStaticHandler("/fragment", "/routes", webAssets, true);
+  }
+  if (index_page::etag.empty() && !index_page::prepare()) {
+    LOG(E, "Could not prepare the index page!");
+  }
+  assetsHandle->setFilter(headersFix);
+  webServer.addHandler(assetsHandle);
+  routesHandle->setFilter(headersFix);
+  webServer.addHandler(routesHandle);
+  webServer.addHandler(&web_router::router);
   if (espConfig::miscConfig.webAuthEnabled) {
     LOG(I, "Web Authentication Enabled");
-    routesHandle->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    dataProvision->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    dataLoad->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    dataClear->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    rootHandle->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    hashPage->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    resetHkHandle->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    resetWifiHandle->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    getWifiRssi->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    startConfigAP->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
-    ethSuppportConfig->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
+    web_auth::begin();
+    if (webAssets.empty()) {
+      routesHandle->setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
+    }
+    ui_events::source.setAuthentication(espConfig::miscConfig.webUsername.c_str(), espConfig::miscConfig.webPassword.c_str());
   }
+  ui_events::source.onConnect([](AsyncEventSourceClient* eventClient) {
+    if (ui_events::source.count() > ui_events::maxClients) {
+      LOG(W, "Too many event stream clients, closing the newest one");
+      eventClient->close();
+      return;
+    }
+    std::string info = std::string("{\"version\":\"").append(esp_app_get_description()->version).append("\"}");
+    eventClient->send(info.c_str(), "info", millis());
+  });
+  webServer.addHandler(&ui_events::source);
   webServer.onNotFound(notFound);
   webServer.begin();
+  LOG(D, "Web server set up with %u routes, %ld bytes of heap used", sizeof(web_router::routes) / sizeof(web_router::routes[0]), (long)heapBefore - (long)heap_caps_get_free_size(MALLOC_CAP_8BIT));
 }
 
 void mqttConfigReset(const char* buf) {
@@ -1753,10 +4320,14 @@ void mqttConfigReset(const char* buf) {
 
 void wifiCallback(int status) {
   if (status == 1) {
-    if (espConfig::mqttData.mqttBroker.size() >= 7 && espConfig::mqttData.mqttBroker.size() <= 16 && !std::equal(espConfig::mqttData.mqttBroker.begin(), espConfig::mqttData.mqttBroker.end(), "0.0.0.0")) {
+    if (!espConfig::mqttData.mqttBroker.empty() && espConfig::mqttData.mqttBroker != "0.0.0.0") {
       mqtt_app_start();
     }
     setupWeb();
+    lan_events::begin();
+    if (espConfig::mqttData.telemetryInterval > 0 && telemetry_task_handle == nullptr) {
+      task_plan::create(telemetry_task, "telemetry_task", NULL, &telemetry_task_handle);
+    }
   }
 }
 
@@ -1766,6 +4337,39 @@ void mqtt_publish(std::string topic, std::string payload, uint8_t qos, bool reta
   } else LOG(W, "MQTT Client not initialized, cannot publish message");
 }
 
+/**
+ * Doorbell button on `doorbellPin` (active LOW), served by the `buttons` task. Presses are
+ * classified into single, double and long press, forwarded to the HomeKit doorbell switch and
+ * published to `doorbellTopic`.
+ */
+namespace doorbell {
+  const char* TAG = "doorbell";
+
+  void onButton(uint8_t id, buttons::type_t type, int64_t time) {
+    uint8_t event;
+    const char* payload;
+    switch (type) {
+      case buttons::SINGLE: event = Characteristic::ProgrammableSwitchEvent::SINGLE_PRESS; payload = "single"; break;
+      case buttons::DOUBLE: event = Characteristic::ProgrammableSwitchEvent::DOUBLE_PRESS; payload = "double"; break;
+      case buttons::HOLD: event = Characteristic::ProgrammableSwitchEvent::LONG_PRESS; payload = "long"; break;
+      default: return;
+    }
+    events::event_t ev{};
+    ev.topic = events::DOORBELL;
+    ev.doorbell = { event, time };
+    events::publish(ev);
+    LOG(I, "Doorbell %s press", payload);
+    if (client != nullptr && !espConfig::mqttData.doorbellTopic.empty()) {
+      mqtt_publish(espConfig::mqttData.doorbellTopic, payload, 0, false);
+    }
+  }
+
+  void begin() {
+    if (espConfig::miscConfig.doorbellPin == 255) return;
+    buttons::add({ .pin = espConfig::miscConfig.doorbellPin, .mode = INPUT_PULLUP, .activeHigh = false, .debounceMs = 30, .holdMs = 1000, .doubleMs = 400, .handler = onButton });
+  }
+}
+
 std::string hex_representation(const std::vector<uint8_t>& v) {
   std::string hex_tmp;
   for (auto x : v) {
@@ -1793,6 +4397,10 @@ void nfc_retry(void* arg) {
       nfc->setRFField(0x02, 0x01);
       nfc->setPassiveActivationRetries(0);
       ESP_LOGI("NFC_SETUP", "Waiting for an ISO14443A card");
+      events::event_t ev{};
+      ev.topic = events::NFC;
+      ev.nfc.connected = true;
+      events::publish(ev);
       vTaskResume(nfc_poll_task);
       vTaskDelete(NULL);
       return;
@@ -1810,15 +4418,11 @@ void nfc_retry(void* arg) {
 extern PN532 *nfc;
 extern readerData_t readerData;
 extern SemaphoreHandle_t readerDataMutex; // Mutex handle must be created in setup()
-extern QueueHandle_t gpio_led_handle;
-extern QueueHandle_t neopixel_handle;
-extern QueueHandle_t gpio_lock_handle;
 extern TaskHandle_t nfc_reconnect_task;
 extern esp_mqtt_client_handle_t client;
 extern SpanCharacteristic* lockCurrentState;
 extern SpanCharacteristic* lockTargetState;
 extern KeyFlow hkFlow;
-extern bool hkAltActionActive;
 extern uint8_t ecpData[18]; // Used for communicateThru
 
 // Function declarations needed if not already visible
@@ -1834,6 +4438,12 @@ extern void trigger_nfc_reconnect(const char* reason);
 void trigger_nfc_reconnect(const char* reason) {
   const char* TAG_RECONNECT = "NFC_RECONNECT";
   ESP_LOGE(TAG_RECONNECT, "Triggering PN532 reconnect due to: %s", reason);
+  pn532ReconnectCount.fetch_add(1, std::memory_order_relaxed);
+  events::event_t ev{};
+  ev.topic = events::NFC;
+  ev.nfc.connected = false;
+  strlcpy(ev.nfc.reason, reason, sizeof(ev.nfc.reason));
+  events::publish(ev);
 
   if (nfc) {
       nfc->stop(); // Attempt to cleanly stop the NFC interface
@@ -1844,7 +4454,7 @@ void trigger_nfc_reconnect(const char* reason) {
   // the handle is a basic preventative measure against creating duplicates rapidly.
   if (nfc_reconnect_task == nullptr) {
       ESP_LOGI(TAG_RECONNECT, "Creating nfc_reconnect_task...");
-      BaseType_t ret = xTaskCreate(nfc_retry, "nfc_reconnect_task", 8192, NULL, 5, &nfc_reconnect_task); // Increased priority maybe?
+      BaseType_t ret = task_plan::create(nfc_retry, "nfc_reconnect_task", NULL, &nfc_reconnect_task);
       if (ret != pdPASS) {
           ESP_LOGE(TAG_RECONNECT, "Failed to create nfc_reconnect_task! System may not recover NFC.");
           // Cannot suspend if task creation failed, maybe just loop with delay?
@@ -1908,6 +4518,7 @@ void nfc_thread_entry(void* arg) {
   // === Main NFC Loop ===      //
   // ===========================//
   while (1) {
+      nfcLoopCount.fetch_add(1, std::memory_order_relaxed);
       if (!nfc_initialized) {
           // Should not happen if initial checks passed, but as a safeguard
           ESP_LOGE(TAG_NFC, "NFC not initialized at start of loop. Attempting reconnect.");
@@ -1985,6 +4596,11 @@ void nfc_thread_entry(void* arg) {
           ESP_LOGD(TAG_NFC, "ATQA: %02x%02x, SAK: %02x", atqa[1], atqa[0], sak[0]);
           ESP_LOG_BUFFER_HEX_LEVEL(TAG_NFC, uid, uidLen, ESP_LOG_VERBOSE);
 
+          events::event_t tapEvent{};
+          tapEvent.topic = events::TAP;
+          tapEvent.tap.result = events::TAP_DETECTED;
+          events::publish(tapEvent);
+          const int64_t detectedAt = tapEvent.time;
           nfc->setPassiveActivationRetries(5); // Increase retries for subsequent commands
           auto startTime = std::chrono::high_resolution_clock::now();
 
@@ -2059,20 +4675,14 @@ void nfc_thread_entry(void* arg) {
               // --- Process Authentication Result (outside the lock) ---
               if (authAttempted && flowResult != kFlowFailed) {
                   ESP_LOGI(TAG_NFC, ">>> HomeKey Authentication Successful! <<<");
-                  bool successStatus = true;
-                  if (espConfig::miscConfig.nfcSuccessPin != 255) xQueueSend(gpio_led_handle, &successStatus, 0);
-                  if (espConfig::miscConfig.nfcNeopixelPin != 255) xQueueSend(neopixel_handle, &successStatus, 0);
-
-                  if ((espConfig::miscConfig.gpioActionPin != 255 && espConfig::miscConfig.hkGpioControlledState) || espConfig::miscConfig.hkDumbSwitchMode) {
-                      ESP_LOGD(TAG_NFC,"Sending action to gpio_task queue due to successful HomeKey auth.");
-                      const gpioLockAction action{ .source = gpioLockAction::HOMEKEY, .action = 0 };
-                      if (gpio_lock_handle) xQueueSend(gpio_lock_handle, &action, pdMS_TO_TICKS(50));
-                  }
+                  tapEvent.tap.result = events::TAP_SUCCESS;
+                  memcpy(tapEvent.tap.issuerId, issuerIdResult.data(), std::min(issuerIdResult.size(), sizeof(tapEvent.tap.issuerId)));
+                  memcpy(tapEvent.tap.endpointId, endpointIdResult.data(), std::min(endpointIdResult.size(), sizeof(tapEvent.tap.endpointId)));
+                  tap_latency::publish(tapEvent, detectedAt);
 
-                  if (espConfig::miscConfig.hkAltActionInitPin != 255 && espConfig::miscConfig.hkAltActionPin != 255 && hkAltActionActive) {
+                  if (espConfig::miscConfig.hkAltActionInitPin != 255 && espConfig::miscConfig.hkAltActionPin != 255 && actuator::altArmed()) {
                        ESP_LOGI(TAG_NFC, "Alt Action is active, triggering related GPIO/MQTT.");
-                       uint8_t alt_action_status = 2;
-                       if(gpio_led_handle) xQueueSend(gpio_led_handle, &alt_action_status, 0);
+                       actuator::altAction();
                        mqtt_publish(espConfig::mqttData.hkAltActionTopic, "alt_action", 0, false);
                   }
 
@@ -2084,32 +4694,21 @@ void nfc_thread_entry(void* arg) {
                   mqtt_publish(espConfig::mqttData.hkTopic, payload.dump(), 0, false);
 
                   if (espConfig::miscConfig.lockAlwaysUnlock) {
-                       ESP_LOGI(TAG_NFC, "Config lockAlwaysUnlock=true, setting TargetState to UNLOCKED.");
-                       lockTargetState->setVal(lockStates::UNLOCKED);
-                       if (espConfig::mqttData.lockEnableCustomState) mqtt_publish(espConfig::mqttData.lockCustomStateTopic, std::to_string(espConfig::mqttData.customLockActions["UNLOCK"]), 0, false);
+                       ESP_LOGI(TAG_NFC, "Config lockAlwaysUnlock=true, unlocking.");
+                       lock_fsm::post(lock_fsm::HOMEKEY, lock_fsm::CMD_UNLOCK);
                   } else if (espConfig::miscConfig.lockAlwaysLock) {
-                       ESP_LOGI(TAG_NFC, "Config lockAlwaysLock=true, setting TargetState to LOCKED.");
-                       lockTargetState->setVal(lockStates::LOCKED);
-                       if (espConfig::mqttData.lockEnableCustomState) mqtt_publish(espConfig::mqttData.lockCustomStateTopic, std::to_string(espConfig::mqttData.customLockActions["LOCK"]), 0, false);
+                       ESP_LOGI(TAG_NFC, "Config lockAlwaysLock=true, locking.");
+                       lock_fsm::post(lock_fsm::HOMEKEY, lock_fsm::CMD_LOCK);
                   } else {
-                       if(lockCurrentState != nullptr && lockTargetState != nullptr) {
-                            int current_state = lockCurrentState->getVal();
-                            int new_target = (current_state == lockStates::LOCKED) ? lockStates::UNLOCKED : lockStates::LOCKED;
-                            ESP_LOGI(TAG_NFC, "Config toggling state, setting TargetState to %d (opposite of current %d).", new_target, current_state);
-                            lockTargetState->setVal(new_target);
-                            if (espConfig::mqttData.lockEnableCustomState) {
-                                 std::string customAction = (new_target == lockStates::UNLOCKED) ? "UNLOCK" : "LOCK";
-                                 mqtt_publish(espConfig::mqttData.lockCustomStateTopic, std::to_string(espConfig::mqttData.customLockActions[customAction]), 0, false);
-                            }
-                       } else { ESP_LOGE(TAG_NFC, "Cannot toggle state, characteristics invalid!"); }
+                       ESP_LOGI(TAG_NFC, "Config toggling state.");
+                       lock_fsm::post(lock_fsm::HOMEKEY, lock_fsm::CMD_TOGGLE);
                   }
                   auto stopTime = std::chrono::high_resolution_clock::now();
                   ESP_LOGI(TAG_NFC, "Total Time (detection->auth->queue): %lli ms", std::chrono::duration_cast<std::chrono::milliseconds>(stopTime - startTime).count());
               } else {
                   ESP_LOGW(TAG_NFC, "--- HomeKey Authentication FAILED (AuthAttempted: %d, FlowResult: %d) ---", authAttempted, flowResult);
-                  bool failStatus = false;
-                  if (espConfig::miscConfig.nfcFailPin != 255) xQueueSend(gpio_led_handle, &failStatus, 0);
-                  if (espConfig::miscConfig.nfcNeopixelPin != 255) xQueueSend(neopixel_handle, &failStatus, 0);
+                  tapEvent.tap.result = events::TAP_FAIL;
+                  tap_latency::publish(tapEvent, detectedAt);
               }
               // --- End Process Authentication Result ---
 
@@ -2122,9 +4721,11 @@ void nfc_thread_entry(void* arg) {
                        (selectCmdResLength >= 2) ? selectCmdRes[selectCmdResLength - 2] : 0xFF,
                        (selectCmdResLength >= 1) ? selectCmdRes[selectCmdResLength - 1] : 0xFF);
 
-              bool failStatus = false; // Signal failure locally
-              if (espConfig::miscConfig.nfcFailPin != 255) xQueueSend(gpio_led_handle, &failStatus, 0);
-              if (espConfig::miscConfig.nfcNeopixelPin != 255) xQueueSend(neopixel_handle, &failStatus, 0);
+              // Signals failure locally
+              tapEvent.tap.result = events::TAP_TAG;
+              tapEvent.tap.uidLen = std::min<size_t>(uidLen, sizeof(tapEvent.tap.uid));
+              memcpy(tapEvent.tap.uid, uid, tapEvent.tap.uidLen);
+              tap_latency::publish(tapEvent, detectedAt);
 
               if (!espConfig::mqttData.nfcTagNoPublish) {
                   // Publish UID etc. to MQTT if configured
@@ -2185,19 +4786,58 @@ void onEvent(arduino_event_id_t event, arduino_event_info_t info) {
   }
 }
 
+/**
+ * Event bus subscriber for everything that writes HomeSpan characteristics. It is drained from
+ * `loop()`, HomeSpan's task, which the bus wakes up early instead of letting it sleep out its
+ * 5 ms delay.
+ */
+namespace hap_events {
+  const char* TAG = "hap_events";
+  int subscriber = -1;
+  TaskHandle_t task = nullptr;
+
+  void begin() {
+    task = xTaskGetCurrentTaskHandle();
+    subscriber = events::bus.subscribe("hap", events::bit(events::LOCK_INPUT) | events::bit(events::DOORBELL) | events::bit(events::BATTERY), events::wakeTask, &task);
+  }
+
+  void drain() {
+    events::event_t ev;
+    while (subscriber >= 0 && events::bus.receive(subscriber, ev)) {
+      switch (ev.topic) {
+      case events::LOCK_INPUT: {
+        bool queued = lock_fsm::handle(lock_fsm::source_t(ev.lockInput.source), lock_fsm::event_t(ev.lockInput.event));
+        if (ev.lockInput.request) {
+          lock_api::complete(ev.lockInput.request, queued);
+        }
+        LOG(D, "Lock event handled %lli us after it was posted", esp_timer_get_time() - ev.time);
+        break;
+      }
+      case events::DOORBELL:
+        if (homekit_doorbell != nullptr) {
+          homekit_doorbell->triggerHomeKitEvent(ev.doorbell.press);
+          // Includes the wait for a second press or the hold time that classified the event
+          LOG(I, "Doorbell HAP event %lli us after the press", esp_timer_get_time() - ev.doorbell.pressedAt);
+        }
+        break;
+      case events::BATTERY:
+        if (btrLevel && statusLowBtr) {
+          btrLevel->setVal(ev.battery.level);
+          statusLowBtr->setVal(ev.battery.level <= espConfig::miscConfig.btrLowStatusThreshold ? 1 : 0);
+        }
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
 void setup() {
   Serial.begin(115200);
   const esp_app_desc_t* app_desc = esp_app_get_description();
   std::string app_version = app_desc->version;
-  gpio_led_handle = xQueueCreate(2, sizeof(uint8_t));
-  neopixel_handle = xQueueCreate(2, sizeof(uint8_t));
-  gpio_lock_handle = xQueueCreate(2, sizeof(gpioLockAction));
   readerDataMutex = xSemaphoreCreateMutex();
-  LOG(I, "Setting up physical doorbell sense pin %d...", GPIO_DOORBELL_SENSE_PIN);
-    pinMode(GPIO_DOORBELL_SENSE_PIN, INPUT);
-    attachInterrupt(digitalPinToInterrupt(GPIO_DOORBELL_SENSE_PIN), handle_doorbell_sense_interrupt, FALLING);
-    LOG(I, "Interrupt attached to GPIO %d for doorbell sense (FALLING edge).", GPIO_DOORBELL_SENSE_PIN);
-
   size_t len;
   const char* TAG = "SETUP";
   nvs_open("SAVED_DATA", NVS_READWRITE, &savedData);
@@ -2380,6 +5020,8 @@ void setup() {
       LOG(I, "Low status set to LOW");
     }
   });
+  new SpanUserCommand('E', "Print event bus counters", events::printStats);
+  new SpanUserCommand('T', "Print task profile (T0 clears the stack peaks)", task_profiler::printCommand);
   new SpanUserCommand('B', "Btr level", [](const char* arg) {
     uint8_t level = atoi(static_cast<const char *>(arg + 1));
     btrLevel->setVal(level);
@@ -2392,7 +5034,9 @@ void setup() {
   new LockManagement();
   new LockMechanism();
   new NFCAccess();
-  homekit_doorbell = new DoorbellSensor();
+  if (espConfig::miscConfig.doorbellPin != 255) {
+    homekit_doorbell = new DoorbellSensor();
+  }
   if (espConfig::miscConfig.proxBatEnabled) {
     new PhysicalLockBattery();
   }
@@ -2400,71 +5044,22 @@ void setup() {
   homeSpan.setConnectionCallback(wifiCallback);
   if (espConfig::miscConfig.nfcNeopixelPin != 255) {
     pixel = std::make_shared<Pixel>(espConfig::miscConfig.nfcNeopixelPin, pixelTypeMap[espConfig::miscConfig.neoPixelType]);
-    xTaskCreate(neopixel_task, "neopixel_task", 4096, NULL, 2, &neopixel_task_handle);
-  }
-  if (espConfig::miscConfig.nfcSuccessPin != 255 || espConfig::miscConfig.nfcFailPin != 255) {
-    xTaskCreate(nfc_gpio_task, "nfc_gpio_task", 4096, NULL, 2, &gpio_led_task_handle);
-  }
-  if (espConfig::miscConfig.gpioActionPin != 255 || espConfig::miscConfig.hkDumbSwitchMode) {
-    xTaskCreate(gpio_task, "gpio_task", 4096, NULL, 2, &gpio_lock_task_handle);
-  }
-  if (espConfig::miscConfig.hkAltActionInitPin != 255) {
-    xTaskCreate(alt_action_task, "alt_action_task", 2048, NULL, 2, &alt_action_task_handle);
   }
-  xTaskCreate(nfc_thread_entry, "nfc_task", 8192, NULL, 1, &nfc_poll_task);
+  hap_events::begin();
+  ui_events::begin();
+  task_profiler::begin();
+  actuator::begin();
+  doorbell::begin();
+  task_plan::create(nfc_thread_entry, "nfc_task", NULL, &nfc_poll_task);
+  // The state restored from NVS, later changes are reported by lock_fsm
+  lock_fsm::notify(lockCurrentState->getVal(), lockTargetState->getVal());
 }
 
 //////////////////////////////////////
 
-#define GPIO_DOORBELL_SENSE_PIN   10  // Example GPIO, choose an available one
-
-// --- Global state for interrupt safety ---
-volatile bool physical_doorbell_pressed_flag = false;
-unsigned long last_physical_press_event_time = 0;
-const unsigned long SENSE_DEBOUNCE_MS = 500; // milliseconds
-
-// --- Interrupt Service Routine (ISR) ---
-void IRAM_ATTR handle_doorbell_sense_interrupt() {
-    unsigned long current_time = millis();
-    if (digitalRead(GPIO_DOORBELL_SENSE_PIN) == LOW) { // Active LOW (3.3V -> 0V on press)
-        if (current_time - last_physical_press_event_time > SENSE_DEBOUNCE_MS) {
-            physical_doorbell_pressed_flag = true;
-            last_physical_press_event_time = current_time;
-        }
-    }
-}
-
-// --- Function to be called from the main loop to act on the interrupt flag ---
-void check_and_notify_doorbell_press() {
-    if (physical_doorbell_pressed_flag) {
-        LOG(I, "Physical doorbell button was pressed!");
-
-        // === YOUR NOTIFICATION LOGIC GOES HERE ===
-
-        // 1. Trigger HomeKit Event
-        if (homekit_doorbell != nullptr) {
-            homekit_doorbell->triggerHomeKitEvent();
-        } else {
-            LOG(E, "homekit_doorbell service not initialized!");
-        }
-
-        // 2. Send an MQTT message (optional, if you still want this)
-        if (client != nullptr) {
-           mqtt_publish("your/doorbell/topic", "pressed", 0, false); // Change topic as needed
-        }
-
-        // 3. Other actions (flash LED, etc.)
-        // ...
-
-        // =========================================
-
-        // Reset the flag so we don't process the same press again
-        physical_doorbell_pressed_flag = false;
-    }
-}
-
 void loop() {
   homeSpan.poll();
-  check_and_notify_doorbell_press();
-  vTaskDelay(5);
+  hap_events::drain();
+  ui_events::drain();
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(5));
 }
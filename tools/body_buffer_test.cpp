@@ -0,0 +1,115 @@
+// Host test for the request body accumulator in main/include/body_buffer.h.
+//
+// Feeds bodies the way AsyncWebServer hands them over, in segments with their offset and the
+// total length, including the broken cases: a gap or overlap between segments, a segment past
+// the announced length, a body over the limit and a second body on the same request.
+//
+// Build: g++ -std=c++17 -O2 -Wall -Wextra -Imain/include tools/body_buffer_test.cpp -o body_buffer_test
+// Usage: body_buffer_test, exits with 1 if a check failed
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "body_buffer.h"
+
+namespace {
+  int failures = 0;
+
+  void check(bool ok, const char* what) {
+    if (!ok) {
+      printf("FAIL %s\n", what);
+      failures++;
+    }
+  }
+
+  // Owns the slot like AsyncWebServerRequest owns `_tempObject`
+  struct request_t {
+    void* slot = nullptr;
+    ~request_t() { free(slot); }
+  };
+
+  // Sends `body` in segments of the given sizes, the last one takes the rest
+  void feed(request_t& req, const std::string& body, const std::vector<size_t>& sizes, size_t limit = body_buffer::maxSize) {
+    size_t index = 0;
+    for (size_t i = 0; index < body.size(); i++) {
+      size_t len = i < sizes.size() ? std::min(sizes[i], body.size() - index) : body.size() - index;
+      body_buffer::accumulate(req.slot, limit, (const uint8_t*)body.data() + index, len, index, body.size());
+      index += len;
+    }
+  }
+
+  bool holds(const request_t& req, const std::string& body) {
+    const body_buffer::body_t* got = body_buffer::complete(req.slot);
+    return got && got->total == body.size() && std::string(got->data, got->total) == body;
+  }
+
+  std::string pattern(size_t size) {
+    std::string body(size, 0);
+    for (size_t i = 0; i < size; i++) body[i] = "0123456789abcdef"[(i * 7) % 16];
+    return body;
+  }
+}
+
+int main() {
+  {
+    request_t req;
+    std::string body = "{\"mqttBroker\":\"10.0.0.2\"}";
+    feed(req, body, {});
+    check(holds(req, body), "single segment");
+    check(!body_buffer::tooLarge(req.slot, body.size(), body_buffer::maxSize), "single segment is not too large");
+  }
+  {
+    request_t req;
+    std::string body = pattern(body_buffer::maxSize);
+    feed(req, body, { 1, 1436, 1436, 7 });
+    check(holds(req, body), "segments up to the limit");
+  }
+  {
+    request_t req;
+    std::string body = pattern(100);
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, (const uint8_t*)body.data(), 40, 0, body.size());
+    check(body_buffer::complete(req.slot) == nullptr, "incomplete body");
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, (const uint8_t*)body.data() + 50, 50, 50, body.size());
+    check(body_buffer::complete(req.slot) == nullptr, "gap between segments");
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, (const uint8_t*)body.data() + 30, 70, 30, body.size());
+    check(body_buffer::complete(req.slot) == nullptr, "overlapping segment");
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, (const uint8_t*)body.data() + 40, 60, 40, body.size());
+    check(holds(req, body), "body completed after dropped segments");
+  }
+  {
+    request_t req;
+    std::string body = pattern(64);
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, (const uint8_t*)body.data(), 64, 0, 32);
+    check(body_buffer::complete(req.slot) == nullptr, "segment past the announced length");
+  }
+  {
+    request_t req;
+    std::string body = pattern(body_buffer::maxSize + 1);
+    feed(req, body, { 1436 });
+    check(body_buffer::complete(req.slot) == nullptr, "body over the limit is not kept");
+    check(body_buffer::tooLarge(req.slot, 0, body_buffer::maxSize), "body over the limit is flagged");
+    check(body_buffer::tooLarge(nullptr, body.size(), body_buffer::maxSize), "content length over the limit");
+  }
+  {
+    request_t req;
+    std::string body = pattern(20000);
+    feed(req, body, { 1436 }, 24576);
+    check(holds(req, body), "custom limit");
+  }
+  {
+    request_t req;
+    std::string first = pattern(300), second = "{\"a\":1}";
+    feed(req, first, { 100 });
+    feed(req, second, {});
+    check(holds(req, second), "a new body replaces the previous one");
+  }
+  {
+    request_t req;
+    std::string empty;
+    body_buffer::accumulate(req.slot, body_buffer::maxSize, nullptr, 0, 0, 0);
+    check(holds(req, empty), "empty body");
+  }
+  check(body_buffer::complete(nullptr) == nullptr, "no body");
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
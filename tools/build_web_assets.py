@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Prepares the web UI in data/ for the LittleFS image.
+
+- HTML/CSS/JS are minified (comments and indentation stripped).
+- Text files are stored gzipped only (`name.gz`); AsyncWebServer picks the `.gz` file and sends it
+  with `Content-Encoding: gzip`.
+- References to `assets/...` get a `?v=<hash>` suffix so assets can be cached as immutable.
+- `manifest.txt` lists `<path> <etag> <flags>` per file, flags: g = stored gzipped, i = immutable.
+- index.html is bundled: the stylesheet, images up to INLINE_LIMIT bytes and the page fragments
+  (as `<template id="fragment-<name>">`) are inlined so the UI loads with a single request.
+  Assets still referenced from it are listed in `page/preload.txt` and sent as `Link: preload`.
+- The LittleFS blocks the output takes are estimated and the build fails if they don't fit the
+  partition (`--fs-size`, `--block-size`) with `--reserve` blocks left for files written at runtime.
+
+Usage: build_web_assets.py [--fs-size 0x20000] [--block-size 4096] [--reserve 4] <data dir> <output dir>
+"""
+import argparse
+import base64
+import gzip
+import hashlib
+import re
+import shutil
+import sys
+from pathlib import Path
+
+TEXT_TYPES = {".html", ".css", ".js", ".json", ".svg"}
+BUNDLED = {"index.html"}
+IMMUTABLE_DIRS = {"assets"}
+INLINE_LIMIT = 2048
+MIME_TYPES = {".webp": "image/webp", ".png": "image/png", ".svg": "image/svg+xml", ".css": "text/css"}
+
+
+def minify(name, text):
+    if name.endswith(".html"):
+        text = re.sub(r"<!--.*?-->", "", text, flags=re.S)
+    if name.endswith(".css"):
+        text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    lines = (line.strip() for line in text.splitlines())
+    return "\n".join(line for line in lines if line)
+
+
+def content_hash(data):
+    return hashlib.sha256(data).hexdigest()[:16]
+
+
+def asset_refs(text):
+    return set(re.findall(r'(?:(?:src|href)="|url\()assets/([\w.\-]+?)(?:\?v=\w+)?[")]', text))
+
+
+def inline_images(text, src):
+    def data_uri(m):
+        path = src / "assets" / m.group(2)
+        if path.suffix not in MIME_TYPES or path.suffix == ".css" or path.stat().st_size > INLINE_LIMIT:
+            return m.group(0)
+        return f'{m.group(1)}data:{MIME_TYPES[path.suffix]};base64,{base64.b64encode(path.read_bytes()).decode()}{m.group(3)}'
+    return re.sub(r'((?:src|href)="|url\()assets/([\w.\-]+?)(?:\?v=\w+)?([")])', data_uri, text)
+
+
+def bundle_index(text, src):
+    """Inlines the stylesheet, small images and the page fragments into index.html."""
+    def stylesheet(m):
+        css = src / "assets" / m.group(1)
+        return f"<style>{minify(css.name, css.read_text())}</style>"
+    text = re.sub(r'<link rel="stylesheet" href="assets/([\w.\-]+?)(?:\?v=\w+)?">', stylesheet, text)
+    text = inline_images(text, src)
+    fragments = "".join(f'<template id="fragment-{path.stem}">{inline_images(minify(path.name, path.read_text()), src)}</template>'
+                        for path in sorted((src / "routes").glob("*.html")))
+    text = text.replace("</body>", fragments + "</body>", 1)
+    preload = sorted(set(re.findall(r'["(](assets/[\w.\-]+(?:\?v=\w+)?)[")]', text)))
+    return text, preload
+
+
+def littlefs_blocks(out, block_size):
+    """Upper estimate of the blocks LittleFS needs for `out`.
+
+    The superblock and every directory take a metadata pair (2 blocks). Files up to an eighth of
+    a block are inlined into their directory, larger ones take a CTZ skip-list whose blocks lose
+    up to 8 bytes to pointers each.
+    """
+    blocks = 2 + 2 * sum(1 for p in out.rglob("*") if p.is_dir())
+    for path in out.rglob("*"):
+        if path.is_file() and path.stat().st_size > block_size // 8:
+            blocks += -(-path.stat().st_size // (block_size - 8))
+    return blocks
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--fs-size", type=lambda v: int(v, 0), default=0x20000, help="size of the LittleFS partition")
+    parser.add_argument("--block-size", type=int, default=4096)
+    parser.add_argument("--reserve", type=int, default=4, help="blocks to keep free for files written at runtime")
+    parser.add_argument("src")
+    parser.add_argument("out")
+    args = parser.parse_args()
+    src, out = Path(args.src), Path(args.out)
+    if out.exists():
+        shutil.rmtree(out)
+    out.mkdir(parents=True)
+
+    files = sorted(p for p in src.rglob("*") if p.is_file())
+    # Hash the assets first so the pages can reference them with a version suffix
+    asset_hashes = {}
+    for path in files:
+        rel = path.relative_to(src).as_posix()
+        if rel.split("/")[0] in IMMUTABLE_DIRS and path.suffix not in TEXT_TYPES:
+            asset_hashes[rel] = content_hash(path.read_bytes())
+    for path in files:
+        rel = path.relative_to(src).as_posix()
+        if rel.split("/")[0] in IMMUTABLE_DIRS and path.suffix in TEXT_TYPES:
+            asset_hashes[rel] = content_hash(minify(path.name, path.read_text()).encode())
+
+    def version_refs(text):
+        return re.sub(r"assets/([\w.\-]+)", lambda m: f"assets/{m.group(1)}?v={asset_hashes[f'assets/{m.group(1)}'][:8]}"
+                      if f"assets/{m.group(1)}" in asset_hashes else m.group(0), text)
+
+    manifest = []
+    total_raw = total_out = 0
+    print(f"{'file':<32}{'raw':>10}{'stored':>10}")
+    for path in files:
+        rel = path.relative_to(src).as_posix()
+        raw = path.read_bytes()
+        dest = out / rel
+        dest.parent.mkdir(parents=True, exist_ok=True)
+        flags = "i" if rel.split("/")[0] in IMMUTABLE_DIRS else ""
+        if path.suffix in TEXT_TYPES:
+            data = version_refs(minify(path.name, raw.decode())).encode()
+            if path.name in BUNDLED:
+                fragments = list((src / "routes").glob("*.html"))
+                before = len(asset_refs(raw.decode()).union(*(asset_refs(f.read_text()) for f in fragments))) + len(fragments)
+                text, preload = bundle_index(data.decode(), src)
+                data = text.encode()
+                (out / "page").mkdir(exist_ok=True)
+                (out / "page" / "preload.txt").write_text("".join(f"/{p}\n" for p in preload))
+                print(f"index.html bundled, requests for a full UI visit: {1 + before} -> {1 + len(preload)}")
+            packed = gzip.compress(data, compresslevel=9, mtime=0)
+            if len(packed) < len(data):
+                dest.with_name(dest.name + ".gz").write_bytes(packed)
+                stored = len(packed)
+                flags += "g"
+            else:
+                dest.write_bytes(data)
+                stored = len(data)
+        else:
+            data = raw
+            dest.write_bytes(data)
+            stored = len(data)
+        manifest.append(f"/{rel} \"{content_hash(data)}\" {flags or '-'}")
+        total_raw += len(raw)
+        total_out += stored
+        print(f"{rel:<32}{len(raw):>10}{stored:>10}")
+    print(f"{'total':<32}{total_raw:>10}{total_out:>10}")
+    (out / "manifest.txt").write_text("\n".join(manifest) + "\n")
+    used, available = littlefs_blocks(out, args.block_size), args.fs_size // args.block_size
+    print(f"LittleFS blocks: {used} of {available} ({args.reserve} reserved for runtime files)")
+    if used + args.reserve > available:
+        print(f"error: the web assets don't fit the {args.fs_size:#x} byte LittleFS partition", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
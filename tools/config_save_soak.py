@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Posts /config/save bodies to a reader split into random TCP segments and checks the result.
+
+Every request re-posts the current value of one config field, so nothing actually changes on
+the device. The body is written in random slices with TCP_NODELAY so it reaches the reader in
+several segments. Free heap is taken from the telemetry `metrics` event on /events before and
+after the run (needs the telemetry interval to be enabled).
+
+Usage: config_save_soak.py --host 192.168.1.50 [--user admin --password password] [--count 1000]
+"""
+import argparse
+import base64
+import json
+import random
+import socket
+import time
+import urllib.request
+
+
+def auth_header(args):
+    return "Basic " + base64.b64encode(f"{args.user}:{args.password}".encode()).decode()
+
+
+def get_json(args, path):
+    req = urllib.request.Request(f"http://{args.host}{path}", headers={"Authorization": auth_header(args)})
+    with urllib.request.urlopen(req, timeout=10) as resp:
+        return json.loads(resp.read())
+
+
+def free_heap(args):
+    req = urllib.request.Request(f"http://{args.host}/events", headers={"Authorization": auth_header(args)})
+    with urllib.request.urlopen(req, timeout=120) as resp:
+        event = None
+        for line in resp:
+            line = line.decode().strip()
+            if line.startswith("event:"):
+                event = line[6:].strip()
+            elif line.startswith("data:") and event == "metrics":
+                return json.loads(line[5:])["hf"]
+
+
+def fragmented_post(args, path, body):
+    head = (f"POST {path} HTTP/1.1\r\nHost: {args.host}\r\nAuthorization: {auth_header(args)}\r\n"
+            f"Content-Type: application/json\r\nContent-Length: {len(body)}\r\nConnection: close\r\n\r\n").encode()
+    data = head + body
+    with socket.create_connection((args.host, 80), timeout=10) as sock:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        pos = 0
+        while pos < len(data):
+            step = random.randint(1, 64)
+            sock.sendall(data[pos:pos + step])
+            pos += step
+            time.sleep(random.uniform(0, 0.01))
+        response = b""
+        while chunk := sock.recv(1024):
+            response += chunk
+    return int(response.split(b" ", 2)[1])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--user", default="admin")
+    parser.add_argument("--password", default="password")
+    parser.add_argument("--count", type=int, default=1000)
+    parser.add_argument("--field", default="btrLowStatusThreshold")
+    args = parser.parse_args()
+
+    value = get_json(args, "/config?type=actions")[args.field]
+    # Padding with whitespace makes the body long enough to span many segments
+    body = json.dumps({args.field: value}).encode() + b" " * random.randint(200, 1500)
+    before = free_heap(args)
+    print(f"free heap before: {before}")
+    failures = 0
+    for i in range(args.count):
+        status = fragmented_post(args, "/config/save?type=actions", body)
+        if status != 200:
+            failures += 1
+            print(f"request {i}: HTTP {status}")
+    oversized = fragmented_post(args, "/config/save?type=actions", b" " * 8192)
+    print(f"{args.count} requests, {failures} failed, oversized body -> HTTP {oversized}")
+    after = free_heap(args)
+    print(f"free heap after: {after} ({after - before:+d})")
+    return 1 if failures or oversized != 413 else 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
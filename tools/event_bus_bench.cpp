@@ -0,0 +1,137 @@
+// Host benchmark for the event bus in main/include/event_bus.h.
+//
+// Producer threads publish events stamped with the publish time, one consumer thread per
+// subscriber waits on its wake hook and drains its ring. Prints the publish rate, the
+// publish-to-receive latency percentiles and the drops per subscriber. The device uses the same
+// bus with a portMUX lock, so the numbers are for comparing changes to the bus rather than
+// absolute.
+//
+// Build: g++ -std=c++17 -O2 -pthread -Imain/include tools/event_bus_bench.cpp -o event_bus_bench
+// Usage: event_bus_bench [producers=2] [subscribers=4] [events per producer=200000] [events/s per producer, 0=flat out]
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "event_bus.h"
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  // Same size as the device event
+  struct event_t {
+    uint8_t topic;
+    int64_t time;
+    uint8_t payload[40];
+  };
+
+  struct mutexLock_t {
+    std::mutex mutex;
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+  };
+
+  constexpr size_t maxSubscribers = 6;
+  constexpr size_t capacity = 16;
+  event_bus::Bus<event_t, mutexLock_t, maxSubscribers, capacity> bus;
+
+  struct consumer_t {
+    int id = -1;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool pending = false;
+    std::vector<int64_t> latencies;
+  };
+
+  int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+  }
+
+  void wake(void* arg) {
+    consumer_t* consumer = static_cast<consumer_t*>(arg);
+    {
+      std::lock_guard<std::mutex> guard(consumer->mutex);
+      consumer->pending = true;
+    }
+    consumer->wakeup.notify_one();
+  }
+
+  int64_t percentile(const std::vector<int64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * p))];
+  }
+}
+
+int main(int argc, char** argv) {
+  const int producers = argc > 1 ? atoi(argv[1]) : 2;
+  const int subscribers = std::min<int>(argc > 2 ? atoi(argv[2]) : 4, maxSubscribers);
+  const int perProducer = argc > 3 ? atoi(argv[3]) : 200000;
+  const int rate = argc > 4 ? atoi(argv[4]) : 0;
+
+  std::vector<consumer_t> consumers(subscribers);
+  for (auto& consumer : consumers) {
+    consumer.id = bus.subscribe("bench", 0xFFFFFFFF, wake, &consumer);
+    consumer.latencies.reserve(size_t(producers) * perProducer);
+  }
+
+  std::atomic<bool> done{ false };
+  std::vector<std::thread> threads;
+  for (auto& consumer : consumers) {
+    threads.emplace_back([&consumer, &done] {
+      event_t ev;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> guard(consumer.mutex);
+          consumer.wakeup.wait_for(guard, std::chrono::milliseconds(10), [&] { return consumer.pending; });
+          consumer.pending = false;
+        }
+        bool any = false;
+        while (bus.receive(consumer.id, ev)) {
+          consumer.latencies.push_back(nowNs() - ev.time);
+          any = true;
+        }
+        if (!any && done.load()) break;
+      }
+    });
+  }
+
+  const int64_t start = nowNs();
+  std::atomic<int64_t> publishNs{ 0 };
+  std::vector<std::thread> publishers;
+  for (int p = 0; p < producers; p++) {
+    publishers.emplace_back([perProducer, rate, p, &publishNs] {
+      event_t ev{};
+      const int64_t first = nowNs();
+      for (int i = 0; i < perProducer; i++) {
+        if (rate) {
+          const int64_t due = first + int64_t(i) * 1000000000 / rate;
+          while (nowNs() < due) std::this_thread::yield();
+        }
+        ev.topic = (p + i) % 6;
+        ev.time = nowNs();
+        bus.publish(ev);
+        publishNs.fetch_add(nowNs() - ev.time, std::memory_order_relaxed);
+      }
+    });
+  }
+  for (auto& t : publishers) t.join();
+  const int64_t elapsed = nowNs() - start;
+  done.store(true);
+  for (auto& t : threads) t.join();
+
+  const double published = double(producers) * perProducer;
+  printf("%d producers, %d subscribers, ring of %zu: %.0f events/s published, %.0f ns per publish\n",
+         producers, subscribers, capacity, published * 1e9 / elapsed, double(publishNs.load()) / published);
+  printf("%-4s %10s %10s %10s %10s %10s %6s\n", "sub", "received", "dropped", "p50 ns", "p99 ns", "max ns", "peak");
+  for (auto& consumer : consumers) {
+    auto stats = bus.stats(consumer.id);
+    std::sort(consumer.latencies.begin(), consumer.latencies.end());
+    printf("%-4d %10u %10u %10lld %10lld %10lld %6u\n", consumer.id, stats.received, stats.dropped,
+           (long long)percentile(consumer.latencies, 0.5), (long long)percentile(consumer.latencies, 0.99),
+           (long long)(consumer.latencies.empty() ? 0 : consumer.latencies.back()), stats.highWater);
+  }
+  return 0;
+}
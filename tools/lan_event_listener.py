@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Listens for HomeKey-ESP32 LAN event datagrams and reports delivery latency.
+
+The reader stamps each packet with its uptime in ms, so the one-way latency is
+estimated relative to the fastest packet seen so far (min offset), which removes
+the unknown clock offset between the reader and this host.
+
+Usage: lan_event_listener.py --group 239.255.42.1 --port 42420 --key <shared key>
+"""
+import argparse
+import hashlib
+import hmac
+import socket
+import struct
+import time
+
+PACKET = struct.Struct("<2sBBII8s6sBB16s")
+TYPES = {1: "TAP_SUCCESS", 2: "TAP_FAIL", 3: "TAG", 4: "LOCK_STATE"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--group", required=True)
+    parser.add_argument("--port", type=int, default=42420)
+    parser.add_argument("--key", default="")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", args.port))
+    mreq = struct.pack("4s4s", socket.inet_aton(args.group), socket.inet_aton("0.0.0.0"))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+    min_offset = None
+    last_seq = {}
+    latencies = []
+    while True:
+        data, addr = sock.recvfrom(64)
+        received = time.monotonic() * 1000
+        if len(data) != PACKET.size:
+            print(f"{addr[0]}: unexpected packet size {len(data)}")
+            continue
+        magic, version, kind, seq, uptime, issuer, endpoint, state, _, mac = PACKET.unpack(data)
+        if magic != b"HK" or version != 1:
+            continue
+        expected = hmac.new(args.key.encode(), data[:PACKET.size - 16], hashlib.sha256).digest()[:16]
+        if not hmac.compare_digest(mac, expected):
+            print(f"{addr[0]}: bad HMAC, seq {seq}")
+            continue
+        lost = ""
+        if addr[0] in last_seq and seq != last_seq[addr[0]] + 1:
+            lost = f" (lost {seq - last_seq[addr[0]] - 1})"
+        last_seq[addr[0]] = seq
+        offset = received - uptime
+        min_offset = offset if min_offset is None else min(min_offset, offset)
+        latency = offset - min_offset
+        latencies.append(latency)
+        latencies = latencies[-1000:]
+        ordered = sorted(latencies)
+        p99 = ordered[int(len(ordered) * 0.99) - 1] if len(ordered) >= 100 else ordered[-1]
+        print(f"{addr[0]} #{seq}{lost} {TYPES.get(kind, kind)} issuer={issuer.hex()} endpoint={endpoint.hex()} "
+              f"state={state} latency=+{latency:.1f}ms p50=+{ordered[len(ordered) // 2]:.1f}ms p99=+{p99:.1f}ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+// Host test for the lock state table in main/include/lock_fsm.h.
+//
+// Walks every source × event row, CMD_TOGGLE included, with the lock starting LOCKED and checks
+// the exact sequence handed to the characteristic, MQTT and actuator sinks. Each row runs three
+// times: with the GPIO controlling the lock, without it, and with the actuator queue full.
+//
+// Build: g++ -std=c++17 -O2 -Wall -Wextra -Imain/include tools/lock_fsm_test.cpp -o lock_fsm_test
+// Usage: lock_fsm_test, exits with 1 if a check failed
+#include <cstdio>
+#include <string>
+#include "lock_fsm.h"
+
+namespace {
+  int failures = 0;
+
+  // Every sink call in order: T<state> target, C<state> current, M<state> MQTT state,
+  // X<state> custom action, A<source>:<state> actuator
+  struct sinks_t
+  {
+    int currentState = lockStates::LOCKED;
+    int targetState = lockStates::LOCKED;
+    bool gpio = true;
+    bool queueFull = false;
+    std::string trace;
+
+    void add(const std::string& call) { trace += (trace.empty() ? "" : " ") + call; }
+    int current() { return currentState; }
+    int target() { return targetState; }
+    void setCurrent(int state) {
+      currentState = state;
+      add("C" + std::to_string(state));
+    }
+    void setTarget(int state) {
+      targetState = state;
+      add("T" + std::to_string(state));
+    }
+    void state(int state) { add("M" + std::to_string(state)); }
+    void custom(int state) { add("X" + std::to_string(state)); }
+    bool controls() { return gpio; }
+    bool lock(uint8_t source, int state) {
+      add("A" + std::to_string(source) + ":" + std::to_string(state));
+      return !queueFull;
+    }
+  };
+
+  const char* sourceNames[] = { "HOMEKIT", "HOMEKEY", "HTTP", "MQTT", "MQTT_CUSTOM", "ACTUATOR" };
+  const char* eventNames[] = { "CMD_UNLOCK", "CMD_LOCK", "IS_UNLOCKED", "IS_LOCKED", "IS_JAMMED", "IS_UNKNOWN", "", "CMD_TOGGLE" };
+  const lock_fsm::event_t events[] = { lock_fsm::CMD_UNLOCK, lock_fsm::CMD_LOCK, lock_fsm::IS_UNLOCKED, lock_fsm::IS_LOCKED, lock_fsm::IS_JAMMED, lock_fsm::IS_UNKNOWN, lock_fsm::CMD_TOGGLE };
+
+  // With the GPIO in control and room in the queue, LOCKED/LOCKED before each row. "-" is ignored
+  const char* expected[lock_fsm::SOURCE_COUNT][7] = {
+    /*                CMD_UNLOCK      CMD_LOCK   IS_UNLOCKED  IS_LOCKED  IS_JAMMED  IS_UNKNOWN  CMD_TOGGLE */
+    /* HOMEKIT */     { "A1:0 X0",    "A1:1 X1", "-",         "-",       "-",       "-",        "A1:0 X0" },
+    /* HOMEKEY */     { "T0 A2:0 X0", "A2:1 X1", "-",         "-",       "-",       "-",        "T0 A2:0 X0" },
+    /* HTTP */        { "T0 A3:0 X0", "A3:1 X1", "-",         "-",       "-",       "-",        "T0 A3:0 X0" },
+    /* MQTT */        { "T0 A1:0 X0", "A1:1 X1", "C0 M0",     "M1",      "C2 M2",   "C3 M3",    "T0 A1:0 X0" },
+    /* MQTT_CUSTOM */ { "T0 C4 M4",   "C5 M5",   "C0 M0",     "M1",      "C2 M2",   "C3 M3",    "T0 C4 M4" },
+    /* ACTUATOR */    { "-",          "-",       "T0 C0 M0",  "M1",      "-",       "-",        "-" },
+  };
+
+  // The same row when the command doesn't reach the actuator: UNLOCKING/LOCKING is reported instead
+  std::string withoutActuator(std::string trace, bool attempted) {
+    for (int state : { lockStates::UNLOCKED, lockStates::LOCKED }) {
+      for (int source = 1; source <= 3; source++) {
+        std::string call = "A" + std::to_string(source) + ":" + std::to_string(state);
+        size_t pos = trace.find(call);
+        if (pos == std::string::npos) continue;
+        int pending = state == lockStates::UNLOCKED ? lockStates::UNLOCKING : lockStates::LOCKING;
+        std::string replacement = "C" + std::to_string(pending) + " M" + std::to_string(pending);
+        trace.replace(pos, call.size(), attempted ? call + " " + replacement : replacement);
+      }
+    }
+    return trace;
+  }
+
+  void run(const char* mode, bool gpio, bool queueFull) {
+    for (int source = 0; source < lock_fsm::SOURCE_COUNT; source++) {
+      for (int e = 0; e < 7; e++) {
+        sinks_t sinks;
+        sinks.gpio = gpio;
+        sinks.queueFull = queueFull;
+        lock_fsm::result_t result = lock_fsm::handle(sinks, sinks, sinks, lock_fsm::source_t(source), events[e]);
+        std::string expect = expected[source][e];
+        if (expect != "-" && (!gpio || queueFull)) expect = withoutActuator(expect, gpio);
+        bool ignored = expect == "-";
+        bool queued = sinks.trace.find('A') != std::string::npos && !queueFull;
+        std::string got = result == lock_fsm::IGNORED ? "-" : sinks.trace;
+        if (got != expect || (result == lock_fsm::QUEUED) != queued || (ignored && !sinks.trace.empty())) {
+          printf("FAIL %s %s/%s: \"%s\" (result %d), expected \"%s\"\n", mode, sourceNames[source], eventNames[events[e]], got.c_str(), result, expect.c_str());
+          failures++;
+        }
+      }
+    }
+  }
+}
+
+int main() {
+  run("gpio", true, false);
+  run("no gpio", false, false);
+  run("queue full", true, true);
+
+  // CMD_TOGGLE follows the current state, not the target
+  sinks_t sinks;
+  sinks.currentState = lockStates::UNLOCKED;
+  lock_fsm::handle(sinks, sinks, sinks, lock_fsm::HOMEKEY, lock_fsm::CMD_TOGGLE);
+  if (sinks.trace != "A2:1 X1") {
+    printf("FAIL toggle while unlocked: \"%s\"\n", sinks.trace.c_str());
+    failures++;
+  }
+  if (lock_fsm::handle(sinks, sinks, sinks, lock_fsm::SOURCE_COUNT, lock_fsm::CMD_LOCK) != lock_fsm::IGNORED ||
+      lock_fsm::handle(sinks, sinks, sinks, lock_fsm::MQTT, lock_fsm::EVENT_COUNT) != lock_fsm::IGNORED) {
+    printf("FAIL out of range source/event not ignored\n");
+    failures++;
+  }
+  printf("%s\n", failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,201 @@
+// Host test for the lock output state machine in main/include/lock_output.h.
+//
+// First walks every row of the state table once and checks the pin writes and reports. Then
+// runs random interleavings of HomeKit, HomeKey, MQTT and HTTP commands with random gaps under
+// random settings, firing the deadline like the actuator task does, and checks after every step
+// that the pin, the reports, the phase and the deadline agree with each other.
+//
+// Build: g++ -std=c++17 -O2 -Wall -Wextra -Imain/include tools/lock_output_test.cpp -o lock_output_test
+// Usage: lock_output_test [seed] [steps=200000], exits with 1 if a check failed
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "lock_output.h"
+
+namespace {
+  // `gpioLockAction` sources, MQTT commands are handed over as HOMEKIT and the HTTP API as OTHER
+  enum : uint8_t { HOMEKIT = 1, HOMEKEY = 2, OTHER = 3 };
+  const uint8_t LOW = 0, HIGH = 1;
+
+  int failures = 0;
+
+  void check(bool ok, const std::string& what) {
+    if (!ok && failures++ < 20) printf("FAIL %s\n", what.c_str());
+  }
+
+  struct fakeIo_t
+  {
+    lock_output::config_t cfg{ 4, HIGH, LOW, 0, 2000, false };
+    int64_t clock = 0;
+    int level = -1; // -1 until the pin was written
+    bool restored = true;
+    int restores = 0;
+    std::string trace; // w<level> for pin writes, L/U for reports
+
+    lock_output::config_t config() { return cfg; }
+    int64_t now() { return clock; }
+    void write(uint8_t pin, uint8_t value) {
+      check(pin == cfg.pin, "write to the configured pin");
+      level = value;
+      trace += "w" + std::to_string(value);
+    }
+    void report(bool locked) { trace += locked ? "L" : "U"; }
+    bool restore() {
+      restores++;
+      return restored;
+    }
+  };
+
+  using machine_t = lock_output::Machine<fakeIo_t>;
+
+  // Runs `step` on a fresh machine already in `phase` and compares the trace it leaves
+  template <typename Step>
+  void row(const char* name, lock_output::phase_t phase, uint8_t momentary, Step step, const std::string& expect, lock_output::phase_t after) {
+    fakeIo_t io;
+    io.cfg.momentarySources = momentary;
+    machine_t m(io);
+    if (phase == lock_output::LOCK_STARTUP) m.start();
+    if (phase == lock_output::LOCK_HOLD) m.action(HOMEKEY, true);
+    io.trace.clear();
+    io.clock += 500000;
+    step(m);
+    check(io.trace == expect, std::string(name) + ": trace " + io.trace + ", expected " + expect);
+    check(m.phase() == after, std::string(name) + ": phase");
+    check((m.deadline() != 0) == (after != lock_output::LOCK_IDLE), std::string(name) + ": deadline");
+  }
+
+  void table() {
+    using namespace lock_output;
+    const uint8_t all = HOMEKIT | HOMEKEY;
+    row("STARTUP timeout", LOCK_STARTUP, 0, [](machine_t& m) { m.timeout(); }, "w1", LOCK_IDLE);
+    row("STARTUP action", LOCK_STARTUP, 0, [](machine_t& m) { m.action(HOMEKIT, true); }, "w0U", LOCK_IDLE);
+    row("IDLE momentary unlock", LOCK_IDLE, HOMEKEY, [](machine_t& m) { m.action(HOMEKEY, true); }, "w0U", LOCK_HOLD);
+    row("IDLE unlock", LOCK_IDLE, HOMEKEY, [](machine_t& m) { m.action(HOMEKIT, true); }, "w0U", LOCK_IDLE);
+    row("IDLE lock", LOCK_IDLE, all, [](machine_t& m) { m.action(HOMEKEY, false); }, "w1L", LOCK_IDLE);
+    row("HOLD momentary unlock", LOCK_HOLD, HOMEKEY, [](machine_t& m) { m.action(HOMEKEY, true); }, "", LOCK_HOLD);
+    row("HOLD unlock", LOCK_HOLD, HOMEKEY, [](machine_t& m) { m.action(HOMEKIT, true); }, "", LOCK_IDLE);
+    row("HOLD lock", LOCK_HOLD, HOMEKEY, [](machine_t& m) { m.action(HOMEKIT, false); }, "w1L", LOCK_IDLE);
+    row("HOLD timeout", LOCK_HOLD, HOMEKEY, [](machine_t& m) { m.timeout(); }, "w1L", LOCK_IDLE);
+
+    fakeIo_t io;
+    io.cfg.momentarySources = HOMEKEY;
+    machine_t m(io);
+    m.action(HOMEKEY, true);
+    io.clock += 1500000;
+    m.action(HOMEKEY, true);
+    check(m.deadline() == io.clock + 2000000, "a repeated momentary unlock restarts the hold");
+
+    io.cfg.pin = 255;
+    io.trace.clear();
+    machine_t off(io);
+    check(!off.action(HOMEKIT, true) && io.trace.empty(), "no pin, no dumb switch: ignored");
+    io.cfg.dumbSwitch = true;
+    check(!off.action(HOMEKIT, true) && io.trace == "U", "dumb switch without a pin reports the target");
+    off.start();
+    off.timeout();
+    check(io.restores == 0, "no pin: nothing restored at start-up");
+  }
+
+  const char* sourceName(uint8_t source) {
+    return source == HOMEKIT ? "homekit" : source == HOMEKEY ? "homekey" : "other";
+  }
+
+  // One boot: random settings, start-up, then `steps` random commands
+  void boot(std::mt19937& rng, uint32_t seed, size_t first, size_t steps) {
+    auto pick = [&rng](uint32_t n) { return uint32_t(rng() % n); };
+    fakeIo_t io;
+    io.cfg.pin = pick(8) == 0 ? 255 : 4;
+    io.cfg.lockLevel = pick(2);
+    io.cfg.unlockLevel = !io.cfg.lockLevel;
+    io.cfg.momentarySources = pick(4);
+    io.cfg.holdMs = 100 + pick(3000);
+    io.cfg.dumbSwitch = pick(2);
+    io.restored = pick(2);
+    machine_t m(io);
+    m.start();
+    int64_t lastMomentary = -1;
+    for (size_t i = first; i < first + steps; i++) {
+      char step[96];
+      io.trace.clear();
+      io.clock += pick(4) == 0 ? pick(4000) * 1000 : pick(200) * 1000;
+      // The actuator task fires the deadline before it takes the next command
+      if (m.deadline() && m.deadline() <= io.clock) {
+        lock_output::phase_t phase = m.phase();
+        m.timeout();
+        snprintf(step, sizeof(step), "step %zu seed %u: timeout in phase %d", i, seed, phase);
+        if (io.cfg.pin != 255) {
+          if (phase == lock_output::LOCK_STARTUP) {
+            check(io.trace == (io.restored ? "w" + std::to_string(io.cfg.lockLevel) : "w" + std::to_string(io.cfg.unlockLevel)), std::string(step) + " restores the pin");
+          } else {
+            check(io.trace == "w" + std::to_string(io.cfg.lockLevel) + "L", std::string(step) + " relocks, trace " + io.trace);
+          }
+        }
+        io.trace.clear();
+      }
+      check(m.deadline() == 0 || m.deadline() > io.clock, "deadline in the past");
+      const uint8_t sources[] = { HOMEKIT, HOMEKEY, HOMEKIT, OTHER }; // HomeKit, HomeKey, MQTT, HTTP
+      const uint8_t source = sources[pick(4)];
+      const bool unlock = pick(2);
+      const lock_output::phase_t before = m.phase();
+      const bool momentary = unlock && (io.cfg.momentarySources & source);
+      m.action(source, unlock);
+      snprintf(step, sizeof(step), "step %zu seed %u: %s %s in phase %d", i, seed, sourceName(source), unlock ? "unlock" : "lock", before);
+      const std::string lockW = "w" + std::to_string(io.cfg.lockLevel);
+      const std::string unlockW = "w" + std::to_string(io.cfg.unlockLevel);
+
+      if (io.cfg.pin == 255) {
+        check(io.trace == (io.cfg.dumbSwitch ? (unlock ? "U" : "L") : ""), std::string(step) + " without a pin, trace " + io.trace);
+        check(m.phase() == lock_output::LOCK_IDLE || (!io.cfg.dumbSwitch && before == m.phase()), std::string(step) + " without a pin stays idle");
+        continue;
+      }
+      // Every report follows a write of the matching level
+      for (size_t r = 0; r < io.trace.size(); r++) {
+        if (io.trace[r] != 'L' && io.trace[r] != 'U') continue;
+        const std::string& w = io.trace[r] == 'L' ? lockW : unlockW;
+        check(r >= 2 && io.trace.compare(r - 2, 2, w) == 0, std::string(step) + " report without its write, trace " + io.trace);
+      }
+      if (!unlock) {
+        check(io.level == io.cfg.lockLevel, std::string(step) + " leaves the pin unlocked");
+        check(io.trace == lockW + "L", std::string(step) + " lock trace " + io.trace);
+        check(m.phase() == lock_output::LOCK_IDLE && m.deadline() == 0, std::string(step) + " lock leaves a deadline");
+      } else {
+        check(io.level == io.cfg.unlockLevel, std::string(step) + " leaves the pin locked");
+        if (before == lock_output::LOCK_HOLD) {
+          check(io.trace.empty(), std::string(step) + " unlock during a hold reports, trace " + io.trace);
+        } else {
+          check(io.trace == unlockW + "U", std::string(step) + " unlock trace " + io.trace);
+        }
+      }
+      if (momentary) {
+        lastMomentary = io.clock;
+        check(m.phase() == lock_output::LOCK_HOLD && m.deadline() == io.clock + (int64_t)io.cfg.holdMs * 1000, std::string(step) + " momentary unlock holds");
+      } else if (unlock) {
+        check(m.phase() == lock_output::LOCK_IDLE && m.deadline() == 0, std::string(step) + " plain unlock holds");
+      }
+      if (m.phase() == lock_output::LOCK_HOLD) {
+        check(io.level == io.cfg.unlockLevel && lastMomentary >= 0 && m.deadline() == lastMomentary + (int64_t)io.cfg.holdMs * 1000, std::string(step) + " hold not from the last momentary unlock");
+      }
+    }
+  }
+
+  void randomized(uint32_t seed, size_t steps) {
+    std::mt19937 rng(seed);
+    const size_t perBoot = 5000;
+    for (size_t first = 0; first < steps; first += perBoot) {
+      boot(rng, seed, first, std::min(perBoot, steps - first));
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  uint32_t seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : std::random_device{}();
+  size_t steps = argc > 2 ? strtoul(argv[2], nullptr, 0) : 200000;
+  table();
+  randomized(seed, steps);
+  printf("%s (seed %u, %zu steps)\n", failures ? "FAILED" : "OK", seed, steps);
+  return failures ? 1 : 0;
+}
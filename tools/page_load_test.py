@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Times loading the reader's web UI the way a browser does.
+
+A cold load fetches the index page and every asset it references (or preloads through the `Link`
+header). A warm load repeats the requests with the ETags from the cold load, as a browser with a
+filled cache would. Each run uses a fresh connection per request, like the device sees most
+browsers. Prints the time to first byte of the index page, the time until every asset arrived and
+the bytes transferred, as the median and worst of `--runs` runs.
+
+Usage: page_load_test.py --host 192.168.1.50 [--user admin --password password] [--runs 10]
+"""
+import argparse
+import base64
+import http.client
+import re
+import statistics
+import time
+
+
+def fetch(args, path, etag=None):
+    headers = {"Accept-Encoding": "gzip"}
+    if args.user:
+        headers["Authorization"] = "Basic " + base64.b64encode(f"{args.user}:{args.password}".encode()).decode()
+    if etag:
+        headers["If-None-Match"] = etag
+    start = time.monotonic()
+    conn = http.client.HTTPConnection(args.host, args.port, timeout=10)
+    conn.request("GET", path, headers=headers)
+    resp = conn.getresponse()
+    ttfb = time.monotonic() - start
+    body = resp.read()
+    conn.close()
+    return resp, body, ttfb, time.monotonic() - start
+
+
+def referenced(resp, body):
+    paths = set(re.findall(rb'(?:src|href)="(/?assets/[\w.\-]+(?:\?v=\w+)?)"', body))
+    paths = {"/" + p.decode().lstrip("/") for p in paths}
+    for link in (resp.getheader("Link") or "").split(","):
+        m = re.match(r"\s*<([^>]+)>", link)
+        if m:
+            paths.add(m.group(1))
+    return sorted(paths)
+
+
+def load(args, etags):
+    start = time.monotonic()
+    resp, body, ttfb, _ = fetch(args, "/", etags.get("/"))
+    total_bytes, not_modified = len(body), int(resp.status == 304)
+    if resp.getheader("ETag"):
+        etags["/"] = resp.getheader("ETag")
+    assets = referenced(resp, body) if resp.status == 200 else etags.get("assets", [])
+    etags["assets"] = assets
+    for path in assets:
+        resp, body, _, _ = fetch(args, path, etags.get(path))
+        total_bytes += len(body)
+        not_modified += resp.status == 304
+        if resp.getheader("ETag"):
+            etags[path] = resp.getheader("ETag")
+    return ttfb * 1000, (time.monotonic() - start) * 1000, total_bytes, 1 + len(assets), not_modified
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--user", default="")
+    parser.add_argument("--password", default="")
+    parser.add_argument("--runs", type=int, default=10)
+    args = parser.parse_args()
+
+    print(f"{'load':<6}{'requests':>9}{'304':>5}{'bytes':>8}{'ttfb p50':>10}{'ttfb max':>10}{'load p50':>10}{'load max':>10}")
+    for name in ("cold", "warm"):
+        results = []
+        for _ in range(args.runs):
+            etags = {}
+            if name == "warm":
+                load(args, etags)
+            results.append(load(args, etags))
+        ttfb = [r[0] for r in results]
+        total = [r[1] for r in results]
+        _, _, size, requests, not_modified = results[-1]
+        print(f"{name:<6}{requests:>9}{not_modified:>5}{size:>8}{statistics.median(ttfb):>10.1f}{max(ttfb):>10.1f}"
+              f"{statistics.median(total):>10.1f}{max(total):>10.1f}")
+
+
+if __name__ == "__main__":
+    main()
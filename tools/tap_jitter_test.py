@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Measures tap latency jitter while the reader is loaded with web and MQTT traffic.
+
+Runs one phase per load profile (idle, web, mqtt, web+mqtt) of `--duration` seconds. Present a
+card repeatedly during each phase, or let a tap rig do it. The tap latency, from detection to the
+published result, is read from the `latency_us` field of the `tap` events on the /events stream.
+Web load comes from `--workers` connections fetching the UI in a loop. MQTT load is published to
+`--mqtt-topic` through the broker at `--mqtt-rate` messages per second. Use a topic the reader
+subscribes to, e.g. its battery level topic. The MQTT phases are skipped without `--broker`.
+
+Usage: tap_jitter_test.py --host 192.168.1.50 [--broker 192.168.1.10 --mqtt-topic <topic>] [--duration 60]
+"""
+import argparse
+import base64
+import http.client
+import json
+import socket
+import statistics
+import struct
+import threading
+import time
+
+PATHS = ["/", "/assets/misc.css", "/assets/logo-white.webp", "/fragment/mqtt.html", "/get_wifi_rssi"]
+
+
+def auth_headers(args):
+    if not args.user:
+        return {}
+    return {"Authorization": "Basic " + base64.b64encode(f"{args.user}:{args.password}".encode()).decode()}
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def web_worker(args, stop, counter, lock):
+    i = 0
+    while not stop.is_set():
+        try:
+            conn = http.client.HTTPConnection(args.host, 80, timeout=5)
+            conn.request("GET", PATHS[i % len(PATHS)], headers=auth_headers(args))
+            conn.getresponse().read()
+            conn.close()
+            with lock:
+                counter[0] += 1
+        except OSError:
+            pass
+        i += 1
+
+
+def mqtt_packet(kind, body):
+    length, encoded = len(body), b""
+    while True:
+        byte, length = length % 128, length // 128
+        encoded += bytes([byte | (0x80 if length else 0)])
+        if not length:
+            return bytes([kind]) + encoded + body
+
+
+def mqtt_string(text):
+    data = text.encode()
+    return struct.pack("!H", len(data)) + data
+
+
+def mqtt_worker(args, stop, counter, lock):
+    """Minimal MQTT 3.1.1 client publishing QoS 0 messages at `--mqtt-rate`."""
+    sock = socket.create_connection((args.broker, args.broker_port), timeout=5)
+    connect = mqtt_string("MQTT") + bytes([4, 0x02 | (0xC0 if args.mqtt_user else 0)]) + struct.pack("!H", 60)
+    connect += mqtt_string(f"tap-jitter-{int(time.time())}")
+    if args.mqtt_user:
+        connect += mqtt_string(args.mqtt_user) + mqtt_string(args.mqtt_password)
+    sock.sendall(mqtt_packet(0x10, connect))
+    if sock.recv(4)[3:4] != b"\x00":
+        raise SystemExit(f"MQTT connection to {args.broker} refused")
+    interval = 1 / args.mqtt_rate
+    due = time.monotonic()
+    while not stop.is_set():
+        sock.sendall(mqtt_packet(0x30, mqtt_string(args.mqtt_topic) + args.mqtt_payload.encode()))
+        with lock:
+            counter[0] += 1
+        due += interval
+        time.sleep(max(0, due - time.monotonic()))
+    sock.sendall(b"\xe0\x00")
+    sock.close()
+
+
+def tap_listener(args, conn, latencies, lock):
+    """Follows /events and collects the `latency_us` of every tap until `conn` is shut down."""
+    conn.request("GET", "/events", headers=auth_headers(args))
+    resp = conn.getresponse()
+    event = None
+    while True:
+        try:
+            raw = resp.fp.readline()
+        except OSError:
+            break
+        if not raw:
+            break
+        line = raw.decode(errors="replace").strip()
+        if line.startswith("event:"):
+            event = line[6:].strip()
+        elif line.startswith("data:") and event == "tap":
+            data = json.loads(line[5:])
+            if "latency_us" in data:
+                with lock:
+                    latencies.append(data["latency_us"] / 1000)
+                print(f"  tap {data['latency_us'] / 1000:.0f} ms")
+        elif not line:
+            event = None
+
+
+def run_phase(args, name, web, mqtt):
+    stop = threading.Event()
+    lock = threading.Lock()
+    latencies, web_count, mqtt_count = [], [0], [0]
+    events = http.client.HTTPConnection(args.host, 80)
+    threads = [threading.Thread(target=tap_listener, args=(args, events, latencies, lock))]
+    if web:
+        threads += [threading.Thread(target=web_worker, args=(args, stop, web_count, lock)) for _ in range(args.workers)]
+    if mqtt:
+        threads.append(threading.Thread(target=mqtt_worker, args=(args, stop, mqtt_count, lock)))
+    print(f"{name}: tap a card now, {args.duration:.0f} s")
+    for t in threads:
+        t.start()
+    time.sleep(args.duration)
+    stop.set()
+    if events.sock:
+        events.sock.shutdown(socket.SHUT_RDWR)
+    for t in threads:
+        t.join()
+    events.close()
+    jitter = statistics.pstdev(latencies) if latencies else float("nan")
+    return (f"{name:<10}{web_count[0] / args.duration:>8.1f}{mqtt_count[0] / args.duration:>8.1f}{len(latencies):>6}"
+            f"{percentile(latencies, 0.5):>8.0f}{percentile(latencies, 0.95):>8.0f}"
+            f"{max(latencies, default=float('nan')):>8.0f}{jitter:>8.1f}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--user", default="")
+    parser.add_argument("--password", default="")
+    parser.add_argument("--workers", type=int, default=8)
+    parser.add_argument("--broker")
+    parser.add_argument("--broker-port", type=int, default=1883)
+    parser.add_argument("--mqtt-user", default="")
+    parser.add_argument("--mqtt-password", default="")
+    parser.add_argument("--mqtt-topic")
+    parser.add_argument("--mqtt-payload", default="100")
+    parser.add_argument("--mqtt-rate", type=float, default=200)
+    parser.add_argument("--duration", type=float, default=60)
+    args = parser.parse_args()
+    if args.broker and not args.mqtt_topic:
+        parser.error("--broker needs --mqtt-topic")
+
+    phases = [("idle", False, False), ("web", True, False)]
+    if args.broker:
+        phases += [("mqtt", False, True), ("web+mqtt", True, True)]
+    rows = []
+    for name, web, mqtt in phases:
+        rows.append(run_phase(args, name, web, mqtt))
+        time.sleep(2)
+    print(f"{'phase':<10}{'req/s':>8}{'msg/s':>8}{'taps':>6}{'p50 ms':>8}{'p95 ms':>8}{'max ms':>8}{'jit ms':>8}")
+    for row in rows:
+        print(row)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Hammers the reader's web UI with increasing concurrency while probing HomeKit (HAP).
+
+Each step runs `--duration` seconds with N workers fetching the index page and assets in a
+loop. Meanwhile a probe opens a fresh connection to the HAP port every 250 ms and times an
+unauthenticated request (HAP answers it with 470 without needing a pairing). Per step it
+prints the web request rate, how many requests were refused by admission control, failures and
+the HAP latency percentiles, so the highest rate that keeps HAP responsive can be read off.
+
+Usage: web_load_test.py --host 192.168.1.50 [--steps 1,2,4,8,16] [--duration 20]
+"""
+import argparse
+import base64
+import http.client
+import threading
+import time
+
+PATHS = ["/", "/assets/misc.css", "/assets/logo-white.webp", "/fragment/mqtt.html", "/get_wifi_rssi"]
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def web_worker(args, stop, stats, lock):
+    headers = {}
+    if args.user:
+        headers["Authorization"] = "Basic " + base64.b64encode(f"{args.user}:{args.password}".encode()).decode()
+    i = 0
+    while not stop.is_set():
+        path = PATHS[i % len(PATHS)]
+        i += 1
+        try:
+            conn = http.client.HTTPConnection(args.host, 80, timeout=5)
+            conn.request("GET", path, headers=headers)
+            status = conn.getresponse().status
+            conn.close()
+        except (ConnectionResetError, BrokenPipeError):
+            # Refused connections get a 503 and are closed at once, sending the request may race that
+            status = 503
+        except OSError:
+            status = "error"
+        with lock:
+            stats[status] = stats.get(status, 0) + 1
+
+
+def hap_probe(args, stop, latencies, lock):
+    while not stop.is_set():
+        start = time.monotonic()
+        try:
+            conn = http.client.HTTPConnection(args.host, args.hap_port, timeout=5)
+            conn.request("GET", "/accessories")
+            conn.getresponse().read()
+            conn.close()
+            with lock:
+                latencies.append((time.monotonic() - start) * 1000)
+        except OSError:
+            with lock:
+                latencies.append(float("inf"))
+        time.sleep(0.25)
+
+
+def run_step(args, workers):
+    stop = threading.Event()
+    lock = threading.Lock()
+    stats, latencies = {}, []
+    threads = [threading.Thread(target=web_worker, args=(args, stop, stats, lock)) for _ in range(workers)]
+    threads.append(threading.Thread(target=hap_probe, args=(args, stop, latencies, lock)))
+    for t in threads:
+        t.start()
+    time.sleep(args.duration)
+    stop.set()
+    for t in threads:
+        t.join()
+    ok = sum(v for k, v in stats.items() if k in (200, 304))
+    busy = stats.get(503, 0)
+    failed = sum(stats.values()) - ok - busy
+    hap_failed = sum(1 for v in latencies if v == float("inf"))
+    hap = [v for v in latencies if v != float("inf")]
+    print(f"{workers:>7}{ok / args.duration:>10.1f}{busy:>8}{failed:>8}"
+          f"{percentile(hap, 0.5):>10.1f}{percentile(hap, 0.99):>10.1f}{hap_failed:>10}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", required=True)
+    parser.add_argument("--user", default="")
+    parser.add_argument("--password", default="")
+    parser.add_argument("--hap-port", type=int, default=1201)
+    parser.add_argument("--steps", default="1,2,4,8,16")
+    parser.add_argument("--duration", type=float, default=20)
+    args = parser.parse_args()
+
+    print(f"{'workers':>7}{'req/s':>10}{'refused':>8}{'failed':>8}{'hap p50':>10}{'hap p99':>10}{'hap fail':>10}")
+    for workers in (int(s) for s in args.steps.split(",")):
+        run_step(args, workers)
+        time.sleep(2)
+
+
+if __name__ == "__main__":
+    main()